@@ -0,0 +1,407 @@
+#include "async_avio_writer.h"
+
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <QFile>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+struct AsyncAvioWriter::FileHandle
+{
+    QString path;
+#ifdef Q_OS_WIN
+    QFile *file {nullptr};
+#else
+    int fd {-1};
+#endif
+    bool direct {false};
+};
+
+static uint8_t* aligned_alloc_buffer(size_t size)
+{
+#ifdef Q_OS_WIN
+    return static_cast<uint8_t*>(_aligned_malloc(size, ASYNC_WRITE_ALIGNMENT));
+#else
+    void *buffer = nullptr;
+    if (posix_memalign(&buffer, ASYNC_WRITE_ALIGNMENT, size) != 0)
+        return nullptr;
+    return static_cast<uint8_t*>(buffer);
+#endif
+}
+
+static void aligned_free_buffer(uint8_t *buffer)
+{
+#ifdef Q_OS_WIN
+    _aligned_free(buffer);
+#else
+    free(buffer);
+#endif
+}
+
+AsyncAvioWriter::AsyncAvioWriter(const AsyncWriterSettings &settings)
+    : m_settings(settings)
+    , m_bufferCount(std::max<int>(2, settings.memoryBudget / std::max(settings.bufferSize, ASYNC_WRITE_ALIGNMENT)))
+    , m_filled(m_bufferCount * 2 + 16)
+    , m_free(m_bufferCount)
+{
+    // Direct I/O wants whole, aligned blocks
+    m_settings.bufferSize = std::max(settings.bufferSize, ASYNC_WRITE_ALIGNMENT) / ASYNC_WRITE_ALIGNMENT * ASYNC_WRITE_ALIGNMENT;
+
+    m_buffers = new uint8_t*[m_bufferCount];
+    for (int i = 0; i < m_bufferCount; ++i)
+    {
+        m_buffers[i] = aligned_alloc_buffer(m_settings.bufferSize);
+        if (m_buffers[i])
+            m_free.push(i);
+    }
+
+    m_flusher = QThread::create([this] { run_flusher(); });
+    m_flusher->setObjectName("recorder flush");
+    m_flusher->start();
+}
+
+AsyncAvioWriter::~AsyncAvioWriter()
+{
+    closeFile();
+
+    m_quit = true;
+    m_filledSignal.release();
+    m_flusher->wait();
+    delete m_flusher;
+
+    for (int i = 0; i < m_bufferCount; ++i)
+        aligned_free_buffer(m_buffers[i]);
+    delete[] m_buffers;
+}
+
+AVIOContext* AsyncAvioWriter::openFile(const QString &path)
+{
+    closeFile();
+
+    FileHandle *file = new FileHandle;
+    file->path = path;
+
+#ifdef Q_OS_WIN
+    file->file = new QFile(path);
+    if (!file->file->open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        delete file->file;
+        delete file;
+        return nullptr;
+    }
+#else
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (m_settings.directIo)
+        flags |= O_DIRECT;
+#endif
+    file->fd = ::open(path.toStdString().c_str(), flags, 0644);
+#ifdef O_DIRECT
+    // Not every filesystem supports O_DIRECT
+    if (file->fd < 0 && (flags & O_DIRECT))
+        file->fd = ::open(path.toStdString().c_str(), flags & ~O_DIRECT, 0644);
+    else
+        file->direct = (flags & O_DIRECT) != 0;
+#endif
+    if (file->fd < 0)
+    {
+        delete file;
+        return nullptr;
+    }
+#ifdef F_NOCACHE
+    if (m_settings.directIo)
+    {
+        fcntl(file->fd, F_NOCACHE, 1);
+        file->direct = true;
+    }
+#endif
+#endif
+
+    unsigned char *avioBuffer = static_cast<unsigned char*>(av_malloc(AVIO_BUFFER_SIZE));
+    m_avio = avio_alloc_context(avioBuffer, AVIO_BUFFER_SIZE, 1, this, nullptr, write_packet, nullptr);
+    if (!m_avio)
+    {
+        av_free(avioBuffer);
+        finish_file(file);
+        return nullptr;
+    }
+    m_avio->seekable = 0;
+
+    m_file = file;
+    m_fileOffset = 0;
+    return m_avio;
+}
+
+void AsyncAvioWriter::closeFile()
+{
+    if (!m_file)
+        return;
+
+    avio_flush(m_avio);
+    av_freep(&m_avio->buffer);
+    avio_context_free(&m_avio);
+
+    if (m_current >= 0)
+        submit_current();
+
+    // The flusher closes the file after its last buffer
+    Block end;
+    end.file = m_file;
+    submit(end);
+    m_file = nullptr;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+int AsyncAvioWriter::write_packet(void *opaque, uint8_t *buf, int buf_size)
+#else
+int AsyncAvioWriter::write_packet(void *opaque, const uint8_t *buf, int buf_size)
+#endif
+{
+    static_cast<AsyncAvioWriter*>(opaque)->write(buf, buf_size);
+    return buf_size;
+}
+
+void AsyncAvioWriter::write(const uint8_t *data, int size)
+{
+    while (size > 0)
+    {
+        if (m_current < 0 && !acquire_buffer())
+            return;
+
+        int chunk = std::min(size, m_settings.bufferSize - m_currentLength);
+        memcpy(m_buffers[m_current] + m_currentLength, data, chunk);
+        m_currentLength += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if (m_currentLength == m_settings.bufferSize)
+            submit_current();
+    }
+
+    // Keep crash loss bounded on a quiet stream, direct I/O only writes whole blocks
+    if (m_current >= 0 && !m_file->direct && m_settings.flushIntervalMs > 0
+            && av_gettime_relative() - m_currentStartUs > m_settings.flushIntervalMs * 1000LL)
+        submit_current();
+}
+
+template<typename Ready>
+bool AsyncAvioWriter::wait_for_flusher(Ready ready)
+{
+    // Wake-ups left over from buffers taken without waiting
+    m_flushedSignal.tryAcquire(m_flushedSignal.available());
+    while (!ready())
+    {
+        if (m_quit)
+            return false;
+        m_flushedSignal.tryAcquire(1, ASYNC_WRITE_WAIT_MS);
+    }
+    return true;
+}
+
+bool AsyncAvioWriter::acquire_buffer()
+{
+    if (!m_free.pop(m_current))
+    {
+        // Memory budget exhausted, this is the only place the muxer waits on the disk.
+        // It sleeps until the flusher returns a buffer; the mux stage has its own thread
+        // and the demux thread drops packets meanwhile, so only the recording waits.
+        int64_t stallStartUs = av_gettime_relative();
+        m_stalls++;
+        bool acquired = wait_for_flusher([this] { return m_free.pop(m_current); });
+        m_stallTimeUs += av_gettime_relative() - stallStartUs;
+        if (!acquired)
+        {
+            m_current = -1;
+            return false;
+        }
+    }
+
+    m_currentLength = 0;
+    m_currentStartUs = av_gettime_relative();
+    return true;
+}
+
+void AsyncAvioWriter::submit_current()
+{
+    Block block;
+    block.buffer = m_current;
+    block.length = m_currentLength;
+    block.offset = m_fileOffset;
+    block.file = m_file;
+
+    m_fileOffset += m_currentLength;
+    m_current = -1;
+    m_currentLength = 0;
+    submit(block);
+}
+
+void AsyncAvioWriter::submit(const Block &block)
+{
+    // Sized for every buffer plus end markers, so this only waits if files are switched in a tight loop
+    if (!m_filled.push(block) && !wait_for_flusher([this, &block] { return m_filled.push(block); }))
+        return;
+    m_queueDepth++;
+    m_filledSignal.release();
+}
+
+void AsyncAvioWriter::run_flusher()
+{
+    Block batch[ASYNC_WRITE_BATCH];
+    Block carry;
+    bool hasCarry = false;
+
+    while (true)
+    {
+        Block first;
+        if (hasCarry)
+        {
+            first = carry;
+            hasCarry = false;
+        }
+        else if (!m_filled.pop(first))
+        {
+            if (m_quit)
+                break;
+            m_filledSignal.tryAcquire(1, 100);
+            continue;
+        }
+        m_queueDepth--;
+
+        if (first.buffer < 0)
+        {
+            finish_file(first.file);
+            m_flushedSignal.release();
+            continue;
+        }
+
+        // Gather buffers that continue the same file into one vectored write
+        int count = 0;
+        batch[count++] = first;
+        while (count < ASYNC_WRITE_BATCH)
+        {
+            Block next;
+            if (!m_filled.pop(next))
+                break;
+            const Block &last = batch[count - 1];
+            if (next.buffer >= 0 && next.file == last.file && next.offset == last.offset + last.length)
+            {
+                m_queueDepth--;
+                batch[count++] = next;
+            }
+            else
+            {
+                // Counted when it is taken from carry
+                carry = next;
+                hasCarry = true;
+                break;
+            }
+        }
+
+        write_batch(batch, count);
+
+        for (int i = 0; i < count; ++i)
+            m_free.push(batch[i].buffer);
+        m_flushedSignal.release();
+    }
+}
+
+void AsyncAvioWriter::write_batch(const Block *blocks, int count)
+{
+    FileHandle *file = blocks[0].file;
+    int64_t total = 0;
+    for (int i = 0; i < count; ++i)
+        total += blocks[i].length;
+
+    int64_t startUs = av_gettime_relative();
+
+#ifdef Q_OS_WIN
+    bool ok = file->file->seek(blocks[0].offset);
+    for (int i = 0; ok && i < count; ++i)
+        ok = file->file->write(reinterpret_cast<const char*>(m_buffers[blocks[i].buffer]), blocks[i].length) == blocks[i].length;
+    if (!ok)
+        m_writeErrors++;
+#else
+#ifdef O_DIRECT
+    // A partial tail cannot go through O_DIRECT, finish the file buffered
+    if (file->direct && total % ASYNC_WRITE_ALIGNMENT != 0)
+    {
+        fcntl(file->fd, F_SETFL, fcntl(file->fd, F_GETFL) & ~O_DIRECT);
+        file->direct = false;
+    }
+#endif
+
+    struct iovec iov[ASYNC_WRITE_BATCH];
+    for (int i = 0; i < count; ++i)
+    {
+        iov[i].iov_base = m_buffers[blocks[i].buffer];
+        iov[i].iov_len = blocks[i].length;
+    }
+
+    ssize_t written = pwritev(file->fd, iov, count, blocks[0].offset);
+    if (written < 0)
+        written = 0;
+
+    // Short write: finish the rest block by block
+    int64_t done = 0;
+    for (int i = 0; i < count && written < total; ++i)
+    {
+        int64_t end = done + blocks[i].length;
+        while (written < end)
+        {
+            int64_t inBlock = written - done;
+            ssize_t ret = pwrite(file->fd, m_buffers[blocks[i].buffer] + inBlock,
+                                 blocks[i].length - inBlock, blocks[0].offset + written);
+            if (ret <= 0)
+            {
+                m_writeErrors++;
+                qWarning() << "recorder write failed" << file->path;
+                written = total;
+                break;
+            }
+            written += ret;
+        }
+        done = end;
+    }
+#endif
+
+    m_bytesWritten += total;
+    m_writeTimeUs += av_gettime_relative() - startUs;
+}
+
+void AsyncAvioWriter::finish_file(FileHandle *file)
+{
+#ifdef Q_OS_WIN
+    file->file->close();
+    delete file->file;
+#else
+    ::close(file->fd);
+#endif
+    delete file;
+}
+
+AsyncWriterStats AsyncAvioWriter::stats() const
+{
+    AsyncWriterStats stats;
+    stats.queueDepth = m_queueDepth;
+    stats.bufferCount = m_bufferCount;
+    stats.bytesWritten = m_bytesWritten;
+    qint64 writeTimeUs = m_writeTimeUs;
+    if (writeTimeUs > 0)
+        stats.throughputMBps = (double)stats.bytesWritten / writeTimeUs;
+    stats.stalls = m_stalls;
+    stats.stallTimeUs = m_stallTimeUs;
+    stats.writeErrors = m_writeErrors;
+    return stats;
+}
@@ -0,0 +1,123 @@
+#ifndef ASYNC_AVIO_WRITER_H
+#define ASYNC_AVIO_WRITER_H
+
+#include <atomic>
+
+#include <QSemaphore>
+#include <QString>
+#include <QThread>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include "spsc_queue.h"
+
+#define ASYNC_WRITE_BUFFER_SIZE     (1024 * 1024)
+#define ASYNC_WRITE_MEMORY_BUDGET   (64 * 1024 * 1024)
+#define ASYNC_WRITE_FLUSH_MS        500
+#define ASYNC_WRITE_BATCH           16
+#define ASYNC_WRITE_ALIGNMENT       4096
+#define ASYNC_WRITE_WAIT_MS         100     // re-checks m_quit while waiting for the flusher
+#define AVIO_BUFFER_SIZE            (64 * 1024)
+
+struct AsyncWriterSettings
+{
+    bool enabled {true};
+    int bufferSize {ASYNC_WRITE_BUFFER_SIZE};
+    int64_t memoryBudget {ASYNC_WRITE_MEMORY_BUDGET};
+    bool directIo {false};                      // O_DIRECT on Linux, F_NOCACHE on macOS
+    int flushIntervalMs {ASYNC_WRITE_FLUSH_MS}; // partial buffers older than this are written, not with directIo
+};
+
+struct AsyncWriterStats
+{
+    int queueDepth {0};
+    int bufferCount {0};
+    quint64 bytesWritten {0};
+    double throughputMBps {0};
+    quint64 stalls {0};
+    qint64 stallTimeUs {0};
+    quint64 writeErrors {0};
+};
+
+// Write-behind AVIOContext for the recorder.
+// The muxer copies into a ring of aligned buffers and returns immediately; a
+// flusher thread writes full buffers in batches with pwritev. The muxer only
+// waits when every buffer of the memory budget is queued for the disk.
+// Switching files does not wait either: the old file is closed by the flusher
+// once its last buffer is written.
+class AsyncAvioWriter
+{
+public:
+    explicit AsyncAvioWriter(const AsyncWriterSettings &settings);
+    ~AsyncAvioWriter();
+
+    AsyncAvioWriter(const AsyncAvioWriter&) = delete;
+    AsyncAvioWriter& operator=(const AsyncAvioWriter&) = delete;
+
+    // Returns an AVIOContext writing to path, valid until closeFile()
+    AVIOContext* openFile(const QString &path);
+    // Flushes the AVIOContext and hands the tail to the flusher
+    void closeFile();
+
+    // Bytes written by the muxer to the current file so far
+    int64_t fileBytes() const { return m_fileOffset + m_currentLength; }
+    AsyncWriterStats stats() const;
+
+private:
+    struct FileHandle;
+
+    struct Block
+    {
+        int buffer {-1};            // -1 marks the end of file
+        int length {0};
+        int64_t offset {0};
+        FileHandle *file {nullptr};
+    };
+
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+    static int write_packet(void *opaque, uint8_t *buf, int buf_size);
+#else
+    static int write_packet(void *opaque, const uint8_t *buf, int buf_size);
+#endif
+    void write(const uint8_t *data, int size);
+    template<typename Ready>
+    bool wait_for_flusher(Ready ready);
+    bool acquire_buffer();
+    void submit_current();
+    void submit(const Block &block);
+
+    void run_flusher();
+    void write_batch(const Block *blocks, int count);
+    void finish_file(FileHandle *file);
+
+    AsyncWriterSettings m_settings;
+    int m_bufferCount {0};
+    uint8_t **m_buffers {nullptr};
+
+    // Producer state, owned by the muxer thread
+    AVIOContext *m_avio {nullptr};
+    FileHandle *m_file {nullptr};
+    int m_current {-1};
+    int m_currentLength {0};
+    int64_t m_currentStartUs {0};
+    int64_t m_fileOffset {0};
+
+    SpscQueue<Block> m_filled;      // muxer -> flusher
+    SpscQueue<int> m_free;          // flusher -> muxer
+    QSemaphore m_filledSignal;
+    QSemaphore m_flushedSignal;     // flusher -> muxer, blocks taken off m_filled
+    QThread *m_flusher {nullptr};
+    std::atomic<bool> m_quit {false};
+
+    std::atomic<int> m_queueDepth {0};
+    std::atomic<quint64> m_bytesWritten {0};
+    std::atomic<qint64> m_writeTimeUs {0};
+    std::atomic<quint64> m_stalls {0};
+    std::atomic<qint64> m_stallTimeUs {0};
+    std::atomic<quint64> m_writeErrors {0};
+};
+
+#endif // ASYNC_AVIO_WRITER_H
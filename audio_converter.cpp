@@ -0,0 +1,212 @@
+#include "audio_converter.h"
+
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+
+extern "C"
+{
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+}
+
+AudioConverter::AudioConverter()
+{
+}
+
+AudioConverter::~AudioConverter()
+{
+    reset();
+}
+
+void AudioConverter::reset()
+{
+    free_context();
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+    m_convertTime.reset();
+}
+
+void AudioConverter::free_context()
+{
+    swr_free(&m_swr);
+    m_inFormat = -1;
+    m_inRate = 0;
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    m_inLayout = 0;
+#else
+    av_channel_layout_uninit(&m_inLayout);
+#endif
+}
+
+void AudioConverter::setOutput(AVSampleFormat format, int channels, int sampleRate)
+{
+    // Playout writes one interleaved buffer
+    format = av_get_packed_sample_fmt(format);
+    channels = std::max(1, channels);
+    sampleRate = std::max(0, sampleRate);
+    if (format == m_outFormat && channels == m_outChannels && sampleRate == m_outRate)
+        return;
+
+    m_outFormat = format;
+    m_outChannels = channels;
+    m_outRate = sampleRate;
+    m_outChanged = true;
+}
+
+void AudioConverter::setDriftCompensation(bool enabled)
+{
+    if (enabled == m_compensate)
+        return;
+    m_compensate = enabled;
+    m_outChanged = true;
+}
+
+void AudioConverter::setRateCorrection(double ppm)
+{
+    m_correctionPpm = ppm;
+    apply_correction();
+}
+
+void AudioConverter::apply_correction()
+{
+    if (!m_swr || !m_compensate)
+        return;
+
+    // Spread over a long distance so that a step of a few ppm is still whole samples
+    const int distance = m_builtOutRate * AUDIO_COMPENSATION_SECONDS;
+    const int delta = static_cast<int>(std::lround(-m_correctionPpm * distance / 1e6));
+    if (swr_set_compensation(m_swr, delta, distance) < 0)
+        return;
+    m_appliedPpm = -1e6 * delta / distance;
+}
+
+int AudioConverter::bytesPerFrame() const
+{
+    return av_get_bytes_per_sample(m_outFormat) * m_outChannels;
+}
+
+bool AudioConverter::update_context(const AVFrame *frame)
+{
+    const int inRate = frame->sample_rate;
+
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    // Some decoders only set the channel count
+    uint64_t inLayout = frame->channel_layout ? frame->channel_layout
+                                              : av_get_default_channel_layout(frame->channels);
+    if (m_swr && !m_outChanged && frame->format == m_inFormat && inRate == m_inRate && inLayout == m_inLayout)
+        return true;
+#else
+    // Some decoders only set the channel count
+    AVChannelLayout inLayout {};
+    if (frame->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+        av_channel_layout_default(&inLayout, frame->ch_layout.nb_channels);
+    else
+        av_channel_layout_copy(&inLayout, &frame->ch_layout);
+    if (m_swr && !m_outChanged && frame->format == m_inFormat && inRate == m_inRate
+            && av_channel_layout_compare(&inLayout, &m_inLayout) == 0)
+    {
+        av_channel_layout_uninit(&inLayout);
+        return true;
+    }
+#endif
+
+    free_context();
+    const int outRate = m_outRate > 0 ? m_outRate : inRate;
+
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    m_swr = swr_alloc_set_opts(nullptr, av_get_default_channel_layout(m_outChannels), m_outFormat, outRate,
+                               inLayout, static_cast<AVSampleFormat>(frame->format), inRate, 0, nullptr);
+#else
+    AVChannelLayout outLayout {};
+    av_channel_layout_default(&outLayout, m_outChannels);
+    if (swr_alloc_set_opts2(&m_swr, &outLayout, m_outFormat, outRate,
+                            &inLayout, static_cast<AVSampleFormat>(frame->format), inRate, 0, nullptr) < 0)
+        swr_free(&m_swr);
+    av_channel_layout_uninit(&outLayout);
+#endif
+
+    // Without the flag swresample drops the resampler at equal rates and compensation would reinit it
+    if (m_swr && m_compensate)
+        av_opt_set_int(m_swr, "flags", SWR_FLAG_RESAMPLE, 0);
+
+    if (!m_swr || swr_init(m_swr) < 0)
+    {
+        qDebug() << "audio: no swresample context for" << av_get_sample_fmt_name(static_cast<AVSampleFormat>(frame->format))
+                 << inRate << "Hz";
+        swr_free(&m_swr);
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 0, 0)
+        av_channel_layout_uninit(&inLayout);
+#endif
+        return false;
+    }
+
+    m_inFormat = frame->format;
+    m_inRate = inRate;
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    m_inLayout = inLayout;
+    m_inputChannels = frame->channels;
+#else
+    m_inLayout = inLayout;
+    m_inputChannels = inLayout.nb_channels;
+#endif
+    m_outChanged = false;
+    m_inputFormat = av_get_sample_fmt_name(static_cast<AVSampleFormat>(frame->format));
+    m_inputRate = inRate;
+    m_builtOutRate = outRate;
+    m_outputRate = outRate;
+    m_appliedPpm = 0;
+    m_contextRebuilds++;
+    apply_correction();
+    return true;
+}
+
+bool AudioConverter::convert(const AVFrame *frame, const uint8_t *&data, int &bytes)
+{
+    int64_t startUs = av_gettime_relative();
+    data = nullptr;
+    bytes = 0;
+
+    if (!frame || frame->nb_samples <= 0 || !update_context(frame))
+        return false;
+
+    // Upper bound, includes whatever the resampler still holds
+    const int outSamples = swr_get_out_samples(m_swr, frame->nb_samples);
+    if (outSamples < 0)
+        return false;
+    const size_t needed = static_cast<size_t>(outSamples) * bytesPerFrame();
+    if (needed > m_buffer.size())
+    {
+        m_buffer.resize(needed);
+        m_bufferAllocations++;
+    }
+
+    uint8_t *out[1] = { m_buffer.data() };
+    int converted = swr_convert(m_swr, out, outSamples,
+                                const_cast<const uint8_t**>(frame->extended_data), frame->nb_samples);
+    if (converted < 0)
+        return false;
+
+    data = m_buffer.data();
+    bytes = converted * bytesPerFrame();
+
+    m_convertTime.add(static_cast<double>(av_gettime_relative() - startUs));
+    m_convertTimeUs = m_convertTime.mean();
+    m_framesConverted++;
+    return true;
+}
+
+AudioConverterStats AudioConverter::stats() const
+{
+    AudioConverterStats stats;
+    stats.framesConverted = m_framesConverted;
+    stats.contextRebuilds = m_contextRebuilds;
+    stats.bufferAllocations = m_bufferAllocations;
+    stats.convertTimeUs = m_convertTimeUs;
+    stats.inputFormat = m_inputFormat;
+    stats.inputChannels = m_inputChannels;
+    stats.inputRate = m_inputRate;
+    stats.outputRate = m_outputRate;
+    stats.correctionPpm = m_appliedPpm;
+    return stats;
+}
@@ -0,0 +1,105 @@
+#ifndef AUDIO_CONVERTER_H
+#define AUDIO_CONVERTER_H
+
+#include <atomic>
+#include <vector>
+
+#include <QStringList>
+
+extern "C"
+{
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+
+#include "rolling_average.h"
+
+#define AUDIO_COMPENSATION_SECONDS  10
+
+struct AudioConverterStats
+{
+    quint64 framesConverted {0};
+    quint64 contextRebuilds {0};
+    quint64 bufferAllocations {0};
+    double convertTimeUs {0};
+    const char *inputFormat {""};   // av_get_sample_fmt_name() of the last input
+    int inputChannels {0};
+    int inputRate {0};
+    int outputRate {0};
+    double correctionPpm {0};
+};
+
+// Decoded audio of any sample format and channel layout to one packed format for playout.
+// The SwrContext is kept until the input format, layout or rate or the output changes,
+// so swresample's SIMD paths run on every frame without a setup cost, and the samples
+// land in one buffer that only grows. Playout resamples to the device rate and
+// trims that rate by a few ppm against clock drift through swr_set_compensation.
+// Only the audio stage calls convert() and the setters, stats() is safe anywhere.
+class AudioConverter
+{
+public:
+    AudioConverter();
+    ~AudioConverter();
+
+    AudioConverter(const AudioConverter&) = delete;
+    AudioConverter& operator=(const AudioConverter&) = delete;
+
+    // Packed output with the default layout for channels, sampleRate 0 keeps the input rate.
+    // Applied to the next frame.
+    void setOutput(AVSampleFormat format, int channels, int sampleRate = 0);
+    AVSampleFormat outputFormat() const { return m_outFormat; }
+    int outputChannels() const { return m_outChannels; }
+    // Bytes of one sample in all output channels
+    int bytesPerFrame() const;
+
+    // Keeps the resampler in the path even at equal rates, so that the rate can be nudged
+    void setDriftCompensation(bool enabled);
+    // Positive plays faster: fewer output samples per input second. Applied at once.
+    void setRateCorrection(double ppm);
+
+    // The converted samples stay valid until the next call
+    bool convert(const AVFrame *frame, const uint8_t *&data, int &bytes);
+    // Frees the context and the buffer, the next frame starts over
+    void reset();
+
+    AudioConverterStats stats() const;
+
+private:
+    bool update_context(const AVFrame *frame);
+    void free_context();
+    void apply_correction();
+
+    SwrContext *m_swr {nullptr};
+    int m_inFormat {-1};
+    int m_inRate {0};
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+    uint64_t m_inLayout {0};
+#else
+    AVChannelLayout m_inLayout {};
+#endif
+
+    AVSampleFormat m_outFormat {AV_SAMPLE_FMT_S16};
+    int m_outChannels {2};
+    int m_outRate {0};
+    int m_builtOutRate {0};
+    bool m_outChanged {true};
+    bool m_compensate {false};
+    double m_correctionPpm {0};
+
+    std::vector<uint8_t> m_buffer;
+    RollingAverage m_convertTime;
+
+    std::atomic<quint64> m_framesConverted {0};
+    std::atomic<quint64> m_contextRebuilds {0};
+    std::atomic<quint64> m_bufferAllocations {0};
+    std::atomic<double> m_convertTimeUs {0};
+    std::atomic<const char*> m_inputFormat {""};
+    std::atomic<int> m_inputChannels {0};
+    std::atomic<int> m_inputRate {0};
+    std::atomic<int> m_outputRate {0};
+    std::atomic<double> m_appliedPpm {0};
+};
+
+#endif // AUDIO_CONVERTER_H
@@ -0,0 +1,249 @@
+#include "audio_playout.h"
+
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+PlayoutDevice::PlayoutDevice(QObject *parent)
+    : QIODevice{parent}
+{
+}
+
+void PlayoutDevice::configure(const QAudioFormat &format, int targetMs)
+{
+    // Nobody reads while the sink is stopped, so the old ring can be emptied from here
+    const size_t capacity = static_cast<size_t>(format.bytesForDuration(PLAYOUT_RING_MS * 1000));
+    if (!m_ring || m_ring->capacity() < capacity)
+        m_ring.reset(new SpscQueue<char>(capacity));
+    else
+        m_ring->skip(m_ring->capacity());
+
+    m_format = format;
+    m_bytesPerSecond = format.bytesForDuration(1000000);
+    m_bufferedBytes = 0;
+    m_pushedBytes = 0;
+    m_ptsOriginUs = AV_NOPTS_VALUE;
+    m_readBytes = 0;
+    m_readAtUs = 0;
+    m_baseTargetMs = std::clamp(targetMs, 1, PLAYOUT_MAX_TARGET_MS);
+    m_targetMs = m_baseTargetMs;
+    m_buffering = true;
+    m_lastUnderrunUs = av_gettime_relative();
+}
+
+qint64 PlayoutDevice::push(const char *data, qint64 bytes, int64_t ptsEndUs)
+{
+    if (!m_ring || bytes <= 0)
+        return 0;
+
+    // Conservative from this side, the sink may have made more room meanwhile
+    if (m_ring->capacity() - m_ring->size() < static_cast<size_t>(bytes))
+    {
+        m_overruns++;
+        m_droppedBytes += bytes;
+        return 0;
+    }
+    qint64 written = static_cast<qint64>(m_ring->write(data, static_cast<size_t>(bytes)));
+    m_pushedBytes += written;
+    const int bytesPerSecond = m_bytesPerSecond;
+    if (ptsEndUs != AV_NOPTS_VALUE && bytesPerSecond > 0)
+        m_ptsOriginUs = ptsEndUs - av_rescale(m_pushedBytes, 1000000, bytesPerSecond);
+    return written;
+}
+
+int64_t PlayoutDevice::readPtsUs(int64_t nowUs, int64_t maxElapsedUs) const
+{
+    const int64_t originUs = m_ptsOriginUs;
+    const int bytesPerSecond = m_bytesPerSecond;
+    const int64_t readAtUs = m_readAtUs;
+    if (originUs == AV_NOPTS_VALUE || bytesPerSecond <= 0 || readAtUs == 0 || m_buffering)
+        return AV_NOPTS_VALUE;
+    return originUs + av_rescale(m_readBytes, 1000000, bytesPerSecond) + std::min(nowUs - readAtUs, maxElapsedUs);
+}
+
+qint64 PlayoutDevice::bytesAvailable() const
+{
+    return (m_ring ? static_cast<qint64>(m_ring->size()) : 0) + QIODevice::bytesAvailable();
+}
+
+void PlayoutDevice::fill_silence(char *data, qint64 bytes) const
+{
+    // Unsigned 8-bit samples are centred on 128
+    memset(data, m_format.sampleFormat() == QAudioFormat::UInt8 ? 0x80 : 0, static_cast<size_t>(bytes));
+}
+
+double PlayoutDevice::to_ms(quint64 bytes) const
+{
+    const int bytesPerSecond = m_bytesPerSecond;
+    return bytesPerSecond > 0 ? bytes * 1000.0 / bytesPerSecond : 0;
+}
+
+qint64 PlayoutDevice::readData(char *data, qint64 maxSize)
+{
+    const int frameBytes = m_format.bytesPerFrame();
+    if (!m_ring || frameBytes <= 0)
+        return 0;
+    maxSize -= maxSize % frameBytes;
+    if (maxSize <= 0)
+        return 0;
+
+    if (m_paused)
+    {
+        fill_silence(data, maxSize);
+        return maxSize;
+    }
+
+    const int64_t nowUs = av_gettime_relative();
+    const int targetMs = m_targetMs;
+    const size_t targetBytes = static_cast<size_t>(m_format.bytesForDuration(targetMs * 1000));
+    size_t buffered = m_ring->size();
+
+    // Silence keeps the device clock running while the buffer fills
+    if (m_buffering)
+    {
+        if (buffered < targetBytes)
+        {
+            fill_silence(data, maxSize);
+            return maxSize;
+        }
+        m_buffering = false;
+    }
+
+    // A burst after a stall would otherwise stay as extra latency for the rest of the stream
+    if (buffered > 2 * targetBytes + static_cast<size_t>(maxSize))
+    {
+        size_t excess = buffered - targetBytes;
+        excess -= excess % frameBytes;
+        size_t skipped = m_ring->skip(excess);
+        m_trimmedBytes += skipped;
+        m_readBytes += skipped;
+    }
+
+    qint64 read = static_cast<qint64>(m_ring->read(data, static_cast<size_t>(maxSize)));
+    m_bufferedBytes = m_ring->size();
+    m_readBytes += read;
+    m_readAtUs = nowUs;
+    if (read < maxSize)
+    {
+        fill_silence(data + read, maxSize - read);
+        m_underruns++;
+        m_buffering = true;
+        m_targetMs = std::min(targetMs + PLAYOUT_TARGET_STEP_MS, PLAYOUT_MAX_TARGET_MS);
+        m_lastUnderrunUs = nowUs;
+    }
+    else if (targetMs > m_baseTargetMs && nowUs - m_lastUnderrunUs > PLAYOUT_SETTLE_SECONDS * 1000000LL)
+    {
+        // The network has been calm for a while, give some latency back
+        m_targetMs = std::max(targetMs - PLAYOUT_TARGET_STEP_MS, m_baseTargetMs);
+        m_lastUnderrunUs = nowUs;
+    }
+    return maxSize;
+}
+
+qint64 PlayoutDevice::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
+
+PlayoutStats PlayoutDevice::stats() const
+{
+    PlayoutStats stats;
+    stats.buffering = m_buffering;
+    stats.underruns = m_underruns;
+    stats.overruns = m_overruns;
+    stats.droppedMs = to_ms(m_droppedBytes);
+    stats.trimmedMs = to_ms(m_trimmedBytes);
+    stats.bufferedMs = to_ms(m_bufferedBytes);
+    stats.targetMs = m_targetMs;
+    return stats;
+}
+
+AudioPlayout::AudioPlayout()
+{
+    m_thread.setObjectName("audio playout");
+    m_device = new PlayoutDevice;
+    m_device->moveToThread(&m_thread);
+}
+
+AudioPlayout::~AudioPlayout()
+{
+    stop();
+    m_thread.quit();
+    m_thread.wait();
+    delete m_device;
+}
+
+bool AudioPlayout::start(const QAudioDevice &device, const QAudioFormat &format, qint64 sinkBufferBytes, int targetMs)
+{
+    stop();
+    m_device->configure(format, targetMs);
+    if (!m_thread.isRunning())
+        m_thread.start(QThread::TimeCriticalPriority);
+
+    // The sink has to be created on the thread whose event loop drives it
+    bool started = false;
+    QMetaObject::invokeMethod(m_device, [this, &device, &format, sinkBufferBytes, &started] {
+        m_sink = new QAudioSink(device, format);
+        m_sink->setBufferSize(sinkBufferBytes);
+        m_device->open(QIODevice::ReadOnly);
+        m_sink->start(m_device);
+        started = m_sink->error() == QAudio::NoError;
+        m_sinkBufferMs = format.durationForBytes(m_sink->bufferSize()) / 1000.0;
+    }, Qt::BlockingQueuedConnection);
+
+    if (!started)
+    {
+        qWarning() << "Audio playout could not start on" << device.description();
+        stop();
+    }
+    m_running = started;
+    return started;
+}
+
+void AudioPlayout::stop()
+{
+    m_running = false;
+    if (!m_thread.isRunning())
+        return;
+
+    QMetaObject::invokeMethod(m_device, [this] {
+        if (m_sink)
+        {
+            m_sink->stop();
+            delete m_sink;
+            m_sink = nullptr;
+        }
+        m_device->close();
+    }, Qt::BlockingQueuedConnection);
+}
+
+qint64 AudioPlayout::push(const char *data, qint64 bytes, int64_t ptsEndUs)
+{
+    return m_running ? m_device->push(data, bytes, ptsEndUs) : 0;
+}
+
+int64_t AudioPlayout::clockUs() const
+{
+    if (!m_running)
+        return AV_NOPTS_VALUE;
+    // What left the ring is heard once the sink's buffer in front of it has played.
+    // Between pulls the sink drains, but never further than what it held.
+    const int64_t sinkUs = static_cast<int64_t>(m_sinkBufferMs * 1000);
+    const int64_t readUs = m_device->readPtsUs(av_gettime_relative(), sinkUs);
+    return readUs == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : readUs - sinkUs;
+}
+
+PlayoutStats AudioPlayout::stats() const
+{
+    PlayoutStats stats = m_device->stats();
+    stats.running = m_running;
+    stats.sinkBufferMs = m_sinkBufferMs;
+    return stats;
+}
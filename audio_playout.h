@@ -0,0 +1,131 @@
+#ifndef AUDIO_PLAYOUT_H
+#define AUDIO_PLAYOUT_H
+
+#include <atomic>
+#include <memory>
+
+#include <QAudioDevice>
+#include <QAudioFormat>
+#include <QAudioSink>
+#include <QIODevice>
+#include <QThread>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+}
+
+#include "spsc_queue.h"
+
+#define PLAYOUT_RING_MS                 2000
+#define PLAYOUT_DEFAULT_TARGET_MS       100
+#define PLAYOUT_LOW_LATENCY_TARGET_MS   40
+#define PLAYOUT_MAX_TARGET_MS           500
+#define PLAYOUT_TARGET_STEP_MS          20
+#define PLAYOUT_SETTLE_SECONDS          10
+
+struct PlayoutStats
+{
+    bool running {false};
+    bool buffering {true};          // filling up to the target, playing silence
+    quint64 underruns {0};
+    quint64 overruns {0};           // pushes dropped because the buffer was full
+    double droppedMs {0};           // audio lost to overruns
+    double trimmedMs {0};           // skipped to bring the latency back to the target
+    double bufferedMs {0};
+    double targetMs {0};
+    double sinkBufferMs {0};
+};
+
+// What the sink pulls from: a ring the audio stage pushes PCM into, in the sink's format.
+// The jitter buffer holds playback back until targetMs is queued. An underrun plays
+// silence, buffers up again and raises the target by a step; after a quiet while the
+// target steps back down to where it started. Bursts that pile up beyond twice the
+// target are skipped so the latency does not stay high after a network stall.
+class PlayoutDevice : public QIODevice
+{
+    Q_OBJECT
+public:
+    explicit PlayoutDevice(QObject *parent = nullptr);
+
+    // Only while the sink is stopped
+    void configure(const QAudioFormat &format, int targetMs);
+
+    // Producer side, never blocks. A push that does not fit is dropped whole.
+    // ptsEndUs is the stream time just after the pushed audio, or AV_NOPTS_VALUE.
+    qint64 push(const char *data, qint64 bytes, int64_t ptsEndUs = AV_NOPTS_VALUE);
+    PlayoutStats stats() const;
+    // Paused plays silence and keeps what is queued, without counting it as an underrun
+    void setPaused(bool paused) { m_paused = paused; }
+    // Stream time of the audio leaving the ring, interpolated since the last pull by at most maxElapsedUs
+    int64_t readPtsUs(int64_t nowUs, int64_t maxElapsedUs) const;
+
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override;
+
+protected:
+    // Sink thread
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+
+private:
+    void fill_silence(char *data, qint64 bytes) const;
+    double to_ms(quint64 bytes) const;
+
+    std::unique_ptr<SpscQueue<char>> m_ring;
+    QAudioFormat m_format;
+    int m_baseTargetMs {PLAYOUT_DEFAULT_TARGET_MS};
+    int64_t m_lastUnderrunUs {0};
+
+    // Read by stats() from any thread
+    std::atomic<bool> m_buffering {true};
+    std::atomic<bool> m_paused {false};
+    std::atomic<int> m_bytesPerSecond {0};
+    std::atomic<quint64> m_bufferedBytes {0};
+    std::atomic<int> m_targetMs {PLAYOUT_DEFAULT_TARGET_MS};
+    std::atomic<quint64> m_underruns {0};
+    std::atomic<quint64> m_overruns {0};
+    std::atomic<quint64> m_droppedBytes {0};
+    std::atomic<quint64> m_trimmedBytes {0};
+
+    // Byte positions in the ring's stream: the stream time of byte 0 maps any position to a pts
+    quint64 m_pushedBytes {0};
+    std::atomic<int64_t> m_ptsOriginUs {AV_NOPTS_VALUE};
+    std::atomic<quint64> m_readBytes {0};
+    std::atomic<int64_t> m_readAtUs {0};
+};
+
+// Pull-mode audio output. The QAudioSink lives on a thread of its own with an event
+// loop and pulls from a PlayoutDevice, so the audio stage only copies into a ring and
+// neither it nor demux ever waits for the soundcard.
+// start() and stop() block until the playout thread has done them, push() never blocks.
+class AudioPlayout
+{
+public:
+    AudioPlayout();
+    ~AudioPlayout();
+
+    AudioPlayout(const AudioPlayout&) = delete;
+    AudioPlayout& operator=(const AudioPlayout&) = delete;
+
+    bool start(const QAudioDevice &device, const QAudioFormat &format, qint64 sinkBufferBytes, int targetMs);
+    void stop();
+    bool isRunning() const { return m_running; }
+
+    qint64 push(const char *data, qint64 bytes, int64_t ptsEndUs = AV_NOPTS_VALUE);
+    // Any thread, a paused preview stops feeding the ring and should not grow the jitter target
+    void setPaused(bool paused) { m_device->setPaused(paused); }
+    PlayoutStats stats() const;
+    // Stream time of what is audible now, the master clock for A/V sync.
+    // AV_NOPTS_VALUE while nothing with a timestamp is playing.
+    int64_t clockUs() const;
+
+private:
+    QThread m_thread;
+    PlayoutDevice *m_device {nullptr};
+    QAudioSink *m_sink {nullptr};       // created and deleted on m_thread
+    std::atomic<bool> m_running {false};
+    std::atomic<double> m_sinkBufferMs {0};
+};
+
+#endif // AUDIO_PLAYOUT_H
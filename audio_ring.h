@@ -0,0 +1,153 @@
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#define AUDIO_RING_MAX_READERS  4
+
+// Lock-free ring of float samples with one writer and a few independent readers.
+// The writer never waits: a reader that falls more than the capacity behind loses the
+// oldest samples, which are counted as its overrun. Each reader has its own read
+// position, so a slow analysis view never holds back another one or the decoder.
+// Samples are copied in and out, nothing is allocated after construction.
+// Exactly one thread may call write(), each reader id is used by one thread at a time.
+class AudioRing
+{
+public:
+    // The capacity is rounded up to the next power of two
+    explicit AudioRing(size_t capacity)
+    {
+        m_capacity = 1;
+        while (m_capacity < capacity)
+            m_capacity <<= 1;
+        m_mask = m_capacity - 1;
+        m_buffer.reset(new std::atomic<float>[m_capacity]);
+    }
+
+    AudioRing(const AudioRing&) = delete;
+    AudioRing& operator=(const AudioRing&) = delete;
+
+    // Producer side
+    void write(const float *samples, size_t count)
+    {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        // Only the newest capacity samples survive anyway
+        if (count > m_capacity)
+        {
+            samples += count - m_capacity;
+            head += count - m_capacity;
+            count = m_capacity;
+        }
+
+        // Readers check this after copying to find samples overwritten under them
+        m_writing.store(head + count, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < count; ++i)
+            m_buffer[(head + i) & m_mask].store(samples[i], std::memory_order_relaxed);
+        m_head.store(head + count, std::memory_order_release);
+    }
+
+    // Rate of the samples being written, 0 until the producer knows it
+    void setSampleRate(int rate) { m_sampleRate.store(rate, std::memory_order_relaxed); }
+    int sampleRate() const { return m_sampleRate.load(std::memory_order_relaxed); }
+
+    // A new reader starts at the newest sample. Returns -1 when all slots are taken.
+    int addReader()
+    {
+        for (int id = 0; id < AUDIO_RING_MAX_READERS; ++id)
+        {
+            bool active = false;
+            if (m_readers[id].active.compare_exchange_strong(active, true, std::memory_order_acq_rel))
+            {
+                m_readers[id].position.store(m_head.load(std::memory_order_acquire), std::memory_order_relaxed);
+                m_readers[id].overruns.store(0, std::memory_order_relaxed);
+                return id;
+            }
+        }
+        return -1;
+    }
+
+    void removeReader(int id)
+    {
+        if (id >= 0 && id < AUDIO_RING_MAX_READERS)
+            m_readers[id].active.store(false, std::memory_order_release);
+    }
+
+    bool hasReaders() const
+    {
+        for (const Reader &reader : m_readers)
+            if (reader.active.load(std::memory_order_relaxed))
+                return true;
+        return false;
+    }
+
+    // Consumer side. Copies up to count of the oldest unread samples and returns how many.
+    size_t read(int id, float *dst, size_t count)
+    {
+        Reader &reader = m_readers[id];
+        const uint64_t head = m_head.load(std::memory_order_acquire);
+        uint64_t position = reader.position.load(std::memory_order_relaxed);
+        if (head - position > m_capacity)
+        {
+            reader.overruns.fetch_add(head - m_capacity - position, std::memory_order_relaxed);
+            position = head - m_capacity;
+        }
+
+        size_t n = static_cast<size_t>(std::min<uint64_t>(count, head - position));
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = m_buffer[(position + i) & m_mask].load(std::memory_order_relaxed);
+
+        // Whatever the writer started to replace meanwhile is dropped, never returned torn
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t writing = m_writing.load(std::memory_order_relaxed);
+        const uint64_t oldest = writing > m_capacity ? writing - m_capacity : 0;
+        if (oldest > position)
+        {
+            const uint64_t lost = oldest - position;
+            reader.overruns.fetch_add(lost, std::memory_order_relaxed);
+            const size_t valid = lost < n ? n - static_cast<size_t>(lost) : 0;
+            memmove(dst, dst + (n - valid), valid * sizeof(float));
+            position = oldest;
+            n = valid;
+        }
+
+        reader.position.store(position + n, std::memory_order_relaxed);
+        return n;
+    }
+
+    size_t available(int id) const
+    {
+        const uint64_t head = m_head.load(std::memory_order_acquire);
+        const uint64_t position = m_readers[id].position.load(std::memory_order_relaxed);
+        return static_cast<size_t>(std::min<uint64_t>(head - position, m_capacity));
+    }
+
+    // Samples the reader lost because it fell behind
+    uint64_t overruns(int id) const { return m_readers[id].overruns.load(std::memory_order_relaxed); }
+    uint64_t written() const { return m_head.load(std::memory_order_relaxed); }
+    size_t capacity() const { return m_capacity; }
+
+private:
+    struct Reader
+    {
+        alignas(64) std::atomic<uint64_t> position {0};
+        std::atomic<uint64_t> overruns {0};
+        std::atomic<bool> active {false};
+    };
+
+    std::unique_ptr<std::atomic<float>[]> m_buffer;
+    size_t m_capacity {0};
+    size_t m_mask {0};
+    std::atomic<int> m_sampleRate {0};
+
+    // The writer's cache line, readers only load from it
+    alignas(64) std::atomic<uint64_t> m_head {0};
+    std::atomic<uint64_t> m_writing {0};
+    Reader m_readers[AUDIO_RING_MAX_READERS];
+};
+
+#endif // AUDIO_RING_H
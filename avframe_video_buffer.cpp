@@ -0,0 +1,137 @@
+#include "avframe_video_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+}
+
+static QVideoFrameFormat::PixelFormat pixel_format(int format)
+{
+    switch (format)
+    {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        return QVideoFrameFormat::Format_YUV420P;
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+        return QVideoFrameFormat::Format_YUV422P;
+    case AV_PIX_FMT_NV12:
+        return QVideoFrameFormat::Format_NV12;
+    case AV_PIX_FMT_P010LE:
+        return QVideoFrameFormat::Format_P010;
+    default:
+        return QVideoFrameFormat::Format_Invalid;
+    }
+}
+
+// Chroma planes are subsampled vertically
+static int plane_rows(const AVFrame *frame, int plane)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    return plane == 0 ? frame->height : AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h);
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+
+AVFrameVideoBuffer::AVFrameVideoBuffer(AVFrame *frame, const QVideoFrameFormat &format)
+    : m_frame(frame)
+    , m_format(format)
+{
+}
+
+AVFrameVideoBuffer::~AVFrameVideoBuffer()
+{
+    av_frame_free(&m_frame);
+}
+
+QAbstractVideoBuffer::MapData AVFrameVideoBuffer::map(QVideoFrame::MapMode mode)
+{
+    MapData data;
+    // The planes may be shared with the decoder's reference list
+    if (mode & QVideoFrame::WriteOnly)
+        return data;
+
+    for (int plane = 0; plane < 4 && m_frame->data[plane]; ++plane)
+    {
+        data.data[plane] = m_frame->data[plane];
+        data.bytesPerLine[plane] = m_frame->linesize[plane];
+        data.dataSize[plane] = m_frame->linesize[plane] * plane_rows(m_frame, plane);
+        data.planeCount = plane + 1;
+    }
+    return data;
+}
+
+#endif
+
+bool AVFrameVideo::supports(int pixelFormat)
+{
+    return pixel_format(pixelFormat) != QVideoFrameFormat::Format_Invalid;
+}
+
+QVideoFrameFormat AVFrameVideo::formatFor(const AVFrame *frame)
+{
+    QVideoFrameFormat format(QSize(frame->width, frame->height), pixel_format(frame->format));
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 4, 0)
+    switch (frame->colorspace)
+    {
+    case AVCOL_SPC_BT709:
+        format.setColorSpace(QVideoFrameFormat::ColorSpace_BT709);
+        break;
+    case AVCOL_SPC_BT2020_NCL:
+    case AVCOL_SPC_BT2020_CL:
+        format.setColorSpace(QVideoFrameFormat::ColorSpace_BT2020);
+        break;
+    case AVCOL_SPC_BT470BG:
+    case AVCOL_SPC_SMPTE170M:
+        format.setColorSpace(QVideoFrameFormat::ColorSpace_BT601);
+        break;
+    default:
+        // Untagged streams: SD is BT.601, everything else BT.709
+        format.setColorSpace(frame->height < 720 ? QVideoFrameFormat::ColorSpace_BT601
+                                                 : QVideoFrameFormat::ColorSpace_BT709);
+        break;
+    }
+
+    bool fullRange = frame->color_range == AVCOL_RANGE_JPEG
+            || frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_YUVJ422P;
+    format.setColorRange(fullRange ? QVideoFrameFormat::ColorRange_Full : QVideoFrameFormat::ColorRange_Video);
+#endif
+    return format;
+}
+
+QVideoFrame AVFrameVideo::wrap(AVFrame *frame)
+{
+    if (!frame || !supports(frame->format) || frame->linesize[0] < 0)
+    {
+        av_frame_free(&frame);
+        return QVideoFrame();
+    }
+
+    QVideoFrameFormat format = formatFor(frame);
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+    return QVideoFrame(std::make_unique<AVFrameVideoBuffer>(frame, format));
+#else
+    // No public buffer interface before Qt 6.8, the planes are copied once
+    QVideoFrame videoFrame(format);
+    if (videoFrame.map(QVideoFrame::WriteOnly))
+    {
+        for (int plane = 0; plane < videoFrame.planeCount() && frame->data[plane]; ++plane)
+        {
+            int rows = plane_rows(frame, plane);
+            int bytes = std::min(frame->linesize[plane], videoFrame.bytesPerLine(plane));
+            for (int y = 0; y < rows; ++y)
+                memcpy(videoFrame.bits(plane) + y * videoFrame.bytesPerLine(plane),
+                       frame->data[plane] + y * frame->linesize[plane], bytes);
+        }
+        videoFrame.unmap();
+    }
+    av_frame_free(&frame);
+    return videoFrame;
+#endif
+}
@@ -0,0 +1,48 @@
+#ifndef AVFRAME_VIDEO_BUFFER_H
+#define AVFRAME_VIDEO_BUFFER_H
+
+#include <QtGlobal>
+#include <QVideoFrame>
+#include <QVideoFrameFormat>
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+#include <QAbstractVideoBuffer>
+#endif
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// Decoded YUV frame handed to Qt Multimedia without an RGB conversion.
+// With Qt 6.8 the QVideoFrame maps the AVFrame planes directly and owns one
+// reference to them, so the decoder buffer goes back to FFmpeg's pool when the
+// last copy of the QVideoFrame is dropped. Older Qt versions get a plane copy.
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+class AVFrameVideoBuffer : public QAbstractVideoBuffer
+{
+public:
+    // Takes over the reference
+    AVFrameVideoBuffer(AVFrame *frame, const QVideoFrameFormat &format);
+    ~AVFrameVideoBuffer() override;
+
+    MapData map(QVideoFrame::MapMode mode) override;
+    QVideoFrameFormat format() const override { return m_format; }
+
+private:
+    AVFrame *m_frame;
+    QVideoFrameFormat m_format;
+};
+#endif
+
+class AVFrameVideo
+{
+public:
+    // Formats a QVideoFrame can carry without conversion
+    static bool supports(int pixelFormat);
+    static QVideoFrameFormat formatFor(const AVFrame *frame);
+    // Takes over the frame reference, an invalid frame for unsupported formats
+    static QVideoFrame wrap(AVFrame *frame);
+};
+
+#endif // AVFRAME_VIDEO_BUFFER_H
@@ -0,0 +1,73 @@
+#ifndef CLOCK_DRIFT_H
+#define CLOCK_DRIFT_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+#define DRIFT_UPDATE_INTERVAL_US    1000000
+#define DRIFT_LOG_INTERVAL_US       60000000
+#define DRIFT_MAX_PPM               1000.0
+#define DRIFT_PROPORTIONAL_GAIN     20.0        // ppm per ms of fill error
+#define DRIFT_INTEGRAL_GAIN         0.2         // ppm per ms of fill error, per update
+
+// Clock drift between the publisher and the soundcard, seen through the playout buffer.
+// If the publisher's clock runs fast the buffer slowly fills up, if it runs slow it
+// drains. A PI controller on the mean fill around the jitter target gives the rate
+// correction for the resampler, and its integral settles on the drift itself.
+// With the gains above the loop takes about a minute to settle and is well damped,
+// so network jitter averaged over one update barely moves it.
+// Only the audio stage calls update(), the figures can be read anywhere.
+class ClockDrift
+{
+public:
+    // One fill sample per decoded frame. Returns true once per interval with a new correction.
+    bool update(int64_t nowUs, double bufferedMs, double targetMs)
+    {
+        if (m_intervalStartUs == 0)
+            m_intervalStartUs = nowUs;
+        m_errorSum += bufferedMs - targetMs;
+        m_samples++;
+        if (nowUs - m_intervalStartUs < DRIFT_UPDATE_INTERVAL_US)
+            return false;
+
+        const double error = m_errorSum / m_samples;
+        m_integral = std::clamp(m_integral + DRIFT_INTEGRAL_GAIN * error, -DRIFT_MAX_PPM, DRIFT_MAX_PPM);
+        m_driftPpm = m_integral;
+        m_correctionPpm = std::clamp(m_integral + DRIFT_PROPORTIONAL_GAIN * error, -DRIFT_MAX_PPM, DRIFT_MAX_PPM);
+        m_fillErrorMs = error;
+
+        m_intervalStartUs = nowUs;
+        m_errorSum = 0;
+        m_samples = 0;
+        return true;
+    }
+
+    void reset()
+    {
+        m_intervalStartUs = 0;
+        m_errorSum = 0;
+        m_samples = 0;
+        m_integral = 0;
+        m_driftPpm = 0;
+        m_correctionPpm = 0;
+        m_fillErrorMs = 0;
+    }
+
+    // Positive when the publisher runs fast, playback has to consume more input per second
+    double driftPpm() const { return m_driftPpm; }
+    double correctionPpm() const { return m_correctionPpm; }
+    double fillErrorMs() const { return m_fillErrorMs; }
+
+private:
+    int64_t m_intervalStartUs {0};
+    double m_errorSum {0};
+    int m_samples {0};
+    double m_integral {0};
+
+    std::atomic<double> m_driftPpm {0};
+    std::atomic<double> m_correctionPpm {0};
+    std::atomic<double> m_fillErrorMs {0};
+};
+
+#endif // CLOCK_DRIFT_H
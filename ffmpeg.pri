@@ -0,0 +1,20 @@
+# FFmpeg headers and libraries, for the app and the programs under tests/
+
+win32 {
+  INCLUDEPATH += $$PWD\lib\ffmpeg
+  LIBS += -L$$PWD\lib\libav -llibavformat -llibavcodec -llibavutil -llibavfilter -llibswscale -lswresample
+}
+
+unix:!macx {
+    INCLUDEPATH += /usr/include/x86_64-linux-gnu/libavcodec
+    INCLUDEPATH += /usr/include/x86_64-linux-gnu/libavformat
+    INCLUDEPATH += /usr/include/x86_64-linux-gnu/libavfilter
+    LIBS += -L/usr/include/x86_64-linux-gnu/ -lavformat -lavcodec -lavutil -lavfilter -lswscale -lswresample
+}
+
+unix:macx {
+    # HOMEBREW_CELLAR_PATH = /opt/homebrew/Cellar
+    HOMEBREW_CELLAR_PATH = /usr/local/Cellar
+    INCLUDEPATH += $$HOMEBREW_CELLAR_PATH/ffmpeg/7.0.1/include
+    LIBS += -L$$HOMEBREW_CELLAR_PATH/ffmpeg/7.0.1/lib -lavformat -lavcodec -lavutil -lavfilter -lswscale -lswresample
+}
@@ -1,5 +1,5 @@
 #include "ffmpeg_rtmp.h"
-#include <QStandardPaths>
+#include "stream_param_cache.h"
 
 #define STR(x) #x
 #define XSTR(x) STR(x)
@@ -48,99 +48,484 @@ ffmpeg_rtmp::ffmpeg_rtmp(QObject *parent)
     std::string avutil_verison = XSTR(LIBAVUTIL_VERSION);
     std::cout << "FFmpeg version: " << ffmpegVersion << " avutil_verison : " << avutil_verison << std::endl;
 
-    out_filename = QString("%1/output.mp4").arg(QStandardPaths::writableLocation(QStandardPaths::DesktopLocation));
+    m_recorder = new SegmentRecorder(this);
+    connect(m_recorder, &SegmentRecorder::sendInfo, this, &ffmpeg_rtmp::sendInfo);
+    m_ladder = new TranscodeLadder(this);
+    connect(m_ladder, &TranscodeLadder::sendInfo, this, &ffmpeg_rtmp::sendInfo);
+    m_analysisConverter.setOutput(AV_SAMPLE_FMT_FLT, 1);
     avformat_network_init();
 }
 
 void ffmpeg_rtmp::stop()
 {
+    m_abortRequestedUs = av_gettime_relative();
     m_stop = true;
+    m_abort = true;
 }
 
-void ffmpeg_rtmp::setUrl()
+void ffmpeg_rtmp::restart()
+{
+    // Drops the current publisher (or listen attempt) and listens again
+    if (m_state == SessionState::Idle)
+        return;
+    m_abortRequestedUs = av_gettime_relative();
+    m_abort = true;
+}
+
+int ffmpeg_rtmp::interrupt_callback(void *opaque)
+{
+    // Polled by FFmpeg inside every blocking network call on the input
+    return static_cast<ffmpeg_rtmp*>(opaque)->m_abort ? 1 : 0;
+}
+
+void ffmpeg_rtmp::set_state(SessionState state)
+{
+    m_state = state;
+}
+
+QString ffmpeg_rtmp::localAddress()
 {
-    bool found = false;
     foreach(QNetworkInterface interface, QNetworkInterface::allInterfaces())
     {
         if (interface.flags().testFlag(QNetworkInterface::IsUp) && !interface.flags().testFlag(QNetworkInterface::IsLoopBack))
             foreach (QNetworkAddressEntry entry, interface.addressEntries())
             {
                 //qDebug() << entry.ip().toString() + " " + interface.hardwareAddress()  + " " + interface.humanReadableName();
-                if ( !found && interface.hardwareAddress() != "00:00:00:00:00:00" && entry.ip().toString().contains(".")
+                if ( interface.hardwareAddress() != "00:00:00:00:00:00" && entry.ip().toString().contains(".")
                      && !interface.humanReadableName().contains("VM") && !interface.hardwareAddress().startsWith("00:") && interface.hardwareAddress() != "")
                 {
-                    in_filename  = "rtmp://" + entry.ip().toString() + ":8889/live";
-                    qDebug() << in_filename;
-                    emit sendUrl(in_filename);
-                    found = true;
+                    return entry.ip().toString();
                 }
             }
     }
+    return QString();
 }
 
+void ffmpeg_rtmp::setUrl()
+{
+    setUrl(localAddress(), DEFAULT_RTMP_PORT, QString());
+}
 
-int ffmpeg_rtmp::prepare_ffmpeg()
+void ffmpeg_rtmp::setUrl(const QString &host, int port, const QString &streamKey)
 {
-    // Open the RTMP stream
-    AVDictionary *format_opts = NULL;
-    av_dict_set(&format_opts, "timeout", "30", 0);
+    if (host.isEmpty())
+        return;
 
-    if (avformat_open_input(&inputContext, in_filename.toStdString().c_str() , nullptr, &format_opts) != 0) {
-        // Error handling
-        qDebug() << "timeout, avformat_open_input";
-        return false;
+    // The rtmp listener accepts a single publisher per port, the stream key only names the session
+    in_filename  = "rtmp://" + host + ":" + QString::number(port) + "/live";
+    if (streamKey.isEmpty())
+    {
+        m_recorder->setBaseName("output");
+        m_ladder->setBaseName("output");
+    }
+    else
+    {
+        in_filename += "/" + streamKey;
+        m_recorder->setBaseName("output_" + streamKey);
+        m_ladder->setBaseName("output_" + streamKey);
     }
 
-    // Retrieve stream information
-    if (avformat_find_stream_info(inputContext, nullptr) < 0) {
-        // Error handling
-        qDebug() << "error avformat_find_stream_info";
-        return false;
+    qDebug() << in_filename;
+    emit sendUrl(in_filename);
+}
+
+void ffmpeg_rtmp::setProbeSettings(const ProbeSettings &settings)
+{
+    QMutexLocker locker(&m_settingsMutex);
+    m_pendingSettings.probe = settings;
+}
+
+void ffmpeg_rtmp::setLatencyProfile(LatencyProfile profile)
+{
+    m_latencyProfile = profile;
+}
+
+void ffmpeg_rtmp::setDecoderThreading(const DecoderThreading &threading)
+{
+    QMutexLocker locker(&m_settingsMutex);
+    m_pendingSettings.threading = threading;
+}
+
+void ffmpeg_rtmp::setRecorderSettings(const RecorderSettings &settings)
+{
+    QMutexLocker locker(&m_settingsMutex);
+    m_pendingSettings.recorder = settings;
+}
+
+void ffmpeg_rtmp::setWorkerPool(QThreadPool *pool)
+{
+    m_workerPool = pool;
+}
+
+void ffmpeg_rtmp::setLadderSettings(const LadderSettings &settings)
+{
+    QMutexLocker locker(&m_settingsMutex);
+    m_pendingSettings.ladder = settings;
+}
+
+void ffmpeg_rtmp::setRestreamTargets(const QStringList &targets)
+{
+    QMutexLocker locker(&m_settingsMutex);
+    m_pendingSettings.restreamTargets = targets;
+}
+
+void ffmpeg_rtmp::setTimeshiftSeconds(int seconds)
+{
+    m_timeshiftSeconds = std::max(0, seconds);
+}
+
+void ffmpeg_rtmp::pausePreview()
+{
+    if (m_previewMode == PreviewMode::Paused)
+        return;
+    m_previewMode = PreviewMode::Paused;
+    m_playout.setPaused(true);
+    emit sendInfo("Preview paused, recording continues.");
+}
+
+void ffmpeg_rtmp::resumePreview()
+{
+    if (m_previewMode != PreviewMode::Paused)
+        return;
+    // Without a buffer there is nothing to catch up from
+    m_previewMode = m_timeshiftSeconds > 0 ? PreviewMode::Timeshift : PreviewMode::Live;
+    m_playout.setPaused(false);
+}
+
+void ffmpeg_rtmp::seekPreview(double offsetSeconds)
+{
+    if (m_timeshiftSeconds <= 0)
+    {
+        emit sendInfo("Time-shift buffer is off.");
+        return;
     }
+    m_seekOffsetUs = static_cast<int64_t>(offsetSeconds * 1000000);
+    m_seekPending = true;
+    m_previewMode = PreviewMode::Timeshift;
+    m_playout.setPaused(false);
+}
 
-    // Create the output file context
-    if (avformat_alloc_output_context2(&outputContext, nullptr, nullptr, out_filename.toStdString().c_str()) < 0) {
-        // Error handling
-        qDebug() << "error avformat_alloc_output_context2";
+void ffmpeg_rtmp::goLivePreview()
+{
+    m_seekPending = false;
+    m_previewMode = PreviewMode::Live;
+    m_playout.setPaused(false);
+}
+
+void ffmpeg_rtmp::setPreviewSize(const QSize &size)
+{
+    // Picked up by the next converted frame
+    m_previewWidth = size.width();
+    m_previewHeight = size.height();
+}
+
+void ffmpeg_rtmp::setPreviewThreads(int threads)
+{
+    m_previewConverter.setThreadCount(threads);
+}
+
+void ffmpeg_rtmp::setPreviewKernels(bool enabled)
+{
+    m_previewConverter.setKernelsEnabled(enabled);
+}
+
+void ffmpeg_rtmp::setPreviewZeroCopy(bool enabled)
+{
+    m_previewZeroCopy = enabled;
+}
+
+void ffmpeg_rtmp::setAudioLatency(int milliseconds)
+{
+    m_audioLatencyMs = std::max(0, milliseconds);
+}
+
+void ffmpeg_rtmp::setAudioOutput(const QAudioDevice &device, int bufferMs)
+{
+    {
+        QMutexLocker locker(&m_audioOutputMutex);
+        m_audioOutput = device;
+    }
+    m_audioBufferMs = std::max(0, bufferMs);
+    m_audioOutputChanged = true;
+}
+
+void ffmpeg_rtmp::setAvSyncEnabled(bool enabled)
+{
+    m_avSyncEnabled = enabled;
+}
+
+bool ffmpeg_rtmp::takePreviewFrame(PreviewFrame &frame)
+{
+    // Low latency shows the newest picture, waiting for the audio would add its buffer to the video
+    const bool sync = m_avSyncEnabled && m_latencyProfile != LatencyProfile::LowLatency;
+    const int64_t clockUs = sync ? m_playout.clockUs() : AV_NOPTS_VALUE;
+    m_avSyncActive = clockUs != AV_NOPTS_VALUE;
+
+    // The mailbox only fills when the queue was off or full: its frame is newer than the one held back
+    PreviewFrame latest;
+    if (m_previewMailbox.take(latest))
+    {
+        if (m_previewNextValid)
+            m_previewFramesOverwritten++;
+        m_previewNext = std::move(latest);
+        m_previewNextValid = true;
+        m_previewTakenSequence = m_previewNext.sequence;
+    }
+
+    // Everything due by now is taken in order, only the last of them is shown
+    bool found = false;
+    for (;;)
+    {
+        if (!m_previewNextValid)
+        {
+            if (!m_previewQueue.pop(m_previewNext))
+                break;
+            // Queued before the mailbox frame that already went past it
+            if (m_previewNext.sequence <= m_previewTakenSequence)
+            {
+                m_previewFramesOverwritten++;
+                m_previewNext = PreviewFrame();
+                continue;
+            }
+            m_previewNextValid = true;
+            m_previewTakenSequence = m_previewNext.sequence;
+        }
+
+        if (clockUs != AV_NOPTS_VALUE && m_previewNext.ptsUs != AV_NOPTS_VALUE)
+        {
+            const int64_t aheadUs = m_previewNext.ptsUs - clockUs;
+            if (aheadUs > AV_SYNC_TOLERANCE_US && aheadUs < AV_SYNC_MAX_OFFSET_US)
+            {
+                m_avSyncHeld++;
+                break;
+            }
+        }
+
+        if (found)
+        {
+            if (clockUs != AV_NOPTS_VALUE)
+                m_avSyncDroppedLate++;
+            else
+                m_previewFramesOverwritten++;
+        }
+        frame = std::move(m_previewNext);
+        m_previewNext = PreviewFrame();
+        m_previewNextValid = false;
+        found = true;
+    }
+    if (!found)
         return false;
+
+    m_previewFramesDisplayed++;
+    if (clockUs != AV_NOPTS_VALUE && frame.ptsUs != AV_NOPTS_VALUE)
+    {
+        const int64_t offsetUs = frame.ptsUs - clockUs;
+        if (offsetUs > -AV_SYNC_MAX_OFFSET_US && offsetUs < AV_SYNC_MAX_OFFSET_US)
+        {
+            m_avSyncOffset.add(offsetUs / 1000.0);
+            m_avSyncOffsetMs = m_avSyncOffset.mean();
+        }
     }
+    return true;
+}
+
+SessionStats ffmpeg_rtmp::stats() const
+{
+    SessionStats stats;
+    stats.state = m_state;
+    stats.connected = m_connected;
+    if (stats.connected)
+        stats.uptimeMs = (av_gettime_relative() - m_connectedSinceUs) / 1000;
+    stats.packetsIn = m_packetsIn;
+    stats.bytesIn = m_bytesIn;
+    stats.videoFramesDecoded = m_videoFramesDecoded;
+    stats.droppedVideoFrames = m_droppedVideoFrames;
+    stats.packetsMuxed = m_packetsMuxed;
+    stats.decoderPacketsDropped = m_decoderPacketsDropped;
+    stats.muxPacketsDropped = m_muxPacketsDropped;
+    stats.timeToFirstFrameMs = m_timeToFirstFrameMs;
+    stats.videoDecodeTimeMs = m_videoDecodeTimeMs;
+    stats.preview = m_previewConverter.stats();
+    stats.previewFramesZeroCopy = m_previewFramesZeroCopy;
+    stats.previewFramesDisplayed = m_previewFramesDisplayed;
+    stats.previewFramesOverwritten = m_previewFramesOverwritten + m_previewMailbox.dropped();
+    stats.avSyncActive = m_avSyncActive;
+    stats.avSyncOffsetMs = m_avSyncOffsetMs;
+    stats.avSyncDroppedLate = m_avSyncDroppedLate;
+    stats.avSyncHeld = m_avSyncHeld;
+    stats.avSyncFallbacks = m_avSyncFallbacks;
+    stats.audio = m_audioConverter.stats();
+    stats.playout = m_playout.stats();
+    stats.audioDriftPpm = m_clockDrift.driftPpm();
+    stats.previewMode = m_previewMode;
+    int64_t endUs = m_timeshiftEndUs;
+    int64_t positionUs = m_previewPositionUs;
+    if (stats.previewMode != PreviewMode::Live && endUs != AV_NOPTS_VALUE && positionUs != AV_NOPTS_VALUE)
+        stats.previewDelayMs = (endUs - positionUs) / 1000.0;
+    stats.recorder = m_recorder->writerStats();
+    stats.renditions = m_ladder->stats();
+
+    QMutexLocker locker(&m_outputsMutex);
+    for (const RestreamOutput *output : m_outputs)
+        stats.outputs.append(output->stats());
+    return stats;
+}
+
+
+void ffmpeg_rtmp::find_streams()
+{
+    vid_stream = nullptr;
+    aud_stream = nullptr;
+    video_idx = -1;
+    audio_idx = -1;
 
-    // Iterate through input streams and copy all streams to output
     for (unsigned int i = 0; i < inputContext->nb_streams; ++i) {
-        inputStream = inputContext->streams[i];
-        outputStream = avformat_new_stream(outputContext, nullptr);
-        if (inputContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        if (inputContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && video_idx == -1)
         {
             vid_stream = inputContext->streams[i];
             video_idx = i;
             qDebug() << "video_idx : " << video_idx;
         }
-        else if (inputContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-            aud_stream = inputContext->streams[i];;
+        else if (inputContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audio_idx == -1) {
+            aud_stream = inputContext->streams[i];
             audio_idx = i;
             qDebug() << "audio_idx : " << audio_idx;
         }
-        if (!outputStream) {
-            // Error handling
-            return false;
-        }
-        avcodec_parameters_copy(outputStream->codecpar, inputStream->codecpar);
     }
+}
 
-    // Open the output file for writing
-    if (avio_open(&outputContext->pb, out_filename.toStdString().c_str(), AVIO_FLAG_WRITE) < 0) {
-        // Error handling
-        qDebug() << "error avio_open";
-        return false ;
+bool ffmpeg_rtmp::apply_cached_params(AVStream *stream, const AVCodecParameters *cached)
+{
+    if (!stream || stream->codecpar->codec_id != cached->codec_id)
+        return false;
+
+    if (StreamParamCache::isComplete(stream->codecpar) && stream->codecpar->extradata_size > 0)
+        return true;
+
+    // Keep whatever sequence header the demuxer already read, it is newer than the cache
+    if (stream->codecpar->extradata_size > 0 && cached->extradata_size == 0)
+        return StreamParamCache::isComplete(stream->codecpar);
+
+    return avcodec_parameters_copy(stream->codecpar, cached) >= 0;
+}
+
+int ffmpeg_rtmp::prepare_ffmpeg()
+{
+    // Open the RTMP stream
+    inputContext = avformat_alloc_context();
+    if (!inputContext)
+        return false;
+    inputContext->interrupt_callback.callback = interrupt_callback;
+    inputContext->interrupt_callback.opaque = this;
+
+    m_lowLatency = m_latencyProfile == LatencyProfile::LowLatency;
+    {
+        QMutexLocker locker(&m_settingsMutex);
+        m_settings = m_pendingSettings;
     }
 
-    // Write the output file header
-    if (avformat_write_header(outputContext, nullptr) < 0) {
+    AVDictionary *format_opts = NULL;
+    av_dict_set(&format_opts, "timeout", "30", 0);
+    if (m_lowLatency)
+        av_dict_set(&format_opts, "fflags", "nobuffer", 0);
+    if (m_settings.probe.fastStart)
+    {
+        av_dict_set_int(&format_opts, "probesize", m_settings.probe.probeSize, 0);
+        av_dict_set_int(&format_opts, "analyzeduration", m_settings.probe.analyzeDurationUs, 0);
+        av_dict_set_int(&format_opts, "fpsprobesize", m_settings.probe.fpsProbeSize, 0);
+    }
+
+    int ret = avformat_open_input(&inputContext, in_filename.toStdString().c_str() , nullptr, &format_opts);
+    av_dict_free(&format_opts);
+    if (ret != 0) {
+        // Error handling, the context is freed by avformat_open_input
+        if (!m_abort)
+            qDebug() << "timeout, avformat_open_input";
+        return false;
+    }
+    m_acceptedUs = av_gettime_relative();
+    m_firstFrameDecoded = false;
+
+    // A returning publisher only needs enough probing to create its streams,
+    // everything the demuxer has not learned yet comes from the cache
+    AVCodecParameters *cachedVideo = avcodec_parameters_alloc();
+    AVCodecParameters *cachedAudio = avcodec_parameters_alloc();
+    m_usedCachedParams = m_settings.probe.fastStart && cachedVideo && cachedAudio
+            && StreamParamCache::instance().load(in_filename, cachedVideo, cachedAudio);
+    if (m_usedCachedParams)
+    {
+        inputContext->probesize = CACHED_PROBE_SIZE;
+        inputContext->max_analyze_duration = CACHED_ANALYZE_DURATION_US;
+    }
+
+    // Retrieve stream information
+    if (avformat_find_stream_info(inputContext, nullptr) < 0) {
         // Error handling
-        qDebug() << "error avformat_write_header";
+        qDebug() << "error avformat_find_stream_info";
+        avcodec_parameters_free(&cachedVideo);
+        avcodec_parameters_free(&cachedAudio);
+        return false;
+    }
+
+    if (m_usedCachedParams)
+    {
+        find_streams();
+        if (!apply_cached_params(vid_stream, cachedVideo) || !apply_cached_params(aud_stream, cachedAudio))
+        {
+            // Publisher changed its codecs, probe the regular way
+            m_usedCachedParams = false;
+            inputContext->probesize = m_settings.probe.probeSize;
+            inputContext->max_analyze_duration = m_settings.probe.analyzeDurationUs;
+            if (avformat_find_stream_info(inputContext, nullptr) < 0) {
+                qDebug() << "error avformat_find_stream_info";
+                avcodec_parameters_free(&cachedVideo);
+                avcodec_parameters_free(&cachedAudio);
+                return false;
+            }
+        }
+    }
+    avcodec_parameters_free(&cachedVideo);
+    avcodec_parameters_free(&cachedAudio);
+
+    m_probeMs = (av_gettime_relative() - m_acceptedUs) / 1000.0;
+
+    find_streams();
+    if ((video_idx == -1 || audio_idx == -1) && m_settings.probe.fastStart)
+    {
+        // The short probe can end before a late track's first packet, keep reading with FFmpeg's defaults
+        inputContext->probesize = FULL_PROBE_SIZE;
+        inputContext->max_analyze_duration = 0;
+        inputContext->fps_probe_size = -1;
+        if (avformat_find_stream_info(inputContext, nullptr) >= 0)
+            find_streams();
+        m_probeMs = (av_gettime_relative() - m_acceptedUs) / 1000.0;
+    }
+    if (video_idx == -1 || audio_idx == -1) {
+        info = "Video or Audio stream not found ";
+        emit sendInfo(info);
         return false;
     }
+    StreamParamCache::instance().store(in_filename, vid_stream->codecpar, aud_stream->codecpar);
+
+    // Start a new recording segment for this publisher
+    RecorderSettings recorderSettings = m_settings.recorder;
+    recorderSettings.flushPackets = m_lowLatency;
+    m_recorder->setSettings(recorderSettings);
+    if (!m_recorder->open(inputContext, video_idx))
+        return false;
+
+    // Record-only sessions never create decoders, they are opened once preview is switched on
+    m_waitVideoKeyframe = true;
+    m_decodeActive = false;
+    if (m_decodeEnabled && !open_decoders())
+        return false;
+
+    m_decodeActive = m_decodersOpen;
+    return true;
+}
 
+bool ffmpeg_rtmp::open_decoders()
+{
     auto video_codec = avcodec_find_decoder(vid_stream->codecpar->codec_id);
     if (!video_codec) {
         qDebug() << "error video avcodec_find_decoder";
@@ -151,11 +536,25 @@ int ffmpeg_rtmp::prepare_ffmpeg()
     if(avcodec_parameters_to_context(videoCodecContext, vid_stream->codecpar)<0)
         std::cout << 512;
 
+#ifdef AV_CODEC_FLAG_COPY_OPAQUE
+    // Carries the packet arrival time over to the decoded frame
+    videoCodecContext->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+#endif
+    if (m_lowLatency)
+        videoCodecContext->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    configure_decoder_threads();
+
     if (avcodec_open2(videoCodecContext, video_codec, nullptr)<0) {
         std::cout << 5;
         return false;
     }
 
+    // The decoder may fall back when it does not support the requested type
+    QString threadType = (videoCodecContext->active_thread_type & FF_THREAD_FRAME) ? "frame"
+                       : (videoCodecContext->active_thread_type & FF_THREAD_SLICE) ? "slice" : "none";
+    emit sendInfo("Video decoder threads: " + QString::number(videoCodecContext->thread_count) + " (" + threadType + ")");
+    m_videoDecodeTime.reset();
+
     auto audio_codec = avcodec_find_decoder(aud_stream->codecpar->codec_id);
     if (!audio_codec) {
         qDebug() << "error audio avcodec_find_decoder";
@@ -167,6 +566,11 @@ int ffmpeg_rtmp::prepare_ffmpeg()
     if(avcodec_parameters_to_context(audioCodecContext, aud_stream->codecpar)<0)
         std::cout << 512;
 
+    if (m_lowLatency)
+        audioCodecContext->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    // Audio decode is cheap, keep it on the calling thread
+    audioCodecContext->thread_count = 1;
+
     if (avcodec_open2(audioCodecContext, audio_codec, nullptr)<0) {
         std::cout << 5;
         return false;
@@ -186,12 +590,137 @@ int ffmpeg_rtmp::prepare_ffmpeg()
         return false;
     }
 
+    m_decodersOpen = true;
+    return true;
+}
+
+void ffmpeg_rtmp::close_decoders()
+{
+    avcodec_free_context(&videoCodecContext);
+    avcodec_free_context(&audioCodecContext);
+    av_frame_free(&video_frame);
+    av_frame_free(&audio_frame);
+    m_decodersOpen = false;
+}
+
+void ffmpeg_rtmp::setDecodeEnabled(bool enabled)
+{
+    m_decodeEnabled = enabled;
+}
+
+bool ffmpeg_rtmp::feed_decoders(const AVPacket *packet)
+{
+    if (!m_decodeEnabled)
+    {
+        m_decodeActive = false;
+        return false;
+    }
+
+    if (!m_decodeActive)
+    {
+        m_feedingLive = true;
+        // Switched on at runtime: open once, and restart decoding from a clean state
+        if (!m_decodersOpen && !open_decoders())
+        {
+            close_decoders();
+            m_decodeEnabled = false;
+            emit sendInfo("Could not open decoders, staying in record-only mode.");
+            return false;
+        }
+        m_flushVideoDecoder = true;
+        m_flushAudioDecoder = true;
+        m_waitVideoKeyframe = true;
+        m_decodeActive = true;
+        emit sendInfo("Preview decoding on.");
+    }
+
+    // Paused or replaying: the preview is fed from the time-shift buffer
+    if (m_previewMode != PreviewMode::Live)
+    {
+        if (m_feedingLive && m_timeshift && m_timeshiftEndUs != AV_NOPTS_VALUE)
+        {
+            // Replay continues with this packet, the decoders have seen everything before it
+            m_timeshiftCursor = m_timeshift->endSeq() - 1;
+            m_previewPositionUs = m_timeshiftEndUs.load();
+            DecoderFeed live = DecoderFeed::Live;
+            m_decoderFeed.compare_exchange_strong(live, DecoderFeed::HandedOver);
+        }
+        m_feedingLive = false;
+        // The replay idles at the end of the buffer until this packet lands in it
+        if (m_timeshiftStage)
+            m_timeshiftStage->notify();
+        return true;
+    }
+
+    if (!m_feedingLive)
+    {
+        // Back to live once the replay has let go of the decoder queues. From here on
+        // the replay cannot take them: it only starts from HandedOver.
+        DecoderFeed handedOver = DecoderFeed::HandedOver;
+        if (!m_decoderFeed.compare_exchange_strong(handedOver, DecoderFeed::Live)
+                && handedOver == DecoderFeed::Replaying)
+            return true;
+        push_flush_markers();
+        m_waitVideoKeyframe = true;
+        m_feedingLive = true;
+        emit sendInfo("Preview is live.");
+    }
+
+    // Video decoding can only start at a keyframe
+    if (packet->stream_index == video_idx && m_waitVideoKeyframe)
+    {
+        if (!(packet->flags & AV_PKT_FLAG_KEY))
+            return true;
+        m_waitVideoKeyframe = false;
+    }
+
+    // A decoder that falls behind loses packets, ingest never waits for it.
+    // Video resumes at the next keyframe rather than decoding a broken GOP.
+    if (!dispatch_to_decoders(packet))
+    {
+        m_decoderPacketsDropped++;
+        if (packet->stream_index == video_idx)
+            m_waitVideoKeyframe = true;
+    }
+    return true;
+}
+
+bool ffmpeg_rtmp::dispatch_to_decoders(const AVPacket *packet)
+{
+    if (packet->stream_index == audio_idx)
+        return push_packet(m_audioPacketQueue, packet, m_audioStage.get());
+    // for preview
+    if (packet->stream_index == video_idx)
+        return push_packet(m_videoPacketQueue, packet, m_videoDecodeStage.get());
     return true;
 }
 
+static AVSampleFormat sample_format(QAudioFormat::SampleFormat format)
+{
+    switch (format)
+    {
+    case QAudioFormat::UInt8:
+        return AV_SAMPLE_FMT_U8;
+    case QAudioFormat::Int16:
+        return AV_SAMPLE_FMT_S16;
+    case QAudioFormat::Int32:
+        return AV_SAMPLE_FMT_S32;
+    case QAudioFormat::Float:
+        return AV_SAMPLE_FMT_FLT;
+    default:
+        return AV_SAMPLE_FMT_NONE;
+    }
+}
+
 int ffmpeg_rtmp::start_audio_device()
 {
-    QAudioDevice deviceInfo(QMediaDevices::defaultAudioOutput());
+    QAudioDevice deviceInfo;
+    {
+        QMutexLocker locker(&m_audioOutputMutex);
+        deviceInfo = m_audioOutput;
+    }
+    if (deviceInfo.isNull())
+        deviceInfo = QMediaDevices::defaultAudioOutput();
     QAudioFormat format = deviceInfo.preferredFormat();
 
     if (!deviceInfo.isFormatSupported(format)) {
@@ -203,35 +732,75 @@ int ffmpeg_rtmp::start_audio_device()
 #else
     format.setChannelCount(audioCodecContext->ch_layout.nb_channels);
 #endif
-    format.setSampleRate(audioCodecContext->sample_rate);
-    format.setSampleFormat(QAudioFormat::Int16);
+    // The backend's own sample format saves it a conversion, swresample does it here instead
+    AVSampleFormat sampleFormat = sample_format(format.sampleFormat());
+    if (sampleFormat == AV_SAMPLE_FMT_NONE)
+    {
+        format.setSampleFormat(QAudioFormat::Int16);
+        sampleFormat = AV_SAMPLE_FMT_S16;
+    }
     format.setChannelConfig(QAudioFormat::ChannelConfigStereo);
+    // The device keeps its preferred rate, the resampler on the way also absorbs clock drift
+    m_audioConverter.setOutput(sampleFormat, format.channelCount(), format.sampleRate());
+    m_audioConverter.setDriftCompensation(true);
+    m_audioConverter.setRateCorrection(0);
+    m_clockDrift.reset();
+    m_driftLoggedUs = av_gettime_relative();
 
     qDebug() << format.sampleRate() << format.channelCount() << format.sampleFormat();
 
-    m_audioSinkOutput.reset(new QAudioSink(deviceInfo, format));
-    int bufferSize = 4096; // Set your desired buffer size in bytes
-
-    m_audioSinkOutput->setBufferSize(bufferSize);
-
-    m_ioAudioDevice = m_audioSinkOutput->start();
-
-    qreal initialVolume = QAudio::convertVolume(m_audioSinkOutput->volume(),
-                                                QAudio::LinearVolumeScale,
-                                                QAudio::LogarithmicVolumeScale);
-
+    int bufferSize = DEFAULT_SINK_BUFFER_BYTES;
+    if (m_audioBufferMs > 0)
+        bufferSize = format.bytesForDuration(m_audioBufferMs * 1000);
+    else if (m_lowLatency)
+        bufferSize = format.bytesForDuration(LOW_LATENCY_SINK_BUFFER_MS * 1000);
+
+    // The jitter buffer sits in front of the sink's own buffer
+    int targetMs = m_audioLatencyMs;
+    if (targetMs <= 0)
+        targetMs = m_lowLatency ? PLAYOUT_LOW_LATENCY_TARGET_MS : PLAYOUT_DEFAULT_TARGET_MS;
+    if (!m_playout.start(deviceInfo, format, bufferSize, targetMs))
+        return false;
 
-    info = "Audio Device: " + deviceInfo.description() + " Volume: " + QString::number(initialVolume) + " Ch: " + QString::number(format.channelCount());
+    // The backend may round the buffer, report what it actually took
+    double sinkBufferMs = m_playout.stats().sinkBufferMs;
+    info = "Audio Device: " + deviceInfo.description() + " Ch: " + QString::number(format.channelCount())
+            + " Rate: " + QString::number(audioCodecContext->sample_rate) + " -> " + QString::number(format.sampleRate()) + " Hz"
+            + " Buffer: " + QString::number(sinkBufferMs, 'f', 1) + " ms"
+            + " (requested " + QString::number(format.durationForBytes(bufferSize) / 1000.0, 'f', 1) + " ms)"
+            + " Jitter target: " + QString::number(targetMs) + " ms"
+            + " Output latency: " + QString::number(sinkBufferMs + targetMs, 'f', 0) + " ms";
     qDebug() << info;
     emit sendInfo(info);
 
     return true;
 }
 
-int ffmpeg_rtmp::set_audio_device(QAudioDevice &audio_device)
+void ffmpeg_rtmp::configure_decoder_threads()
 {
-    qDebug() << audio_device.description();
-    return -1;
+    int threads = m_settings.threading.threadCount;
+    if (threads <= 0)
+        threads = QThread::idealThreadCount();
+
+    DecoderThreadMode mode = m_settings.threading.mode;
+    // Frame threading delays output by one frame per thread
+    if (m_lowLatency && mode == DecoderThreadMode::Frame)
+        mode = DecoderThreadMode::Slice;
+
+    videoCodecContext->thread_count = threads;
+    switch (mode) {
+    case DecoderThreadMode::Frame:
+        videoCodecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        break;
+    case DecoderThreadMode::Slice:
+        videoCodecContext->thread_type = FF_THREAD_SLICE;
+        break;
+    case DecoderThreadMode::LowLatencySlice:
+        // Low delay without the rest of the low-latency profile
+        videoCodecContext->thread_type = FF_THREAD_SLICE;
+        videoCodecContext->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        break;
+    }
 }
 
 int ffmpeg_rtmp::set_parameters()
@@ -274,101 +843,575 @@ int ffmpeg_rtmp::set_parameters()
     info = "Audio Codec: " + QString(codecAudioName) + " sr: " + QString::number(codecAudioParams->sample_rate);
     emit sendInfo(info);
 #if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
-    info = "Audio Format: " + QString(av_get_sample_fmt_name(audioCodecContext->sample_fmt)) + " Channels: " + QString::number(codecAudioParams->channels);
+    info = "Audio Format: " + QString(av_get_sample_fmt_name(static_cast<AVSampleFormat>(codecAudioParams->format))) + " Channels: " + QString::number(codecAudioParams->channels);
 #else
-    info = "Audio Format: " + QString(av_get_sample_fmt_name(audioCodecContext->sample_fmt)) + " Channels: " + QString::number(codecAudioParams->ch_layout.nb_channels);
+    info = "Audio Format: " + QString(av_get_sample_fmt_name(static_cast<AVSampleFormat>(codecAudioParams->format))) + " Channels: " + QString::number(codecAudioParams->ch_layout.nb_channels);
 #endif
     emit sendInfo(info);
 
     return true;
 }
 
-int ffmpeg_rtmp::init_swr_context(AVSampleFormat out_format)
+bool ffmpeg_rtmp::push_packet(PacketQueue &queue, const AVPacket *packet, PipelineStage *stage)
+{
+    // The clone only takes a new reference on the packet data
+    AVPacket *ref = av_packet_clone(packet);
+    if (!ref)
+        return false;
+    return enqueue_packet(queue, ref, stage);
+}
+
+bool ffmpeg_rtmp::enqueue_packet(PacketQueue &queue, AVPacket *packet, PipelineStage *stage)
 {
+    // Never waits: a full queue is the caller's to drop on
+    bool queued = queue.push(packet);
+    if (!queued)
+        av_packet_free(&packet);
+    stage->notify();
+    return queued;
+}
 
-    swrAudioContext = swr_alloc();
-    if (!swrAudioContext) {
-        fprintf(stderr, "Error allocating SwrContext.\n");
+void ffmpeg_rtmp::push_mux_packet(const AVPacket *packet)
+{
+    // After an overflow the recording resumes on a keyframe, never on a broken GOP
+    if (m_muxDropUntilKeyframe)
+    {
+        if (video_idx >= 0 && !(packet->stream_index == video_idx && (packet->flags & AV_PKT_FLAG_KEY)))
+        {
+            m_muxPacketsDropped++;
+            return;
+        }
+        m_muxDropUntilKeyframe = false;
+    }
+
+    if (!push_packet(m_muxPacketQueue, packet, m_muxStage.get()))
+    {
+        m_muxPacketsDropped++;
+        m_muxDropUntilKeyframe = true;
+    }
+}
+
+void ffmpeg_rtmp::push_flush_markers()
+{
+    // A packet without data flushes the decoder in queue order, after the packets already queued.
+    // A full queue gets the flush request instead, applied to the next packet taken.
+    AVPacket *marker = av_packet_alloc();
+    if (!marker || !enqueue_packet(m_videoPacketQueue, marker, m_videoDecodeStage.get()))
+        m_flushVideoDecoder = true;
+    marker = av_packet_alloc();
+    if (!marker || !enqueue_packet(m_audioPacketQueue, marker, m_audioStage.get()))
+        m_flushAudioDecoder = true;
+}
+
+void ffmpeg_rtmp::drain_queues()
+{
+    AVPacket *packet = nullptr;
+    while (m_videoPacketQueue.pop(packet))
+        av_packet_free(&packet);
+    while (m_audioPacketQueue.pop(packet))
+        av_packet_free(&packet);
+    while (m_muxPacketQueue.pop(packet))
+        av_packet_free(&packet);
+
+    DecodedFrame decoded;
+    while (m_videoFrameQueue.pop(decoded))
+        av_frame_free(&decoded.frame);
+}
+
+bool ffmpeg_rtmp::pump_video_decode()
+{
+    AVPacket *packet = nullptr;
+    if (m_abort || !m_videoPacketQueue.pop(packet))
         return false;
+
+    if (m_flushVideoDecoder.exchange(false) || !packet->data)
+        avcodec_flush_buffers(videoCodecContext);
+    if (!packet->data)
+    {
+        av_packet_free(&packet);
+        return true;
     }
 
-#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
-    av_opt_set_channel_layout(swrAudioContext, "in_channel_layout", audioCodecContext->channel_layout, 0);
-    av_opt_set_channel_layout(swrAudioContext, "out_channel_layout", audioCodecContext->channel_layout, 0);
-#else
-    av_opt_set_chlayout(swrAudioContext, "in_channel_layout", &audioCodecContext->ch_layout, 0);
-    av_opt_set_chlayout(swrAudioContext, "out_channel_layout", &audioCodecContext->ch_layout, 0);
+    int64_t decodeStartUs = av_gettime_relative();
+    int ret = avcodec_send_packet(videoCodecContext, packet);
+    av_packet_free(&packet);
+    if (ret < 0) {
+        std::cout << "video avcodec_send_packet: " << ret << std::endl;
+        return true;
+    }
+
+    while (ret >= 0) {
+        ret = avcodec_receive_frame(videoCodecContext, video_frame);
+        if (ret < 0) {
+            break;
+        }
+        m_videoFramesDecoded++;
+
+        // Wall time spent in the decoder per output frame
+        int64_t decodedUs = av_gettime_relative();
+        m_videoDecodeTime.add((decodedUs - decodeStartUs) / 1000.0);
+        m_videoDecodeTimeMs = m_videoDecodeTime.mean();
+        decodeStartUs = decodedUs;
+        if (m_videoFramesDecoded % DECODE_STATS_INTERVAL == 0)
+            emit sendInfo("Video decode: " + QString::number(m_videoDecodeTimeMs, 'f', 2) + " ms/frame");
+
+        if (!m_firstFrameDecoded)
+        {
+            m_firstFrameDecoded = true;
+            m_timeToFirstFrameMs = (av_gettime_relative() - m_acceptedUs) / 1000.0;
+            emit sendInfo("Time to first frame: " + QString::number(m_timeToFirstFrameMs, 'f', 1) + " ms"
+                          + " (probe " + QString::number(m_probeMs, 'f', 1) + " ms"
+                          + (m_usedCachedParams ? ", cached parameters)" : ")"));
+        }
+
+        DecodedFrame decoded;
+        decoded.timing.decodedUs = decodedUs;
+#ifdef AV_CODEC_FLAG_COPY_OPAQUE
+        decoded.timing.arrivalUs = reinterpret_cast<intptr_t>(video_frame->opaque);
 #endif
-    av_opt_set_int(swrAudioContext, "in_sample_rate", audioCodecContext->sample_rate, 0);
-    av_opt_set_int(swrAudioContext, "out_sample_rate", audioCodecContext->sample_rate, 0);
-    av_opt_set_sample_fmt(swrAudioContext, "in_sample_fmt", audioCodecContext->sample_fmt, 0);
-    av_opt_set_sample_fmt(swrAudioContext, "out_sample_fmt", out_format, 0);
+        if (!decoded.timing.arrivalUs)
+            decoded.timing.arrivalUs = decoded.timing.decodedUs;
 
-    if (swr_init(swrAudioContext) < 0) {
-        fprintf(stderr, "Error initializing SwrContext.\n");
-        return false;
+        // Hand the decoded picture over by reference, the preview may drop it
+        decoded.frame = av_frame_alloc();
+        if (!decoded.frame) {
+            av_frame_unref(video_frame);
+            break;
+        }
+        av_frame_move_ref(decoded.frame, video_frame);
+        if (!m_videoFrameQueue.push(decoded))
+        {
+            av_frame_free(&decoded.frame);
+            m_droppedVideoFrames++;
+        }
+        m_videoConvertStage->notify();
     }
 
     return true;
 }
 
-AVFrame* ffmpeg_rtmp::convert_audio_frame(AVSampleFormat out_format)
+bool ffmpeg_rtmp::pump_video_convert()
 {
-    AVFrame* convertedAudioFrame = av_frame_alloc();
-    if (!convertedAudioFrame) {
-        fprintf(stderr, "Error allocating converted audio AVFrame.\n");
-        return NULL;
+    DecodedFrame decoded;
+    if (m_abort || !m_videoFrameQueue.pop(decoded))
+        return false;
+
+    // Low latency previews only the newest picture
+    DecodedFrame newer;
+    while (m_lowLatency && m_videoFrameQueue.pop(newer))
+    {
+        av_frame_free(&decoded.frame);
+        m_droppedVideoFrames++;
+        decoded = newer;
     }
+    AVFrame *frame = decoded.frame;
+    int64_t ptsUs = AV_NOPTS_VALUE;
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE && vid_stream)
+        ptsUs = av_rescale_q(frame->best_effort_timestamp, vid_stream->time_base, AV_TIME_BASE_Q);
 
-#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
-    convertedAudioFrame->channel_layout = audioCodecContext->channel_layout;
-#else
-    convertedAudioFrame->ch_layout = audioCodecContext->ch_layout;
-#endif
-    convertedAudioFrame->format = out_format;
-    convertedAudioFrame->sample_rate = audioCodecContext->sample_rate;
-    convertedAudioFrame->nb_samples = audio_frame->nb_samples;
+    // YUV is handed to Qt Multimedia as decoded, the frame reference goes with it
+    if (m_previewZeroCopy && AVFrameVideo::supports(frame->format))
+    {
+        PreviewFrame preview;
+        preview.video = AVFrameVideo::wrap(decoded.frame);
+        decoded.frame = nullptr;
+        preview.timing = decoded.timing;
+        preview.timing.convertedUs = av_gettime_relative();
+        preview.ptsUs = ptsUs;
+        m_previewFramesZeroCopy++;
+        post_preview(std::move(preview));
+        return true;
+    }
 
-    if (av_frame_get_buffer(convertedAudioFrame, 0) < 0) {
-        fprintf(stderr, "Error allocating converted frame buffer.\n");
-        av_frame_free(&convertedAudioFrame);
-        return NULL;
+    PreviewFrame preview;
+    if (m_previewConverter.convert(frame, preview.image, QSize(m_previewWidth, m_previewHeight)))
+    {
+        preview.timing = decoded.timing;
+        preview.timing.convertedUs = av_gettime_relative();
+        preview.ptsUs = ptsUs;
+        post_preview(std::move(preview));
     }
-    swr_convert_frame(swrAudioContext, convertedAudioFrame, audio_frame);
-    return convertedAudioFrame;
+    av_frame_free(&decoded.frame);
+
+    PreviewConverterStats convertStats = m_previewConverter.stats();
+    if (convertStats.framesConverted && convertStats.framesConverted % DECODE_STATS_INTERVAL == 0)
+        emit sendInfo(QString("Preview convert (%1): %2 ms/frame in %3 slices, %4 buffer allocations, %5 context rebuilds")
+                      .arg(convertStats.path).arg(convertStats.convertTimeMs, 0, 'f', 2).arg(convertStats.slices)
+                      .arg(convertStats.bufferAllocations).arg(convertStats.contextRebuilds));
+    return true;
 }
 
-void ffmpeg_rtmp::start_streamer()
+void ffmpeg_rtmp::post_preview(PreviewFrame &&preview)
 {
-    while (!prepare_ffmpeg())
+    preview.sequence = ++m_previewSequence;
+    if (!m_avSyncActive)
     {
-//        emit sendConnectionStatus(false);
-        QThread::msleep(100);
+        m_previewMailbox.post(std::move(preview));
+        return;
     }
 
-    if (!start_audio_device())
+    // A failed push leaves the frame untouched
+    if (m_previewQueue.push(std::move(preview)))
     {
-        emit sendConnectionStatus(false);
+        m_avSyncQueueFull = false;
         return;
     }
 
+    // Audio further behind than the queue holds (frame rate above AV_SYNC_MAX_FPS, or a
+    // stalled GUI): the newest frame is shown unsynchronised rather than an old one in sync
+    m_avSyncFallbacks++;
+    if (!m_avSyncQueueFull)
+    {
+        m_avSyncQueueFull = true;
+        emit sendInfo(QString("A/V sync: video is more than %1 frames ahead of the audio, showing the newest frames unsynchronised")
+                      .arg(AV_SYNC_QUEUE_SIZE));
+    }
+    m_previewMailbox.post(std::move(preview));
+}
+
+bool ffmpeg_rtmp::pump_audio()
+{
+    AVPacket *packet = nullptr;
+    if (m_abort || !m_audioPacketQueue.pop(packet))
+        return false;
+
+    if (m_flushAudioDecoder.exchange(false) || !packet->data)
+        avcodec_flush_buffers(audioCodecContext);
+    if (!packet->data)
+    {
+        av_packet_free(&packet);
+        return true;
+    }
+
+    // A new output is opened in place, the ring starts over and the jitter buffer refills
+    if (m_audioOutputChanged.exchange(false))
+    {
+        m_audioDeviceFailed = false;
+        if (m_playout.isRunning())
+            m_playout.stop();
+    }
+
+    // Opened once the decoder knows the stream's layout and rate
+    if (!m_playout.isRunning() && !m_audioDeviceFailed && !start_audio_device())
+    {
+        m_audioDeviceFailed = true;
+        emit sendInfo("Audio playout disabled.");
+    }
+
+    int ret = avcodec_send_packet(audioCodecContext, packet);
+    av_packet_free(&packet);
+    if (ret < 0) {
+        std::cout << "audio avcodec_send_packet: " << ret << std::endl;
+        return true;
+    }
+
+    while (ret >= 0) {
+        ret = avcodec_receive_frame(audioCodecContext, audio_frame);
+        if (ret < 0) {
+            break;
+        }
+
+        // Every sample format and layout ends up as the sink's packed format
+        const uint8_t *pcm = nullptr;
+        int bytesToWrite = 0;
+        if (m_playout.isRunning() && m_audioConverter.convert(audio_frame, pcm, bytesToWrite))
+        {
+            // The sink pulls on its own thread, a full buffer drops this frame instead of waiting
+            // Stamped with the stream time at the end of the frame, the playout clock follows it
+            int64_t ptsEndUs = AV_NOPTS_VALUE;
+            if (audio_frame->best_effort_timestamp != AV_NOPTS_VALUE && audio_frame->sample_rate > 0)
+                ptsEndUs = av_rescale_q(audio_frame->best_effort_timestamp, aud_stream->time_base, AV_TIME_BASE_Q)
+                           + av_rescale(audio_frame->nb_samples, AV_TIME_BASE, audio_frame->sample_rate);
+            m_playout.push(reinterpret_cast<const char*>(pcm), bytesToWrite, ptsEndUs);
+
+            // Publisher and soundcard clocks drift apart, the resampler absorbs it before the buffer does
+            PlayoutStats fill = m_playout.stats();
+            int64_t nowUs = av_gettime_relative();
+            if (!fill.buffering && m_clockDrift.update(nowUs, fill.bufferedMs, fill.targetMs))
+            {
+                m_audioConverter.setRateCorrection(m_clockDrift.correctionPpm());
+                if (nowUs - m_driftLoggedUs >= DRIFT_LOG_INTERVAL_US)
+                {
+                    m_driftLoggedUs = nowUs;
+                    emit sendInfo(QString("Audio clock drift: %1 ppm, correction %2 ppm, buffer %3 ms off target")
+                                  .arg(m_clockDrift.driftPpm(), 0, 'f', 1).arg(m_clockDrift.correctionPpm(), 0, 'f', 1)
+                                  .arg(m_clockDrift.fillErrorMs(), 0, 'f', 1));
+                }
+            }
+
+            AudioConverterStats convertStats = m_audioConverter.stats();
+            if (convertStats.framesConverted % DECODE_STATS_INTERVAL == 0)
+            {
+                emit sendInfo(QString("Audio convert (%1 %2ch %3 Hz): %4 us/frame, %5 buffer allocations, %6 context rebuilds")
+                              .arg(convertStats.inputFormat).arg(convertStats.inputChannels).arg(convertStats.inputRate)
+                              .arg(convertStats.convertTimeUs, 0, 'f', 1).arg(convertStats.bufferAllocations)
+                              .arg(convertStats.contextRebuilds));
+                PlayoutStats playoutStats = m_playout.stats();
+                emit sendInfo(QString("Audio playout: %1 ms buffered (target %2 ms), %3 underruns, %4 overruns (%5 ms dropped), %6 ms trimmed")
+                              .arg(playoutStats.bufferedMs, 0, 'f', 0).arg(playoutStats.targetMs, 0, 'f', 0)
+                              .arg(playoutStats.underruns).arg(playoutStats.overruns)
+                              .arg(playoutStats.droppedMs, 0, 'f', 0).arg(playoutStats.trimmedMs, 0, 'f', 0));
+                if (m_avSyncActive)
+                    emit sendInfo(QString("A/V sync: video %1 ms off the audio clock, %2 frames dropped late, %3 refreshes held, %4 frames unsynchronised")
+                                  .arg(m_avSyncOffsetMs.load(), 0, 'f', 1).arg(m_avSyncDroppedLate.load())
+                                  .arg(m_avSyncHeld.load()).arg(m_avSyncFallbacks.load()));
+            }
+        }
+
+        // Analysis views read a copy, never the buffer the sink is fed from
+        int analysisBytes = 0;
+        if (m_analysisRing.hasReaders() && m_analysisConverter.convert(audio_frame, pcm, analysisBytes))
+        {
+            m_analysisRing.setSampleRate(audio_frame->sample_rate);
+            m_analysisRing.write(reinterpret_cast<const float*>(pcm), analysisBytes / sizeof(float));
+        }
+
+        av_frame_unref(audio_frame);
+    }
+
+    return true;
+}
+
+bool ffmpeg_rtmp::pump_mux()
+{
+    AVPacket *packet = nullptr;
+    if (m_abort || !m_muxPacketQueue.pop(packet))
+        return false;
+
+    int ret = m_recorder->write(packet);
+    if (ret < 0) {
+        if (ret == AVERROR(EAGAIN)) {
+            // Handle EAGAIN error
+        } else if (ret == AVERROR_EOF) {
+            // Handle EOF error
+        } else {
+            // Handle other errors
+            char error_buffer[AV_ERROR_MAX_STRING_SIZE];
+            av_strerror(ret, error_buffer, sizeof(error_buffer));
+            qDebug() << "Error writing frame: " << error_buffer;
+        }
+    }
+    else
+    {
+        m_packetsMuxed++;
+    }
+
+    av_packet_free(&packet);
+    return true;
+}
+
+bool ffmpeg_rtmp::pump_timeshift()
+{
+    // Takes the decoder queues only while the demux thread has handed them over
+    DecoderFeed handedOver = DecoderFeed::HandedOver;
+    bool replayed = false;
+    if (m_decoderFeed.compare_exchange_strong(handedOver, DecoderFeed::Replaying))
+    {
+        replayed = replay_packet();
+        m_decoderFeed = DecoderFeed::HandedOver;
+    }
+    else
+    {
+        m_replayClockValid = false;
+        m_replayWaitUs = 0;
+    }
+
+    // Paced replay waits here for its next packet instead of idling on the stage, which
+    // would only wake on the next notify. While live the stage idles.
+    if (!replayed && m_replayWaitUs > 0 && !m_abort)
+    {
+        QThread::usleep(m_replayWaitUs);
+        m_replayWaitUs = 0;
+        return true;
+    }
+    return replayed;
+}
+
+bool ffmpeg_rtmp::replay_packet()
+{
+    if (m_abort || !m_timeshift || !m_decodeActive
+            || m_previewMode != PreviewMode::Timeshift)
+    {
+        m_replayClockValid = false;
+        return false;
+    }
+
+    uint64_t seq = 0;
+    if (m_seekPending.exchange(false))
+    {
+        int64_t targetUs = m_previewPositionUs + m_seekOffsetUs;
+        if (targetUs >= m_timeshift->endTimeUs())
+        {
+            m_previewMode = PreviewMode::Live;
+            return false;
+        }
+        if (m_timeshift->keyframeAt(targetUs, seq))
+            restart_replay(seq);
+    }
+    else if (m_timeshiftCursor < m_timeshift->firstSeq())
+    {
+        // Paused for longer than the buffer holds, continue from the oldest keyframe
+        if (!m_timeshift->keyframeAt(m_timeshift->startTimeUs(), seq))
+            return false;
+        restart_replay(seq);
+    }
+
+    int64_t timeUs = 0;
+    if (!m_timeshift->read(m_timeshiftCursor, m_replayPacket, &timeUs))
+        return false;
+
+    // Real-time pace from the first packet after a seek or resume
+    int64_t nowUs = av_gettime_relative();
+    if (!m_replayClockValid)
+    {
+        m_replayClockValid = true;
+        m_replayWallBaseUs = nowUs;
+        m_replayTimeBaseUs = timeUs;
+    }
+    if (timeUs - m_replayTimeBaseUs > nowUs - m_replayWallBaseUs)
+    {
+        m_replayWaitUs = std::min<int64_t>(timeUs - m_replayTimeBaseUs - (nowUs - m_replayWallBaseUs),
+                                           TIMESHIFT_IDLE_MS * 1000);
+        av_packet_unref(m_replayPacket);
+        return false;
+    }
+
+    // Latency figures measure from the replay, not from the original arrival
+    m_replayPacket->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(nowUs));
+    bool queued = dispatch_to_decoders(m_replayPacket);
+    av_packet_unref(m_replayPacket);
+    if (!queued)
+    {
+        // The buffer still holds the packet, it is tried again once the decoder catches up
+        m_replayWaitUs = STAGE_IDLE_SLEEP_US;
+        return false;
+    }
+
+    m_previewPositionUs = timeUs;
+    m_timeshiftCursor++;
+    return true;
+}
+
+void ffmpeg_rtmp::restart_replay(uint64_t seq)
+{
+    // Queued packets belong to the old position, the markers flush after them
+    push_flush_markers();
+    m_timeshiftCursor = seq;
+    m_replayClockValid = false;
+
+    int64_t timeUs = 0;
+    if (m_timeshift->read(seq, m_replayPacket, &timeUs))
+    {
+        av_packet_unref(m_replayPacket);
+        m_previewPositionUs = timeUs;
+        emit sendInfo("Preview at -" + QString::number((m_timeshiftEndUs - timeUs) / 1000000.0, 'f', 1) + " s");
+    }
+}
+
+void ffmpeg_rtmp::close_ffmpeg()
+{
+    // Finishes the current segment, the next publisher starts a new one
+    m_recorder->close();
+
+    avformat_close_input(&inputContext);
+    close_decoders();
+
+    vid_stream = nullptr;
+    aud_stream = nullptr;
+    video_idx = -1;
+    audio_idx = -1;
+}
+
+void ffmpeg_rtmp::start_streamer()
+{
     // Print the video codec
     if (video_idx != -1 && audio_idx != -1) {
         if (!set_parameters())
-        {
-            emit sendConnectionStatus(false);
             return;
-        }
-
     } else {
         info = "Video or Audio stream not found ";
         emit sendInfo(info);
         return;
     }
 
+    m_connectedSinceUs = av_gettime_relative();
+    m_connected = true;
     emit sendConnectionStatus(true);
 
-    // Read packets from the input stream and write to the output file
+    // Demux runs on this thread, everything downstream is a separate stage
+    m_demuxFinished = false;
+    m_packetsIn = 0;
+    m_bytesIn = 0;
+    m_videoFramesDecoded = 0;
+    m_droppedVideoFrames = 0;
+    m_packetsMuxed = 0;
+    m_decoderPacketsDropped = 0;
+    m_muxPacketsDropped = 0;
+    m_muxDropUntilKeyframe = false;
+    m_previewFramesZeroCopy = 0;
+
+    // A new publisher starts with an empty buffer and a live preview
+    int timeshiftSeconds = m_timeshiftSeconds;
+    if (timeshiftSeconds <= 0)
+        m_timeshift.reset();
+    else if (!m_timeshift || m_timeshift->windowSeconds() != timeshiftSeconds)
+        m_timeshift.reset(new TimeshiftBuffer(timeshiftSeconds));
+    if (m_timeshift)
+        m_timeshift->reset(inputContext, video_idx);
+    m_previewMode = PreviewMode::Live;
+    m_playout.setPaused(false);
+    m_seekPending = false;
+    m_feedingLive = true;
+    m_decoderFeed = DecoderFeed::Live;
+    m_timeshiftEndUs = AV_NOPTS_VALUE;
+    m_previewPositionUs = AV_NOPTS_VALUE;
+    m_replayPacket = av_packet_alloc();
+
+    auto inputDone = [this] { return m_stop || m_demuxFinished; };
+    m_videoDecodeStage.reset(new PipelineStage("video decode", [this] { return pump_video_decode(); }, inputDone));
+    m_videoConvertStage.reset(new PipelineStage("video convert", [this] { return pump_video_convert(); },
+                                                [this] { return m_stop || m_videoDecodeStage->isFinished(); }));
+    m_audioStage.reset(new PipelineStage("audio", [this] { return pump_audio(); }, inputDone));
+    m_muxStage.reset(new PipelineStage("mux", [this] { return pump_mux(); }, inputDone));
+    // Nothing to replay without the buffer
+    if (m_timeshift)
+        m_timeshiftStage.reset(new PipelineStage("timeshift", [this] { return pump_timeshift(); }, inputDone));
+    else
+        m_timeshiftStage.reset();
+
+    // The sink is opened lazily by the first decoded audio
+    m_audioDeviceFailed = false;
+    m_audioStage->setThreadHooks(nullptr, [this] {
+        m_playout.stop();
+    });
+
+    // Outputs are listed only once started, stats() may look at them any time
+    for (const QString &target : std::as_const(m_settings.restreamTargets))
+    {
+        RestreamOutput *output = new RestreamOutput(target);
+        connect(output, &RestreamOutput::sendInfo, this, &ffmpeg_rtmp::sendInfo);
+        output->start(inputContext, video_idx);
+        QMutexLocker locker(&m_outputsMutex);
+        m_outputs.push_back(output);
+    }
+
+    if (m_settings.ladder.enabled)
+        m_ladder->start(m_settings.ladder, inputContext, video_idx, audio_idx);
+
+    // Only CPU-bound stages go on the shared pool, a stage that can wait on a device or the
+    // disk would hold a pool thread that another session's decoder needs
+    m_videoDecodeStage->start(m_workerPool);
+    m_videoConvertStage->start(m_workerPool);
+    m_audioStage->start();
+    m_muxStage->start();
+    // Paced replay sleeps between packets, it keeps its own thread
+    if (m_timeshiftStage)
+        m_timeshiftStage->start();
+
+    double startup = (av_gettime_relative() - m_acceptedUs) / 1000.0;
+    emit sendInfo("Startup latency: " + QString::number(startup, 'f', 1) + " ms");
+
+    // Read packets from the input stream and pass references to the stages
     AVPacket* packet = av_packet_alloc();
 
     while (!m_stop)
@@ -377,182 +1420,103 @@ void ffmpeg_rtmp::start_streamer()
         if(ret < 0)
         {
             std::cout << "av_read_frame : no packet!" << std::endl;
-            m_stop = true;
             break;
         }
 
-        AVStream* inputStream = inputContext->streams[packet->stream_index];
-        AVStream* outputStream = outputContext->streams[packet->stream_index];
-
         if (packet->stream_index >= 0 && (unsigned int)packet->stream_index < inputContext->nb_streams)
         {
-
-            if (packet->stream_index == audio_idx)
-            {
-                int ret = avcodec_send_packet(audioCodecContext, packet);
-                if (ret < 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    std::cout << "audio avcodec_send_packet: " << ret << std::endl;
-                    break;
-                }
-
-                while (ret >= 0) {
-                    ret = avcodec_receive_frame(audioCodecContext, audio_frame);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        break;
-                    }
-
-                    if (m_ioAudioDevice)
-                    {
-                        if (av_sample_fmt_is_planar(audioCodecContext->sample_fmt) == 1)
-                        {
-                            // Calculate the total number of samples in the frame
-                            int numSamples = audio_frame->nb_samples;
-                            int channels = audioCodecContext->ch_layout.nb_channels;
-
-                            // Allocate memory for the PCM 16-bit frame
-                            int16_t* pcm16Frame = new int16_t[numSamples * channels];
-                            auto f_contstant = 32767.0f;
-
-                            // Convert planar float frame to PCM 16-bit frame
-                            for (int i = 0; i < numSamples; ++i)
-                            {
-                                const float* const* planarFloatData = reinterpret_cast<const float* const*>(audio_frame->extended_data);
-
-                                for (int channel = 0; channel < channels; ++channel)
-                                {
-                                    // Scale the float sample to the range of int16_t (-32768 to 32767)
-                                    float scaledSample = planarFloatData[channel][i] * f_contstant;
-
-                                    // Clamp the sample value to the valid range of int16_t
-                                    scaledSample = std::clamp<float>(scaledSample, -1 * f_contstant, f_contstant);
-
-                                    // Convert to int16_t with rounding
-                                    pcm16Frame[i * channels + channel] = static_cast<int16_t>(scaledSample + 0.5f);
-                                }
-                            }
-
-                            int bytesToWrite = numSamples * channels * sizeof(int16_t);
-
-                            // Write the PCM 16-bit frame to m_ioAudioDevice
-                            const char* pcm16FramePtr = reinterpret_cast<const char*>(pcm16Frame);
-                            emit sendAudioFrame(pcm16FramePtr, bytesToWrite);
-
-                            qint64 totalBytesWritten = 0;
-
-                            while (totalBytesWritten < bytesToWrite) {
-                                qint64 bytesWritten = m_ioAudioDevice->write(pcm16FramePtr + totalBytesWritten, bytesToWrite - totalBytesWritten);
-                                if (bytesWritten == -1) {
-                                    // Handle the error case
-                                    break;
-                                }
-                                totalBytesWritten += bytesWritten;
-                            }
-
-                            // Clean up the allocated memory
-                            delete[] pcm16Frame;
-                        }
-                        else
-                        {
-                            m_ioAudioDevice->write(reinterpret_cast<char*>(audio_frame->data[0]), audio_frame->linesize[0]);
-                        }
-                    }
-
-                    av_frame_unref(audio_frame);
-                }
-            }
-            // for preview
-            else if (packet->stream_index == video_idx)
-            {
-                int ret = avcodec_send_packet(videoCodecContext, packet);
-                if (ret < 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    std::cout << "video avcodec_send_packet: " << ret << std::endl;
-                    break;
-                }
-                while (ret  >= 0) {
-                    ret = avcodec_receive_frame(videoCodecContext, video_frame);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        //std::cout << "video avcodec_receive_frame: " << ret << std::endl;
-                        break;
-                    }
-
-                    SwsContext* swsContext = sws_getContext(video_frame->width, video_frame->height, videoCodecContext->pix_fmt,
-                                                            video_frame->width, video_frame->height, AV_PIX_FMT_RGB32,
-                                                            SWS_BILINEAR, nullptr, nullptr, nullptr);
-                    if (!swsContext) {
-                        std::cout << "Failed to create SwsContext" << std::endl;
-                        break;
-                    }
-
-                    // Initialize the SwsContext
-                    auto ret = sws_init_context(swsContext, nullptr, nullptr);
-                    if (ret < 0) {
-                        std::cout << "Failed to init SwsContext" << std::endl;
-                        break;
-                    }
-
-                    uint8_t* destData[1] = { nullptr };
-                    int destLinesize[1] = { 0 };
-
-                    QImage image(video_frame->width, video_frame->height, QImage::Format_RGB32);
-
-                    destData[0] = image.bits();
-                    destLinesize[0] = image.bytesPerLine();
-
-                    sws_scale(swsContext, video_frame->data, video_frame->linesize, 0, video_frame->height, destData, destLinesize);
-                    emit sendVideoFrame(image);
-
-                    // Cleanup
-                    sws_freeContext(swsContext);
-                    av_frame_unref(video_frame);
-                }
-            }
-
-            // Rescale packet timestamps
-            packet->pts = av_rescale_q(packet->pts, inputStream->time_base, outputStream->time_base);
-            packet->dts = av_rescale_q(packet->dts, inputStream->time_base, outputStream->time_base);
-            packet->duration = av_rescale_q(packet->duration, inputStream->time_base, outputStream->time_base);
-            packet->pos = -1;
-
-            int ret = av_interleaved_write_frame(outputContext, packet);
-            if (ret < 0) {
-                if (ret == AVERROR(EAGAIN)) {
-                    // Handle EAGAIN error
-                } else if (ret == AVERROR_EOF) {
-                    // Handle EOF error
-                } else {
-                    // Handle other errors
-                    char error_buffer[AV_ERROR_MAX_STRING_SIZE];
-                    av_strerror(ret, error_buffer, sizeof(error_buffer));
-                    qDebug() << "Error writing frame: " << error_buffer;
-                }
-            }
+            m_packetsIn++;
+            m_bytesIn += packet->size;
+            packet->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(av_gettime_relative()));
+
+            if (m_timeshift)
+                m_timeshiftEndUs = m_timeshift->append(packet);
+            feed_decoders(packet);
+            push_mux_packet(packet);
+            for (RestreamOutput *output : m_outputs)
+                output->push(packet);
+            m_ladder->push(packet);
         }
 
         av_packet_unref(packet);
     }
 
-    emit sendConnectionStatus(false);
-    m_audioSinkOutput->stop();
+    av_packet_free(&packet);
 
-    // Write the output file trailer
-    av_write_trailer(outputContext);
+    // Let the stages drain what is already queued, then tear down
+    m_demuxFinished = true;
+    // The replay feeds the decoders, it has to end before them
+    if (m_timeshiftStage)
+        m_timeshiftStage->wait();
+    m_videoDecodeStage->wait();
+    m_videoConvertStage->wait();
+    m_audioStage->wait();
+    m_muxStage->wait();
+    drain_queues();
+    av_packet_free(&m_replayPacket);
 
-    // Close input and output contexts
-    avformat_close_input(&inputContext);
-    if (outputContext && !(outputContext->oformat->flags & AVFMT_NOFILE))
-        avio_close(outputContext->pb);
-    avformat_free_context(outputContext);
+    // Encoders are drained so the last HLS segments are complete
+    m_ladder->stop();
 
-    if (m_stop)
+    std::vector<RestreamOutput*> outputs;
+    {
+        QMutexLocker locker(&m_outputsMutex);
+        outputs.swap(m_outputs);
+    }
+    for (RestreamOutput *output : outputs)
     {
-        run();
+        RestreamStats outputStats = output->stats();
+        emit sendInfo(QString("Restream %1: %2 packets, %3 dropped, %4 reconnects")
+                      .arg(outputStats.target).arg(outputStats.packetsWritten)
+                      .arg(outputStats.packetsDropped).arg(outputStats.reconnects));
+        // Files are finished with a trailer here
+        delete output;
     }
 
+    if (m_droppedVideoFrames > 0)
+        emit sendInfo("Preview dropped frames: " + QString::number(m_droppedVideoFrames));
+    if (m_decoderPacketsDropped > 0 || m_muxPacketsDropped > 0)
+        emit sendInfo(QString("Packets dropped on full queues: %1 before the decoders, %2 before the recorder")
+                      .arg(m_decoderPacketsDropped.load()).arg(m_muxPacketsDropped.load()));
+
+    m_connected = false;
+    emit sendConnectionStatus(false);
 }
 
 void ffmpeg_rtmp::run()
 {
     m_stop = false;
-    emit sendInfo("Rtmp stream server is listening.");
-    start_streamer();
+
+    // Each pass serves one publisher, stop() ends the loop and restart() only the pass
+    while (!m_stop)
+    {
+        m_abort = false;
+        set_state(SessionState::Listening);
+        emit sendInfo("Rtmp stream server is listening.");
+
+        if (prepare_ffmpeg())
+        {
+            set_state(SessionState::Streaming);
+            start_streamer();
+        }
+
+        set_state(SessionState::Stopping);
+        close_ffmpeg();
+
+        if (m_abortRequestedUs)
+        {
+            double latency = (av_gettime_relative() - m_abortRequestedUs) / 1000.0;
+            m_abortRequestedUs = 0;
+            emit sendInfo("Teardown latency: " + QString::number(latency, 'f', 1) + " ms");
+        }
+        else if (!m_connectedSinceUs && !m_stop)
+        {
+            // Failed before a publisher showed up, do not spin on an unusable port
+            for (int i = 0; i < 10 && !m_abort; ++i)
+                QThread::msleep(10);
+        }
+        m_connectedSinceUs = 0;
+    }
+
+    set_state(SessionState::Idle);
 }
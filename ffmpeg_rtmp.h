@@ -9,6 +9,7 @@
 #include <fstream>
 #include <cstdint>
 #include <algorithm>
+#include <atomic>
 
 #include <QDebug>
 #include <QThread>
@@ -18,6 +19,8 @@
 #include <QMediaDevices>
 #include <QAudioSink>
 #include <QMediaMetaData>
+#include <QMutex>
+#include <memory>
 
 
 #ifdef _WIN32
@@ -36,6 +39,7 @@ extern "C"
 #include <libavformat/avio.h>
 #include <libavutil/log.h>
 #include <libavformat/version.h>
+#include <libavutil/time.h>
 };
 #else
 //Linux...
@@ -55,49 +59,404 @@ extern "C"
 #include <libavformat/avio.h>
 #include <libavutil/log.h>
 #include <libavformat/version.h>
+#include <libavutil/time.h>
 #ifdef __cplusplus
 };
 #endif
 #endif
 
+#include "spsc_queue.h"
+#include "pipeline_stage.h"
+#include "rolling_average.h"
+#include "segment_recorder.h"
+#include "timeshift_buffer.h"
+#include "restream_output.h"
+#include "transcode_ladder.h"
+#include "preview_converter.h"
+#include "audio_converter.h"
+#include "audio_ring.h"
+#include "audio_playout.h"
+#include "clock_drift.h"
+#include "avframe_video_buffer.h"
+#include "latest_mailbox.h"
+
+#define VIDEO_PACKET_QUEUE_SIZE     512
+#define AUDIO_PACKET_QUEUE_SIZE     512
+#define MUX_PACKET_QUEUE_SIZE       1024
+#define VIDEO_FRAME_QUEUE_SIZE      8
+#define DEFAULT_RTMP_PORT           8889
+#define FAST_START_PROBE_SIZE       65536
+#define FAST_START_ANALYZE_US       500000
+#define FULL_PROBE_SIZE             5000000     // FFmpeg's default probesize
+#define CACHED_PROBE_SIZE           32
+#define CACHED_ANALYZE_DURATION_US  1
+
+#define LOW_LATENCY_SINK_BUFFER_MS  20
+#define DEFAULT_SINK_BUFFER_BYTES   4096
+#define ANALYSIS_RING_SAMPLES       65536
+#define AV_SYNC_MAX_FPS             60
+#define AV_SYNC_MAX_SINK_MS         160         // largest device buffer offered in the GUI
+// Video waits behind the audio for the jitter buffer and the device buffer, at most this many frames
+#define AV_SYNC_QUEUE_SIZE          ((PLAYOUT_MAX_TARGET_MS + AV_SYNC_MAX_SINK_MS) * AV_SYNC_MAX_FPS / 1000)
+#define AV_SYNC_TOLERANCE_US        8000        // about half a refresh interval
+#define AV_SYNC_MAX_OFFSET_US       1000000     // beyond this the timestamps jumped, present at once
+
+// The pooled preview images also cover the one on screen, the one held back, the mailbox and the converter
+static_assert(AV_SYNC_QUEUE_SIZE + 4 <= PREVIEW_POOL_SIZE, "PREVIEW_POOL_SIZE is too small for the A/V sync queue");
+
+enum class LatencyProfile
+{
+    Default,
+    LowLatency
+};
+
+enum class DecoderThreadMode
+{
+    Frame,              // frame + slice threads, best throughput, adds a frame of delay per thread
+    Slice,              // slice threads only
+    LowLatencySlice     // Slice plus AV_CODEC_FLAG_LOW_DELAY, which the low-latency profile sets anyway
+};
+
+struct DecoderThreading
+{
+    int threadCount {0};    // 0 picks the core count
+    DecoderThreadMode mode {DecoderThreadMode::Frame};
+};
+
+#define DECODE_STATS_INTERVAL       300
+#define TIMESHIFT_IDLE_MS           10      // longest paced replay sleep
+
+// Where the preview is fed from, recording always follows the live input
+enum class PreviewMode
+{
+    Live,
+    Paused,
+    Timeshift       // replayed from the time-shift buffer at real-time pace
+};
+
+// Which thread may push into the decoder queues, changed only by compare-exchange
+enum class DecoderFeed
+{
+    Live,           // the demux thread
+    HandedOver,     // nobody: the replay may take the queues, the demux thread may take them back
+    Replaying       // the time-shift stage, for the packet it is replaying
+};
+
+// Monotonic timestamps (av_gettime_relative) of one video frame through the preview path
+struct FrameTiming
+{
+    int64_t arrivalUs {0};
+    int64_t decodedUs {0};
+    int64_t convertedUs {0};
+};
+Q_DECLARE_METATYPE(FrameTiming)
+
+// Preview picture for the GUI: YUV for Qt Multimedia, or RGB from the converter
+struct PreviewFrame
+{
+    QVideoFrame video;
+    QImage image;
+    FrameTiming timing;
+    int64_t ptsUs {AV_NOPTS_VALUE};     // stream time, comparable with the audio clock
+    uint64_t sequence {0};              // convert order, across the queue and the mailbox
+};
+
+struct DecodedFrame
+{
+    AVFrame *frame {nullptr};
+    FrameTiming timing;
+};
+
+typedef SpscQueue<AVPacket*> PacketQueue;
+typedef SpscQueue<DecodedFrame> FrameQueue;
+
+enum class SessionState
+{
+    Idle,
+    Listening,
+    Streaming,
+    Stopping
+};
+
+// Stream probing for a new publisher, fastStart off keeps FFmpeg's defaults
+struct ProbeSettings
+{
+    bool fastStart {true};
+    int64_t probeSize {FAST_START_PROBE_SIZE};
+    int64_t analyzeDurationUs {FAST_START_ANALYZE_US};
+    int fpsProbeSize {0};
+};
+
+// Everything a publisher is set up with. The setters fill a pending copy from any
+// thread, each publisher runs on the snapshot taken when it connects.
+struct SessionSettings
+{
+    ProbeSettings probe;
+    DecoderThreading threading;
+    RecorderSettings recorder;
+    LadderSettings ladder;
+    QStringList restreamTargets;
+};
+
+struct SessionStats
+{
+    SessionState state {SessionState::Idle};
+    bool connected {false};
+    qint64 uptimeMs {0};
+    quint64 packetsIn {0};
+    quint64 bytesIn {0};
+    quint64 videoFramesDecoded {0};
+    quint64 droppedVideoFrames {0};
+    quint64 packetsMuxed {0};
+    quint64 decoderPacketsDropped {0};      // queue full, the decoders were behind
+    quint64 muxPacketsDropped {0};          // queue full, the recorder was behind
+    double timeToFirstFrameMs {0};
+    double videoDecodeTimeMs {0};
+    PreviewConverterStats preview;
+    quint64 previewFramesZeroCopy {0};
+    quint64 previewFramesDisplayed {0};
+    quint64 previewFramesOverwritten {0};   // dropped before the GUI took them, or superseded unsynchronised
+    bool avSyncActive {false};              // presenting against the audio clock
+    double avSyncOffsetMs {0};              // video pts minus audio clock when shown, positive is video ahead
+    quint64 avSyncDroppedLate {0};          // due but superseded by a later due frame in the same refresh
+    quint64 avSyncHeld {0};                 // refreshes that kept an early frame back
+    quint64 avSyncFallbacks {0};            // frames that found the sync queue full and went through the mailbox
+    AudioConverterStats audio;
+    PlayoutStats playout;
+    double audioDriftPpm {0};        // publisher clock against the soundcard, positive when the publisher is fast
+    PreviewMode previewMode {PreviewMode::Live};
+    double previewDelayMs {0};
+    AsyncWriterStats recorder;
+    QList<RestreamStats> outputs;
+    QList<RenditionStats> renditions;
+};
+
 class ffmpeg_rtmp : public QThread
 {
     Q_OBJECT
 public:
     explicit ffmpeg_rtmp(QObject *parent = nullptr);
     void stop();
+    void restart();
+    SessionState state() const { return m_state; }
+    bool stopRequested() const { return m_stop; }
     void setUrl();
-    int set_audio_device(QAudioDevice&);
+    void setUrl(const QString &host, int port, const QString &streamKey);
+    QString url() const { return in_filename; }
+    void setWorkerPool(QThreadPool *pool);
+    // Applied when the next publisher connects
+    void setProbeSettings(const ProbeSettings &settings);
+    // Applied when the next publisher connects
+    void setLatencyProfile(LatencyProfile profile);
+    void setDecoderThreading(const DecoderThreading &threading);
+    // Off is record-only: packets go straight to the muxer and no decoder is created
+    void setDecodeEnabled(bool enabled);
+    bool decodeEnabled() const { return m_decodeEnabled; }
+    // Applied when the next publisher connects
+    void setRecorderSettings(const RecorderSettings &settings);
+    // Applied when the next publisher connects
+    void setLadderSettings(const LadderSettings &settings);
+    // Restream destinations for the next publisher, see RestreamOutput
+    void setRestreamTargets(const QStringList &targets);
+    // Seconds of packets kept for pausing and rewinding the preview, off (0) by default. Applied on connect.
+    void setTimeshiftSeconds(int seconds);
+    void pausePreview();
+    void resumePreview();
+    // Relative to the current preview position, negative rewinds
+    void seekPreview(double offsetSeconds);
+    void goLivePreview();
+    PreviewMode previewMode() const { return m_previewMode; }
+    // Size of the preview on screen in device pixels, frames are converted straight to it
+    void setPreviewSize(const QSize &size);
+    // Threads converting one preview frame, 0 picks from the core count
+    void setPreviewThreads(int threads);
+    // Off converts 4:2:0 previews with swscale instead of the SIMD kernels
+    void setPreviewKernels(bool enabled);
+    // On hands YUV frames over as QVideoFrames, other formats still go through the converter
+    void setPreviewZeroCopy(bool enabled);
+    // Jitter buffer target for audio playout, 0 picks one from the latency profile. Applied on connect.
+    void setAudioLatency(int milliseconds);
+    // Output device and its buffer, a null device is the system default and 0 ms picks the buffer
+    // from the latency profile. A playing stream moves over at its next audio packet, the
+    // decoders and the connection carry on.
+    void setAudioOutput(const QAudioDevice &device, int bufferMs);
+    // Off shows every preview frame as soon as it is converted
+    void setAvSyncEnabled(bool enabled);
+    // GUI thread only, once per refresh: the frame to show now against the audio clock,
+    // or the newest one when there is no clock. Never waits on the decoder.
+    bool takePreviewFrame(PreviewFrame &frame);
+    // Mono float mix of the decoded audio for spectrum and level views, each view adds its own reader
+    AudioRing &analysisRing() { return m_analysisRing; }
+    SessionStats stats() const;
+
+    static QString localAddress();
 private:
     int prepare_ffmpeg();
+    void close_ffmpeg();
+    bool open_decoders();
+    void close_decoders();
+    bool feed_decoders(const AVPacket *packet);
+    void find_streams();
+    bool apply_cached_params(AVStream *stream, const AVCodecParameters *cached);
+    void set_state(SessionState state);
+    static int interrupt_callback(void *opaque);
     int start_audio_device();    
     int set_parameters();
-    int init_swr_context(AVSampleFormat out_format);
-    AVFrame* convert_audio_frame(AVSampleFormat out_format);
+    void configure_decoder_threads();
     void start_streamer();
 
-    bool m_stop {false};
+    // Pipeline stages, each pump handles one packet or frame
+    bool pump_video_decode();
+    bool pump_video_convert();
+    void post_preview(PreviewFrame &&preview);
+    bool pump_audio();
+    bool pump_mux();
+    bool pump_timeshift();
+    bool replay_packet();
+    void restart_replay(uint64_t seq);
+    bool dispatch_to_decoders(const AVPacket *packet);
+    bool push_packet(PacketQueue &queue, const AVPacket *packet, PipelineStage *stage);
+    bool enqueue_packet(PacketQueue &queue, AVPacket *packet, PipelineStage *stage);
+    void push_mux_packet(const AVPacket *packet);
+    void push_flush_markers();
+    void drain_queues();
+
+    // m_stop ends the session, m_abort only the current publisher
+    std::atomic<bool> m_stop {false};
+    std::atomic<bool> m_abort {false};
+    std::atomic<bool> m_demuxFinished {false};
+    std::atomic<SessionState> m_state {SessionState::Idle};
+    std::atomic<int64_t> m_abortRequestedUs {0};
+    int64_t m_acceptedUs {0};
+    std::atomic<LatencyProfile> m_latencyProfile {LatencyProfile::Default};
+    bool m_lowLatency {false};
+    // m_settings belongs to the session thread and is only read by the stages it starts
+    QMutex m_settingsMutex;
+    SessionSettings m_pendingSettings;
+    SessionSettings m_settings;
+
+    // Decode state, owned by the demux thread except for the flush requests
+    std::atomic<bool> m_decodeEnabled {true};
+    bool m_decodersOpen {false};
+    std::atomic<bool> m_decodeActive {false};
+    bool m_waitVideoKeyframe {true};
+    bool m_muxDropUntilKeyframe {false};
+    bool m_audioDeviceFailed {false};
+    std::atomic<bool> m_flushVideoDecoder {false};
+    std::atomic<bool> m_flushAudioDecoder {false};
+    RollingAverage m_videoDecodeTime;
+    std::atomic<double> m_videoDecodeTimeMs {0};
+    bool m_usedCachedParams {false};
+    bool m_firstFrameDecoded {false};
+    double m_probeMs {0};
+    std::atomic<double> m_timeToFirstFrameMs {0};
+    SegmentRecorder *m_recorder {nullptr};
+    // Owned by the convert stage, keeps its context and buffers across publishers
+    PreviewConverter m_previewConverter;
+    std::atomic<int> m_previewWidth {0};
+    std::atomic<int> m_previewHeight {0};
+    std::atomic<bool> m_previewZeroCopy {true};
+    std::atomic<quint64> m_previewFramesZeroCopy {0};
+    // The convert stage queues frames while the GUI presents them against the audio clock, and
+    // overwrites the mailbox otherwise or when the queue is full, so a busy GUI never falls behind.
+    // Whatever the mailbox overtook is dropped by the GUI when it gets there.
+    SpscQueue<PreviewFrame> m_previewQueue {AV_SYNC_QUEUE_SIZE};
+    LatestMailbox<PreviewFrame> m_previewMailbox;
+    uint64_t m_previewSequence {0};
+    std::atomic<quint64> m_previewFramesDisplayed {0};
+    std::atomic<quint64> m_previewFramesOverwritten {0};
+    // A/V sync, GUI thread only apart from the figures
+    std::atomic<bool> m_avSyncEnabled {true};
+    PreviewFrame m_previewNext;
+    bool m_previewNextValid {false};
+    uint64_t m_previewTakenSequence {0};
+    RollingAverage m_avSyncOffset;
+    std::atomic<bool> m_avSyncActive {false};
+    std::atomic<double> m_avSyncOffsetMs {0};
+    std::atomic<quint64> m_avSyncDroppedLate {0};
+    std::atomic<quint64> m_avSyncHeld {0};
+    std::atomic<quint64> m_avSyncFallbacks {0};
+    bool m_avSyncQueueFull {false};         // convert stage, reports each run of fallbacks once
+    // Owned by the audio stage, converts to whatever the sink was opened with
+    AudioConverter m_audioConverter;
+    // Filled only while a reader is registered
+    AudioConverter m_analysisConverter;
+    AudioRing m_analysisRing {ANALYSIS_RING_SAMPLES};
+    // The audio stage pushes, the sink pulls on the playout thread
+    AudioPlayout m_playout;
+    std::atomic<int> m_audioLatencyMs {0};
+    // Set from the GUI, the audio stage reopens the sink when m_audioOutputChanged is raised
+    QMutex m_audioOutputMutex;
+    QAudioDevice m_audioOutput;
+    std::atomic<int> m_audioBufferMs {0};
+    std::atomic<bool> m_audioOutputChanged {false};
+    // Steers the playout resampler from the buffer fill
+    ClockDrift m_clockDrift;
+    int64_t m_driftLoggedUs {0};
+
+    // Time-shift: the demux thread feeds the decoders while live, the replay stage otherwise.
+    // The hand-over goes through m_decoderFeed so that the decoder queues never have two producers.
+    std::unique_ptr<TimeshiftBuffer> m_timeshift;
+    std::atomic<int> m_timeshiftSeconds {0};
+    std::atomic<PreviewMode> m_previewMode {PreviewMode::Live};
+    std::atomic<bool> m_seekPending {false};
+    std::atomic<int64_t> m_seekOffsetUs {0};
+    std::atomic<int64_t> m_timeshiftEndUs {AV_NOPTS_VALUE};
+    std::atomic<int64_t> m_previewPositionUs {AV_NOPTS_VALUE};
+    std::atomic<DecoderFeed> m_decoderFeed {DecoderFeed::Live};
+    bool m_feedingLive {true};
+    uint64_t m_timeshiftCursor {0};
+    AVPacket *m_replayPacket {nullptr};
+    bool m_replayClockValid {false};
+    int64_t m_replayWallBaseUs {0};
+    int64_t m_replayTimeBaseUs {0};
+    int64_t m_replayWaitUs {0};
+
+    // Decode and convert run on the worker pool when one is set. Audio playout, mux with its
+    // disk writes and the paced replay keep their own threads, the replay only with a buffer.
+    QThreadPool *m_workerPool {nullptr};
+    std::unique_ptr<PipelineStage> m_videoDecodeStage;
+    std::unique_ptr<PipelineStage> m_videoConvertStage;
+    std::unique_ptr<PipelineStage> m_audioStage;
+    std::unique_ptr<PipelineStage> m_muxStage;
+    std::unique_ptr<PipelineStage> m_timeshiftStage;
+
+    // Fan-out: each output has its own queue and writer thread, the demux thread never waits on them
+    std::vector<RestreamOutput*> m_outputs;
+    mutable QMutex m_outputsMutex;
+
+    // Optional ABR ladder with its own decoder, fed like the restream outputs
+    TranscodeLadder *m_ladder {nullptr};
+
+    // Refcounted handles passed between the stages
+    PacketQueue m_videoPacketQueue {VIDEO_PACKET_QUEUE_SIZE};
+    PacketQueue m_audioPacketQueue {AUDIO_PACKET_QUEUE_SIZE};
+    PacketQueue m_muxPacketQueue {MUX_PACKET_QUEUE_SIZE};
+    FrameQueue m_videoFrameQueue {VIDEO_FRAME_QUEUE_SIZE};
+    std::atomic<bool> m_connected {false};
+    std::atomic<int64_t> m_connectedSinceUs {0};
+    std::atomic<quint64> m_packetsIn {0};
+    std::atomic<quint64> m_bytesIn {0};
+    std::atomic<quint64> m_videoFramesDecoded {0};
+    std::atomic<quint64> m_droppedVideoFrames {0};
+    std::atomic<quint64> m_packetsMuxed {0};
+    std::atomic<quint64> m_decoderPacketsDropped {0};
+    std::atomic<quint64> m_muxPacketsDropped {0};
 
     //Input AVFormatContext and Output AVFormatContext
     AVFormatContext* inputContext{nullptr};
-    AVFormatContext* outputContext{nullptr};
     AVCodecContext *videoCodecContext{nullptr};
     AVCodecContext *audioCodecContext{nullptr};
     AVFrame *video_frame{nullptr};
     AVFrame *audio_frame{nullptr};
     AVFrame *frameRGB{nullptr};
-    AVStream *inputStream{nullptr};
-    AVStream *outputStream{nullptr};
     AVStream *vid_stream{nullptr};
     AVStream *aud_stream{nullptr};    
-    SwrContext* swrAudioContext{nullptr};
 
     int video_idx = -1;
     int audio_idx = -1;
-    QString in_filename, out_filename;
+    QString in_filename;
     QString info;
-    QIODevice *m_ioAudioDevice{nullptr};   
-    QScopedPointer<QAudioSink> m_audioSinkOutput{nullptr};
 
 protected:
     void run();
@@ -106,8 +465,6 @@ signals:
     void sendInfo(QString);
     void sendUrl(QString);
     void sendConnectionStatus(bool);
-    void sendVideoFrame(QImage);
-    void sendAudioFrame(const char*, int);
 
 };
 
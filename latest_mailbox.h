@@ -0,0 +1,65 @@
+#ifndef LATEST_MAILBOX_H
+#define LATEST_MAILBOX_H
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+// Lock-free single-slot mailbox that only ever holds the newest value.
+// A triple buffer: the producer fills its own slot and swaps it with the shared
+// one, the consumer swaps the shared slot with its own when something new is in
+// it. Neither side waits, and a value the consumer never took is counted as dropped.
+// Exactly one thread may call post() and exactly one other thread may call take().
+template <typename T>
+class LatestMailbox
+{
+public:
+    LatestMailbox() = default;
+
+    LatestMailbox(const LatestMailbox&) = delete;
+    LatestMailbox& operator=(const LatestMailbox&) = delete;
+
+    // Producer side, replaces a value that was not taken yet
+    void post(T value)
+    {
+        m_slots[m_back] = std::move(value);
+        const int previous = m_shared.exchange(m_back | FRESH, std::memory_order_acq_rel);
+        if (previous & FRESH)
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        m_back = previous & INDEX;
+        // Whatever was left here is stale, it should not pin buffers until the next post
+        m_slots[m_back] = T();
+        m_posted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Consumer side. Returns false when nothing new was posted since the last take.
+    bool take(T &value)
+    {
+        if (!(m_shared.load(std::memory_order_acquire) & FRESH))
+            return false;
+        m_front = m_shared.exchange(m_front, std::memory_order_acq_rel) & INDEX;
+        value = std::move(m_slots[m_front]);
+        m_slots[m_front] = T();
+        m_taken.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t posted() const { return m_posted.load(std::memory_order_relaxed); }
+    uint64_t taken() const { return m_taken.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr int INDEX = 3;
+    static constexpr int FRESH = 4;
+
+    T m_slots[3];
+    alignas(64) std::atomic<int> m_shared {1};
+    // Each side's own slot, next to its counter
+    alignas(64) int m_back {0};
+    std::atomic<uint64_t> m_posted {0};
+    std::atomic<uint64_t> m_dropped {0};
+    alignas(64) int m_front {2};
+    std::atomic<uint64_t> m_taken {0};
+};
+
+#endif // LATEST_MAILBOX_H
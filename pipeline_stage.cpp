@@ -0,0 +1,141 @@
+#include "pipeline_stage.h"
+
+PipelineStage::PipelineStage(const QString &name, std::function<bool()> pump, std::function<bool()> done)
+    : m_name(name)
+    , m_pump(std::move(pump))
+    , m_done(std::move(done))
+{
+}
+
+PipelineStage::~PipelineStage()
+{
+    wait();
+}
+
+void PipelineStage::setThreadHooks(std::function<void()> enter, std::function<void()> leave)
+{
+    m_enter = std::move(enter);
+    m_leave = std::move(leave);
+}
+
+void PipelineStage::start(QThreadPool *pool)
+{
+    m_pool = pool;
+    m_finished = false;
+    m_scheduled = false;
+    m_wake = false;
+    m_signal.tryAcquire(m_signal.available());
+
+    if (m_pool)
+    {
+        notify();
+        return;
+    }
+
+    m_thread = QThread::create([this] { runThread(); });
+    m_thread->setObjectName(m_name);
+    m_thread->start();
+}
+
+void PipelineStage::notify()
+{
+    if (m_finished)
+        return;
+
+    if (!m_pool)
+    {
+        // One pending release is enough, the thread pumps until its input is empty
+        if (!m_wake.exchange(true))
+            m_signal.release();
+        return;
+    }
+
+    m_wake = true;
+    if (!m_scheduled.exchange(true))
+        m_pool->start([this] { runSlice(); });
+}
+
+void PipelineStage::wait()
+{
+    if (m_thread)
+    {
+        // Done may have turned true while the thread was idle
+        notify();
+        m_thread->wait();
+        delete m_thread;
+        m_thread = nullptr;
+        return;
+    }
+
+    if (!m_pool)
+        return;
+
+    // A slice only notices the end of input when it runs, poke it and wait for the last one
+    QMutexLocker locker(&m_finishMutex);
+    while (!m_finished || m_scheduled)
+    {
+        locker.unlock();
+        notify();
+        locker.relock();
+        if (m_finished && !m_scheduled)
+            break;
+        m_finishCondition.wait(&m_finishMutex, STAGE_IDLE_WAIT_MS);
+    }
+}
+
+void PipelineStage::runThread()
+{
+    if (m_enter)
+        m_enter();
+
+    while (true)
+    {
+        // Sample done before pumping, so input queued just before the end is not lost
+        const bool done = m_done();
+        if (!m_pump())
+        {
+            if (done)
+                break;
+            m_signal.tryAcquire(1, STAGE_IDLE_WAIT_MS);
+            m_wake = false;
+        }
+    }
+
+    if (m_leave)
+        m_leave();
+
+    m_finished = true;
+}
+
+void PipelineStage::runSlice()
+{
+    m_wake = false;
+
+    bool idle = false;
+    bool done = false;
+    for (int i = 0; i < STAGE_SLICE_BUDGET; ++i)
+    {
+        done = m_done();
+        if (!m_pump())
+        {
+            idle = true;
+            break;
+        }
+    }
+
+    if (idle && done)
+    {
+        // wait() sees both flags change together, nothing touches this object after the unlock
+        QMutexLocker locker(&m_finishMutex);
+        m_finished = true;
+        m_scheduled = false;
+        m_finishCondition.wakeAll();
+        return;
+    }
+
+    m_scheduled = false;
+
+    // Budget used up, or input arrived while we were draining: queue another slice
+    if (!idle || m_wake)
+        notify();
+}
@@ -0,0 +1,70 @@
+#ifndef PIPELINE_STAGE_H
+#define PIPELINE_STAGE_H
+
+#include <atomic>
+#include <functional>
+
+#include <QMutex>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#define STAGE_IDLE_SLEEP_US         500     // time-shift replay retry while a decoder queue is full
+#define STAGE_IDLE_WAIT_MS          100     // an idle stage wakes on notify(), this only bounds a missed one
+#define STAGE_SLICE_BUDGET          64
+
+// Drives one stage of the ingest pipeline.
+// The stage either owns a dedicated thread, or runs in short slices on a
+// shared QThreadPool so that many sessions can share a fixed number of cores.
+// Pooled pumps must not block, a stage that waits on I/O takes its own thread.
+// An idle stage sleeps until notify(), it never polls its input.
+class PipelineStage
+{
+public:
+    // pump processes at most one unit of work and returns false when its input is empty.
+    // done returns true once no more input will arrive (end of stream or stop).
+    PipelineStage(const QString &name, std::function<bool()> pump, std::function<bool()> done);
+    ~PipelineStage();
+
+    PipelineStage(const PipelineStage&) = delete;
+    PipelineStage& operator=(const PipelineStage&) = delete;
+
+    // Called on the dedicated thread before the first and after the last pump.
+    void setThreadHooks(std::function<void()> enter, std::function<void()> leave);
+
+    // nullptr runs the stage on its own thread
+    void start(QThreadPool *pool = nullptr);
+
+    // Producer side: new input is available. Call it after every push.
+    void notify();
+
+    // Blocks until the stage has finished, done has to be true by then.
+    void wait();
+
+    bool isFinished() const { return m_finished; }
+
+private:
+    void runThread();
+    void runSlice();
+
+    QString m_name;
+    std::function<bool()> m_pump;
+    std::function<bool()> m_done;
+    std::function<void()> m_enter;
+    std::function<void()> m_leave;
+
+    QThreadPool *m_pool {nullptr};
+    QThread *m_thread {nullptr};
+
+    std::atomic<bool> m_scheduled {false};
+    std::atomic<bool> m_wake {false};
+    std::atomic<bool> m_finished {false};
+    // Dedicated thread: released by notify() while the stage is idle
+    QSemaphore m_signal;
+    // Pool mode: the last slice sets m_finished and clears m_scheduled under the mutex
+    QMutex m_finishMutex;
+    QWaitCondition m_finishCondition;
+};
+
+#endif // PIPELINE_STAGE_H
@@ -0,0 +1,229 @@
+#include "preview_converter.h"
+
+#include <QDebug>
+#include <QThread>
+#include <algorithm>
+#include <cstring>
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+}
+
+PreviewConverter::PreviewConverter()
+{
+    m_slicePool.setMaxThreadCount(PREVIEW_MAX_SLICE_THREADS - 1);
+    m_slicePool.setObjectName("preview slices");
+}
+
+PreviewConverter::~PreviewConverter()
+{
+    reset();
+}
+
+void PreviewConverter::reset()
+{
+    free_contexts();
+    m_srcWidth = 0;
+    m_srcHeight = 0;
+    m_srcFormat = -1;
+    m_dstSize = QSize();
+    m_builtThreads = -1;
+    m_pool.clear();
+    m_convertTime.reset();
+}
+
+void PreviewConverter::free_contexts()
+{
+    for (Slice &slice : m_slices)
+        sws_freeContext(slice.sws);
+    m_slices.clear();
+    m_sliceCount = 0;
+    m_path = "";
+}
+
+void PreviewConverter::setThreadCount(int threads)
+{
+    m_threadCount = std::max(0, threads);
+}
+
+void PreviewConverter::setKernelsEnabled(bool enabled)
+{
+    m_kernelsEnabled = enabled;
+}
+
+QSize PreviewConverter::fittedSize(const AVFrame *frame, const QSize &target)
+{
+    QSize source(frame->width, frame->height);
+    // Anamorphic streams are shown at their display aspect ratio
+    if (frame->sample_aspect_ratio.num > 0 && frame->sample_aspect_ratio.den > 0)
+        source.setWidth(av_rescale(frame->width, frame->sample_aspect_ratio.num, frame->sample_aspect_ratio.den));
+
+    // Upscaling is left to the view, it would only add work here
+    QSize bounds = target.isEmpty() ? source : target.boundedTo(source);
+    QSize size = source.scaled(bounds, Qt::KeepAspectRatio);
+    return size.expandedTo(QSize(2, 2));
+}
+
+bool PreviewConverter::update_contexts(const AVFrame *frame, const QSize &size)
+{
+    int threads = m_threadCount;
+    bool kernelsEnabled = m_kernelsEnabled;
+    if (!m_slices.empty() && frame->width == m_srcWidth && frame->height == m_srcHeight
+            && frame->format == m_srcFormat && size == m_dstSize && threads == m_builtThreads
+            && kernelsEnabled == m_builtKernels)
+        return true;
+
+    free_contexts();
+    m_srcFormat = -1;
+
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    if (!desc)
+        return false;
+
+    int count = threads > 0 ? threads : std::min(QThread::idealThreadCount(), PREVIEW_MAX_SLICE_THREADS);
+    count = std::clamp(count, 1, PREVIEW_MAX_SLICE_THREADS);
+    count = std::min(count, std::max(1, size.height() / PREVIEW_MIN_SLICE_ROWS));
+    // A palette in data[1] cannot be offset like a plane
+    if (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL))
+        count = 1;
+
+    // The kernels only convert, anything scaled or in another format goes through swscale
+    const bool kernel = kernelsEnabled && YuvToRgb::supports(frame->format) && YuvToRgb::level() != SimdLevel::Scalar
+            && size == QSize(frame->width, frame->height);
+
+    // Band edges fall on chroma rows so every plane can be offset to them
+    const int align = 1 << desc->log2_chroma_h;
+    int srcY = 0;
+    for (int i = 1; i <= count; ++i)
+    {
+        int srcEnd = i == count ? frame->height : (frame->height * i / count) / align * align;
+        if (srcEnd <= srcY)
+            continue;
+
+        Slice slice;
+        slice.srcY = srcY;
+        slice.srcHeight = srcEnd - srcY;
+        slice.dstY = av_rescale(srcY, size.height(), frame->height);
+        slice.dstHeight = av_rescale(srcEnd, size.height(), frame->height) - slice.dstY;
+        if (slice.dstHeight <= 0)
+            continue;
+
+        if (!kernel)
+            slice.sws = sws_getContext(frame->width, slice.srcHeight, static_cast<AVPixelFormat>(frame->format),
+                                       size.width(), slice.dstHeight, AV_PIX_FMT_RGB32,
+                                       SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (!kernel && !slice.sws)
+        {
+            qDebug() << "preview: no swscale context for" << frame->width << "x" << frame->height << frame->format;
+            free_contexts();
+            return false;
+        }
+        m_slices.push_back(slice);
+        srcY = srcEnd;
+    }
+    if (m_slices.empty())
+        return false;
+
+    m_srcWidth = frame->width;
+    m_srcHeight = frame->height;
+    m_srcFormat = frame->format;
+    m_dstSize = size;
+    m_builtThreads = threads;
+    m_builtKernels = kernelsEnabled;
+    m_sliceCount = static_cast<int>(m_slices.size());
+    m_path = kernel ? YuvToRgb::name(YuvToRgb::level()) : "swscale";
+    m_contextRebuilds++;
+    return true;
+}
+
+void PreviewConverter::scale_slice(const Slice &slice, const AVFrame *frame, uint8_t *dst, int dstStride) const
+{
+    if (!slice.sws)
+    {
+        YuvToRgb::convert(frame, dst, dstStride, slice.srcY, slice.srcY + slice.srcHeight);
+        return;
+    }
+
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+
+    const uint8_t *src[AV_NUM_DATA_POINTERS] = {};
+    for (int plane = 0; plane < AV_NUM_DATA_POINTERS && frame->data[plane]; ++plane)
+    {
+        // Chroma planes are subsampled, luma and alpha are not
+        int shift = (plane == 1 || plane == 2) ? desc->log2_chroma_h : 0;
+        src[plane] = frame->data[plane] + (ptrdiff_t)(slice.srcY >> shift) * frame->linesize[plane];
+    }
+
+    uint8_t *destData[1] = { dst + (ptrdiff_t)slice.dstY * dstStride };
+    int destLinesize[1] = { dstStride };
+    sws_scale(slice.sws, src, frame->linesize, 0, slice.srcHeight, destData, destLinesize);
+}
+
+QImage PreviewConverter::acquire_image(int width, int height)
+{
+    // Buffers of an old size are never handed out again
+    m_pool.erase(std::remove_if(m_pool.begin(), m_pool.end(), [width, height](const QImage &image) {
+                     return image.width() != width || image.height() != height;
+                 }), m_pool.end());
+
+    // Only the pool holds it: the GUI is done with this buffer
+    for (QImage &image : m_pool)
+        if (image.isDetached())
+            return image;
+
+    m_bufferAllocations++;
+    QImage image(width, height, QImage::Format_RGB32);
+    if (!image.isNull() && m_pool.size() < PREVIEW_POOL_SIZE)
+        m_pool.push_back(image);
+    return image;
+}
+
+bool PreviewConverter::convert(const AVFrame *frame, QImage &image, const QSize &target)
+{
+    int64_t startUs = av_gettime_relative();
+    // The caller's previous picture goes back to the pool
+    image = QImage();
+
+    QSize size = fittedSize(frame, target);
+    if (!update_contexts(frame, size))
+        return false;
+
+    image = acquire_image(size.width(), size.height());
+    if (image.isNull())
+        return false;
+
+    // constBits() keeps the pool's reference from forcing a detach
+    uint8_t *dst = const_cast<uint8_t*>(image.constBits());
+    int dstStride = static_cast<int>(image.bytesPerLine());
+
+    // The calling thread takes the first band, the pool the others
+    const int others = static_cast<int>(m_slices.size()) - 1;
+    for (int i = 1; i <= others; ++i)
+    {
+        m_slicePool.start([this, i, frame, dst, dstStride] {
+            scale_slice(m_slices[i], frame, dst, dstStride);
+            m_slicesDone.release();
+        });
+    }
+    scale_slice(m_slices[0], frame, dst, dstStride);
+    m_slicesDone.acquire(others);
+
+    m_convertTime.add((av_gettime_relative() - startUs) / 1000.0);
+    m_convertTimeMs = m_convertTime.mean();
+    m_framesConverted++;
+    return true;
+}
+
+PreviewConverterStats PreviewConverter::stats() const
+{
+    PreviewConverterStats stats;
+    stats.framesConverted = m_framesConverted;
+    stats.contextRebuilds = m_contextRebuilds;
+    stats.bufferAllocations = m_bufferAllocations;
+    stats.convertTimeMs = m_convertTimeMs;
+    stats.slices = m_sliceCount;
+    stats.path = m_path;
+    return stats;
+}
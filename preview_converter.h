@@ -0,0 +1,107 @@
+#ifndef PREVIEW_CONVERTER_H
+#define PREVIEW_CONVERTER_H
+
+#include <atomic>
+#include <vector>
+
+#include <QImage>
+#include <QSemaphore>
+#include <QSize>
+#include <QStringList>
+#include <QThreadPool>
+
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+#include "rolling_average.h"
+#include "yuv_to_rgb.h"
+
+#define PREVIEW_POOL_SIZE           44      // enough for the A/V sync queue, see AV_SYNC_QUEUE_SIZE
+#define PREVIEW_MAX_SLICE_THREADS   4
+#define PREVIEW_MIN_SLICE_ROWS      64
+
+struct PreviewConverterStats
+{
+    quint64 framesConverted {0};
+    quint64 contextRebuilds {0};
+    quint64 bufferAllocations {0};
+    double convertTimeMs {0};
+    int slices {0};
+    const char *path {""};      // "swscale", or the kernel converting 4:2:0 at source size
+};
+
+// Decoded frame to RGB32 for the preview, scaled once to the size it is shown at.
+// The swscale contexts are kept until the frame size, format or target changes, and
+// the images come from a small pool: a buffer is reused once the GUI has dropped
+// its last copy of it. Large frames are cut into horizontal bands, each with its
+// own context, converted in parallel on a small private thread pool.
+// 8-bit 4:2:0 frames shown at their own size skip swscale for the SIMD kernels in YuvToRgb.
+// Only the convert stage calls convert(), stats() is safe anywhere.
+class PreviewConverter
+{
+public:
+    PreviewConverter();
+    ~PreviewConverter();
+
+    PreviewConverter(const PreviewConverter&) = delete;
+    PreviewConverter& operator=(const PreviewConverter&) = delete;
+
+    // The image fits in target keeping the display aspect ratio, it is never
+    // larger than the source. An empty target keeps the source size.
+    bool convert(const AVFrame *frame, QImage &image, const QSize &target = QSize());
+    static QSize fittedSize(const AVFrame *frame, const QSize &target);
+    // Frees the contexts and the pool, the next frame starts over
+    void reset();
+
+    // 0 picks up to PREVIEW_MAX_SLICE_THREADS from the core count, 1 converts in one piece.
+    // Applied when the contexts are next rebuilt.
+    void setThreadCount(int threads);
+    // Off forces swscale for every format, applied when the contexts are next rebuilt
+    void setKernelsEnabled(bool enabled);
+
+    PreviewConverterStats stats() const;
+
+private:
+    // One band of the picture: source rows [srcY, srcY + srcHeight) go to [dstY, dstY + dstHeight).
+    // Bands without a context go through the YuvToRgb kernels.
+    struct Slice
+    {
+        SwsContext *sws {nullptr};
+        int srcY {0};
+        int srcHeight {0};
+        int dstY {0};
+        int dstHeight {0};
+    };
+
+    bool update_contexts(const AVFrame *frame, const QSize &size);
+    void free_contexts();
+    void scale_slice(const Slice &slice, const AVFrame *frame, uint8_t *dst, int dstStride) const;
+    QImage acquire_image(int width, int height);
+
+    std::vector<Slice> m_slices;
+    int m_srcWidth {0};
+    int m_srcHeight {0};
+    int m_srcFormat {-1};
+    QSize m_dstSize;
+    int m_builtThreads {-1};
+    bool m_builtKernels {false};
+    std::vector<QImage> m_pool;
+    RollingAverage m_convertTime;
+
+    std::atomic<int> m_threadCount {0};
+    std::atomic<bool> m_kernelsEnabled {true};
+    QThreadPool m_slicePool;
+    QSemaphore m_slicesDone;
+
+    std::atomic<quint64> m_framesConverted {0};
+    std::atomic<quint64> m_contextRebuilds {0};
+    std::atomic<quint64> m_bufferAllocations {0};
+    std::atomic<double> m_convertTimeMs {0};
+    std::atomic<int> m_sliceCount {0};
+    std::atomic<const char*> m_path {""};
+};
+
+#endif // PREVIEW_CONVERTER_H
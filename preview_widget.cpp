@@ -0,0 +1,93 @@
+#include "preview_widget.h"
+
+#include <QPainter>
+#include <QPaintEvent>
+#include <QRegion>
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+PreviewWidget::PreviewWidget(QWidget *parent)
+    : QWidget{parent}
+{
+    // Every pixel is painted here, Qt does not need to clear first
+    setAttribute(Qt::WA_OpaquePaintEvent);
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
+}
+
+QSize PreviewWidget::deviceSize() const
+{
+    return size() * devicePixelRatioF();
+}
+
+void PreviewWidget::setImage(const QImage &image)
+{
+    // Only shares the pooled buffer: setting its pixel ratio here would detach it, a full copy per frame.
+    // drawImage() into a target of the logical size maps it 1:1 to device pixels anyway.
+    m_image = image;
+
+    // The converter follows the widget size, so this only changes around a resize
+    QSize imageSize = (QSizeF(m_image.size()) / devicePixelRatioF()).toSize();
+    if (imageSize != m_imageSize)
+    {
+        m_imageSize = imageSize;
+        QRect previous = m_target;
+        update_target();
+        update(previous.united(m_target));
+        return;
+    }
+    update(m_target);
+}
+
+void PreviewWidget::clear()
+{
+    m_image = QImage();
+    m_imageSize = QSize();
+    m_target = QRect();
+    update();
+}
+
+void PreviewWidget::resizeEvent(QResizeEvent *event)
+{
+    QWidget::resizeEvent(event);
+    update_target();
+    emit deviceSizeChanged(deviceSize());
+}
+
+void PreviewWidget::update_target()
+{
+    if (m_imageSize.isEmpty())
+    {
+        m_target = QRect();
+        return;
+    }
+
+    // Frames already fit the widget and are shown 1:1, only smaller streams are scaled up
+    QSize size = m_imageSize;
+    if (size.width() < width() - 1 && size.height() < height() - 1)
+        size = size.scaled(this->size(), Qt::KeepAspectRatio);
+    m_scaled = size != m_imageSize;
+    m_target = QRect(QPoint((width() - size.width()) / 2, (height() - size.height()) / 2), size);
+}
+
+void PreviewWidget::paintEvent(QPaintEvent *event)
+{
+    int64_t startUs = av_gettime_relative();
+    QPainter painter(this);
+
+    // Letterbox bars only when they are part of the damaged area
+    QRegion bars = QRegion(event->rect()).subtracted(m_image.isNull() ? QRegion() : QRegion(m_target));
+    for (const QRect &rect : bars)
+        painter.fillRect(rect, Qt::black);
+
+    if (!m_image.isNull())
+    {
+        if (m_scaled)
+            painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        painter.drawImage(m_target, m_image);
+    }
+
+    m_paintTime.add((av_gettime_relative() - startUs) / 1000.0);
+}
@@ -0,0 +1,45 @@
+#ifndef PREVIEW_WIDGET_H
+#define PREVIEW_WIDGET_H
+
+#include <QImage>
+#include <QRect>
+#include <QWidget>
+
+#include "rolling_average.h"
+
+// RTMP preview surface for RGB frames.
+// Holds one image that each new frame replaces without a copy, the pooled
+// converter buffer is drawn as it is. Where the picture goes is worked out only
+// when the widget or the frame size changes, and a new frame repaints just the
+// picture, the letterbox bars are left alone.
+class PreviewWidget : public QWidget
+{
+    Q_OBJECT
+public:
+    explicit PreviewWidget(QWidget *parent = nullptr);
+
+    void setImage(const QImage &image);
+    void clear();
+
+    // Size of the picture area in device pixels, what the converter should produce
+    QSize deviceSize() const;
+    double paintTimeMs() const { return m_paintTime.mean(); }
+
+signals:
+    void deviceSizeChanged(QSize);
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+    void resizeEvent(QResizeEvent *event) override;
+
+private:
+    void update_target();
+
+    QImage m_image;
+    QSize m_imageSize;          // device independent
+    QRect m_target;
+    bool m_scaled {false};
+    RollingAverage m_paintTime;
+};
+
+#endif // PREVIEW_WIDGET_H
@@ -0,0 +1,333 @@
+#include "restream_output.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+RestreamOutput::RestreamOutput(const QString &target, QObject *parent)
+    : QObject{parent}
+    , m_target(target)
+    , m_network(isNetwork(target))
+{
+}
+
+RestreamOutput::~RestreamOutput()
+{
+    stop();
+}
+
+bool RestreamOutput::isNetwork(const QString &target)
+{
+    return target.contains("://") && !target.startsWith("file:");
+}
+
+const char* RestreamOutput::formatFor(const QString &target)
+{
+    if (target.startsWith("rtmp://") || target.startsWith("rtmps://"))
+        return "flv";
+    if (target.startsWith("udp://") || target.startsWith("srt://") || target.startsWith("tcp://"))
+        return "mpegts";
+
+    const AVOutputFormat *format = av_guess_format(nullptr, target.toStdString().c_str(), nullptr);
+    return format ? format->name : nullptr;
+}
+
+int RestreamOutput::interrupt_callback(void *opaque)
+{
+    // Unblocks a hanging connect or write when the session stops, network outputs only
+    return static_cast<RestreamOutput*>(opaque)->m_quit ? 1 : 0;
+}
+
+void RestreamOutput::start(AVFormatContext *input, int videoIndex)
+{
+    stop();
+
+    for (unsigned int i = 0; i < input->nb_streams; ++i)
+    {
+        AVCodecParameters *params = avcodec_parameters_alloc();
+        if (params)
+            avcodec_parameters_copy(params, input->streams[i]->codecpar);
+        m_streams.push_back(params);
+        m_timeBases.push_back(input->streams[i]->time_base);
+    }
+    m_videoIndex = videoIndex;
+
+    m_url = m_target;
+    m_url.replace("{time}", QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss"));
+
+    m_quit = false;
+    m_dropUntilKeyframe = false;
+    m_waitKeyframe = true;
+    m_backoffMs = RESTREAM_RECONNECT_MIN_MS;
+    m_packetsWritten = 0;
+    m_packetsDropped = 0;
+    m_reconnects = 0;
+    m_state = RestreamState::Connecting;
+
+    m_writer = QThread::create([this] { run_writer(); });
+    m_writer->setObjectName("restream");
+    m_writer->start();
+}
+
+void RestreamOutput::stop()
+{
+    if (!m_writer)
+        return;
+
+    m_quit = true;
+    m_signal.release();
+    m_writer->wait();
+    delete m_writer;
+    m_writer = nullptr;
+
+    for (AVCodecParameters *&params : m_streams)
+        avcodec_parameters_free(&params);
+    m_streams.clear();
+    m_timeBases.clear();
+}
+
+void RestreamOutput::push(const AVPacket *packet)
+{
+    if (!m_writer || m_state == RestreamState::Failed)
+        return;
+
+    // After an overflow the output resumes on a keyframe, never on a broken GOP
+    if (m_dropUntilKeyframe)
+    {
+        if (m_videoIndex >= 0 && !(packet->stream_index == m_videoIndex && (packet->flags & AV_PKT_FLAG_KEY)))
+        {
+            m_packetsDropped++;
+            return;
+        }
+        m_dropUntilKeyframe = false;
+    }
+
+    AVPacket *ref = av_packet_clone(packet);
+    if (!ref)
+        return;
+
+    if (!m_queue.push(ref))
+    {
+        av_packet_free(&ref);
+        m_packetsDropped++;
+        m_dropUntilKeyframe = true;
+        return;
+    }
+    m_signal.release();
+}
+
+bool RestreamOutput::open_output()
+{
+    m_state = RestreamState::Connecting;
+
+    const char *format = formatFor(m_url);
+    if (avformat_alloc_output_context2(&m_output, nullptr, format, m_url.toStdString().c_str()) < 0)
+    {
+        qDebug() << "restream: no muxer for" << m_url;
+        return false;
+    }
+    // FFmpeg checks the callback on every write, files included: a file must stay
+    // writable until its trailer is out after stop()
+    if (m_network)
+    {
+        m_output->interrupt_callback.callback = interrupt_callback;
+        m_output->interrupt_callback.opaque = this;
+    }
+
+    for (AVCodecParameters *params : m_streams)
+    {
+        AVStream *stream = avformat_new_stream(m_output, nullptr);
+        if (!stream || !params)
+        {
+            close_output();
+            return false;
+        }
+        avcodec_parameters_copy(stream->codecpar, params);
+        // FLV codec tags mean nothing to other muxers
+        stream->codecpar->codec_tag = 0;
+    }
+
+    int ret = 0;
+    if (!(m_output->oformat->flags & AVFMT_NOFILE))
+    {
+        AVDictionary *io_opts = NULL;
+        if (m_network)
+            av_dict_set_int(&io_opts, "rw_timeout", RESTREAM_IO_TIMEOUT_US, 0);
+        ret = avio_open2(&m_output->pb, m_url.toStdString().c_str(), AVIO_FLAG_WRITE,
+                         m_network ? &m_output->interrupt_callback : nullptr, &io_opts);
+        av_dict_free(&io_opts);
+        if (ret < 0)
+        {
+            close_output();
+            return false;
+        }
+    }
+
+    // MP4 files stay playable without a trailer
+    AVDictionary *muxer_opts = NULL;
+    if (!strcmp(m_output->oformat->name, "mp4") || !strcmp(m_output->oformat->name, "mov"))
+        av_dict_set(&muxer_opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+
+    ret = avformat_write_header(m_output, &muxer_opts);
+    av_dict_free(&muxer_opts);
+    if (ret < 0)
+    {
+        if (!(m_output->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&m_output->pb);
+        avformat_free_context(m_output);
+        m_output = nullptr;
+        return false;
+    }
+
+    m_state = RestreamState::Running;
+    m_waitKeyframe = true;
+    return true;
+}
+
+void RestreamOutput::close_output()
+{
+    if (!m_output)
+        return;
+
+    if (m_state == RestreamState::Running)
+        av_write_trailer(m_output);
+    if (m_output->pb && !(m_output->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&m_output->pb);
+    avformat_free_context(m_output);
+    m_output = nullptr;
+}
+
+bool RestreamOutput::write_packet(AVPacket *packet)
+{
+    // A (re)connected output starts on a keyframe
+    if (m_waitKeyframe && m_videoIndex >= 0)
+    {
+        if (!(packet->stream_index == m_videoIndex && (packet->flags & AV_PKT_FLAG_KEY)))
+        {
+            m_packetsDropped++;
+            return true;
+        }
+    }
+    m_waitKeyframe = false;
+
+    int index = packet->stream_index;
+    if (index < 0 || index >= (int)m_timeBases.size())
+        return true;
+
+    av_packet_rescale_ts(packet, m_timeBases[index], m_output->streams[index]->time_base);
+    packet->pos = -1;
+
+    int ret = av_interleaved_write_frame(m_output, packet);
+    if (ret < 0)
+    {
+        char error_buffer[AV_ERROR_MAX_STRING_SIZE];
+        av_strerror(ret, error_buffer, sizeof(error_buffer));
+        qDebug() << "restream" << m_url << "write failed:" << error_buffer;
+        return false;
+    }
+    m_packetsWritten++;
+    return true;
+}
+
+void RestreamOutput::drain_queue()
+{
+    AVPacket *packet = nullptr;
+    while (m_queue.pop(packet))
+    {
+        av_packet_free(&packet);
+        m_packetsDropped++;
+    }
+}
+
+void RestreamOutput::run_writer()
+{
+    int64_t retryAtUs = 0;
+
+    while (!m_quit)
+    {
+        if (!m_output)
+        {
+            // Packets that arrive while disconnected are dropped, not delayed
+            drain_queue();
+            if (m_state == RestreamState::Failed || av_gettime_relative() < retryAtUs)
+            {
+                m_signal.tryAcquire(1, 50);
+                continue;
+            }
+
+            if (!open_output())
+            {
+                if (m_quit)
+                    break;
+                if (!m_network)
+                {
+                    m_state = RestreamState::Failed;
+                    emit sendInfo("Restream " + m_url + ": cannot open output.");
+                    continue;
+                }
+                m_state = RestreamState::Waiting;
+                retryAtUs = av_gettime_relative() + m_backoffMs * 1000LL;
+                emit sendInfo("Restream " + m_url + ": retrying in " + QString::number(m_backoffMs) + " ms.");
+                m_backoffMs = std::min(m_backoffMs * 2, RESTREAM_RECONNECT_MAX_MS);
+                continue;
+            }
+            m_backoffMs = RESTREAM_RECONNECT_MIN_MS;
+            emit sendInfo("Restream " + m_url + ": connected.");
+        }
+
+        AVPacket *packet = nullptr;
+        if (!m_queue.pop(packet))
+        {
+            m_signal.tryAcquire(1, 100);
+            continue;
+        }
+
+        bool ok = write_packet(packet);
+        av_packet_free(&packet);
+        if (!ok)
+        {
+            // A broken connection gets no trailer
+            m_state = m_network ? RestreamState::Waiting : RestreamState::Failed;
+            close_output();
+            if (m_network)
+            {
+                m_reconnects++;
+                retryAtUs = av_gettime_relative() + m_backoffMs * 1000LL;
+                emit sendInfo("Restream " + m_url + ": connection lost.");
+            }
+            else
+            {
+                emit sendInfo("Restream " + m_url + ": write failed, output closed.");
+            }
+        }
+    }
+
+    // Files get what is already queued and a proper trailer
+    AVPacket *packet = nullptr;
+    while (m_output && !m_network && m_queue.pop(packet))
+    {
+        write_packet(packet);
+        av_packet_free(&packet);
+    }
+    close_output();
+    drain_queue();
+    m_state = RestreamState::Stopped;
+}
+
+RestreamStats RestreamOutput::stats() const
+{
+    RestreamStats stats;
+    stats.target = m_url.isEmpty() ? m_target : m_url;
+    stats.state = m_state;
+    stats.queueDepth = m_queue.size();
+    stats.packetsWritten = m_packetsWritten;
+    stats.packetsDropped = m_packetsDropped;
+    stats.reconnects = m_reconnects;
+    return stats;
+}
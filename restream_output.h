@@ -0,0 +1,107 @@
+#ifndef RESTREAM_OUTPUT_H
+#define RESTREAM_OUTPUT_H
+
+#include <atomic>
+#include <vector>
+
+#include <QObject>
+#include <QSemaphore>
+#include <QString>
+#include <QThread>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include "spsc_queue.h"
+
+#define RESTREAM_QUEUE_SIZE         1024
+#define RESTREAM_RECONNECT_MIN_MS   500
+#define RESTREAM_RECONNECT_MAX_MS   30000
+#define RESTREAM_IO_TIMEOUT_US      5000000
+
+enum class RestreamState
+{
+    Connecting,
+    Running,
+    Waiting,        // reconnect back-off
+    Failed,         // gave up, files are not reopened
+    Stopped
+};
+
+struct RestreamStats
+{
+    QString target;
+    RestreamState state {RestreamState::Stopped};
+    int queueDepth {0};
+    quint64 packetsWritten {0};
+    quint64 packetsDropped {0};
+    quint64 reconnects {0};
+};
+
+// One restream destination: rtmp:// push, udp:// MPEG-TS, or a .flv/.mkv/.mp4/.ts file.
+// The demux thread hands it packet references without ever blocking; a full queue
+// drops packets and resumes at the next video keyframe. The writer thread owns the
+// output, and network outputs reconnect with an exponential back-off, so a slow
+// or dead endpoint only affects itself.
+class RestreamOutput : public QObject
+{
+    Q_OBJECT
+public:
+    // A "{time}" in a file name is replaced by the publisher start time
+    explicit RestreamOutput(const QString &target, QObject *parent = nullptr);
+    ~RestreamOutput();
+
+    // Stream parameters are copied, the input may go away before stop()
+    void start(AVFormatContext *input, int videoIndex);
+    void stop();
+
+    // Called by the demux thread
+    void push(const AVPacket *packet);
+
+    RestreamStats stats() const;
+    QString target() const { return m_target; }
+
+    // Muxer for a target: flv for rtmp, mpegts for udp/srt, otherwise from the extension
+    static const char* formatFor(const QString &target);
+    static bool isNetwork(const QString &target);
+
+signals:
+    void sendInfo(QString);
+
+private:
+    void run_writer();
+    bool open_output();
+    void close_output();
+    bool write_packet(AVPacket *packet);
+    void drain_queue();
+    static int interrupt_callback(void *opaque);
+
+    const QString m_target;
+    QString m_url;
+    const bool m_network;
+
+    std::vector<AVCodecParameters*> m_streams;
+    std::vector<AVRational> m_timeBases;
+    int m_videoIndex {-1};
+
+    AVFormatContext *m_output {nullptr};
+    SpscQueue<AVPacket*> m_queue {RESTREAM_QUEUE_SIZE};
+    QSemaphore m_signal;
+    QThread *m_writer {nullptr};
+    std::atomic<bool> m_quit {false};
+
+    // Producer side
+    bool m_dropUntilKeyframe {false};
+    // Writer side
+    bool m_waitKeyframe {true};
+    int m_backoffMs {RESTREAM_RECONNECT_MIN_MS};
+
+    std::atomic<RestreamState> m_state {RestreamState::Stopped};
+    std::atomic<quint64> m_packetsWritten {0};
+    std::atomic<quint64> m_packetsDropped {0};
+    std::atomic<quint64> m_reconnects {0};
+};
+
+#endif // RESTREAM_OUTPUT_H
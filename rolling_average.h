@@ -0,0 +1,45 @@
+#ifndef ROLLING_AVERAGE_H
+#define ROLLING_AVERAGE_H
+
+#include <algorithm>
+#include <vector>
+
+#define ROLLING_AVERAGE_WINDOW  60
+
+// Mean of the last N samples, used for the latency and timing figures.
+class RollingAverage
+{
+public:
+    explicit RollingAverage(int window = ROLLING_AVERAGE_WINDOW)
+        : m_samples(window > 0 ? window : 1, 0.0)
+    {
+    }
+
+    void add(double value)
+    {
+        m_sum += value - m_samples[m_next];
+        m_samples[m_next] = value;
+        m_next = (m_next + 1) % m_samples.size();
+        if (m_count < m_samples.size())
+            m_count++;
+    }
+
+    double mean() const { return m_count ? m_sum / m_count : 0.0; }
+    size_t count() const { return m_count; }
+
+    void reset()
+    {
+        std::fill(m_samples.begin(), m_samples.end(), 0.0);
+        m_sum = 0.0;
+        m_next = 0;
+        m_count = 0;
+    }
+
+private:
+    std::vector<double> m_samples;
+    double m_sum {0.0};
+    size_t m_next {0};
+    size_t m_count {0};
+};
+
+#endif // ROLLING_AVERAGE_H
@@ -10,6 +10,7 @@
 
 #include <QMediaRecorder>
 #include <QVideoWidget>
+#include <QVideoSink>
 #include <QCameraDevice>
 #include <QMediaMetaData>
 #include <QMediaDevices>
@@ -38,28 +39,38 @@ Rtmp::Rtmp()
     ui->textTerminal->setStyleSheet("font: 10pt; color: #00cccc; background-color: #001a1a;");
     //    ui->audioOutputDeviceBox->setStyleSheet("font-size: 10pt; font-weight: bold; color: white;background-color:orange; padding: 6px; spacing: 6px;");
     connect(ui->audioOutputDeviceBox, QOverload<int>::of(&QComboBox::activated), this, &Rtmp::outputDeviceChanged);
+    connect(ui->audioBufferBox, QOverload<int>::of(&QComboBox::activated), this, &Rtmp::outputDeviceChanged);
+    connect(ui->checkLowLatency, &QCheckBox::toggled, this, &Rtmp::setLowLatency);
+    connect(ui->checkPreview, &QCheckBox::toggled, this, &Rtmp::setPreviewEnabled);
+    connect(ui->pushPreviewPause, &QPushButton::toggled, this, &Rtmp::pausePreview);
+    connect(ui->pushPreviewRewind, &QPushButton::clicked, this, &Rtmp::rewindPreview);
+    connect(ui->pushPreviewLive, &QPushButton::clicked, this, &Rtmp::goLivePreview);
+    ui->labelLatency->setStyleSheet("font-size: 12pt; font-weight: bold; color: #ECF0F1;background-color: #2E4053;   padding: 6px; spacing: 6px;");
     QObject::connect(this, SIGNAL(spectValueChanged(int)),this, SLOT(onSpectrumProcessed(int)));
 
-    ui->graphicsView->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
-
-    for (auto &device: QMediaDevices::audioOutputs()) {
-        auto name = device.description();
-        ui->audioOutputDeviceBox->addItem(name, QVariant::fromValue(device));
-    }
+    updateAudioOutputs();
+    connect(&m_devices, &QMediaDevices::audioOutputsChanged, this, &Rtmp::updateAudioOutputs);
+    // 0 leaves the device buffer to the latency profile
+    ui->audioBufferBox->addItem("Auto buffer", 0);
+    // Up to AV_SYNC_MAX_SINK_MS, the A/V sync queue is sized for it
+    for (int ms : {10, 20, 40, 80, 160})
+        ui->audioBufferBox->addItem(QString::number(ms) + " ms buffer", ms);
 
     m_audioInput.reset(new QAudioInput);
     m_captureSession.setAudioInput(m_audioInput.get());
 
-    m_ffmpeg_rtmp = new ffmpeg_rtmp();
+    m_sessionManager = new RtmpSessionManager(this);
+    m_ffmpeg_rtmp = m_sessionManager->addSession(QString(), DEFAULT_RTMP_PORT);
     if(m_ffmpeg_rtmp)
     {
         connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendUrl,this, &Rtmp::setUrl);
         connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendInfo,this, &Rtmp::setInfo);
         connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendConnectionStatus,this, &Rtmp::setConnectionStatus);
-        connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendVideoFrame,this, &Rtmp::setVideoFrame);
-        connect(m_ffmpeg_rtmp,&ffmpeg_rtmp::sendAudioFrame,this, &Rtmp::setAudioFrame);
-        m_ffmpeg_rtmp->setUrl();
+        // The spectrum reads decoded audio at display rate from the session's ring
+        m_analysisReader = m_ffmpeg_rtmp->analysisRing().addReader();
+        setUrl(m_ffmpeg_rtmp->url());
     }
+    parseArguments();
 
     //Camera devices:
 
@@ -71,16 +82,177 @@ Rtmp::Rtmp()
     connect(videoDevicesGroup, &QActionGroup::triggered, this, &Rtmp::updateCameraDevice);
     connect(ui->captureWidget, &QTabWidget::currentChanged, this, &Rtmp::updateCaptureMode);
 
-    scene = new QGraphicsScene;
-    QBrush brush(Qt::black); // Set the desired background color
-    scene->setBackgroundBrush(brush);
-    view = ui->graphicsView;
-    view->setScene(scene);
+    // The converter follows the preview size, the widget only scales up small streams
+    connect(ui->previewWidget, &PreviewWidget::deviceSizeChanged, this, &Rtmp::updatePreviewSize);
+    updatePreviewSize();
+    m_previewTimer.setTimerType(Qt::PreciseTimer);
+    connect(&m_previewTimer, &QTimer::timeout, this, &Rtmp::presentPreview);
+    connect(&m_previewTimer, &QTimer::timeout, this, &Rtmp::readAudio);
     setCamera(QMediaDevices::defaultVideoInput());
     initSpectrumGraph();
 }
 
 
+void Rtmp::parseArguments()
+{
+    // --session <key>:<port>[:<host>] adds a publisher
+    // --decoder-threads <n> and --decoder-threading frame|slice|lowlatency tune video decode
+    // --record-only starts every session without decoders
+    // --probesize <bytes>, --analyzeduration <us> and --fpsprobesize <n> tune fast-start probing, --no-fast-start keeps FFmpeg's defaults
+    // --record-dir, --segment-seconds, --segment-mb, --segment-format fmp4|ts and --disk-quota-mb set up recording
+    // --restream <url|file> (repeatable) copies every session to rtmp://, udp:// or a .flv/.mkv/.mp4/.ts file
+    // --ladder 1080p,720p,480p@1000 encodes HLS renditions, with --hls-dir, --hls-segment-seconds and --ladder-encoder
+    // --timeshift-seconds <n> keeps n seconds per session for rewinding the preview, off by default
+    // --write-buffer-mb sizes the recorder write-behind memory, --direct-io bypasses the page cache, --sync-write turns it off
+    // --audio-latency-ms <n> sets the audio jitter buffer target, it still grows on underruns
+    // --no-av-sync shows preview frames as soon as they are converted instead of against the audio clock
+    // --preview-rgb converts every preview frame to RGB instead of handing YUV frames to Qt Multimedia
+    // --preview-threads <n> slices preview conversion, --preview-swscale turns the SIMD kernels off
+    const QStringList args = QCoreApplication::arguments();
+    DecoderThreading threading;
+    RecorderSettings recorder;
+    ProbeSettings probe;
+    probe.fastStart = !args.contains("--no-fast-start");
+    int timeshiftSeconds = 0;
+    int previewThreads = 0;
+    int audioLatencyMs = 0;
+    bool previewKernels = !args.contains("--preview-swscale");
+    bool previewZeroCopy = !args.contains("--preview-rgb");
+    bool avSync = !args.contains("--no-av-sync");
+    QStringList restreamTargets;
+    LadderSettings ladder;
+    bool recordOnly = args.contains("--record-only");
+    recorder.writer.directIo = args.contains("--direct-io");
+    recorder.writer.enabled = !args.contains("--sync-write");
+
+    for (int i = 1; i + 1 < args.size(); ++i)
+    {
+        if (args[i] == "--record-dir")
+        {
+            recorder.directory = args[++i];
+        }
+        else if (args[i] == "--probesize")
+        {
+            probe.probeSize = args[++i].toLongLong();
+        }
+        else if (args[i] == "--analyzeduration")
+        {
+            probe.analyzeDurationUs = args[++i].toLongLong();
+        }
+        else if (args[i] == "--fpsprobesize")
+        {
+            probe.fpsProbeSize = args[++i].toInt();
+        }
+        else if (args[i] == "--segment-seconds")
+        {
+            recorder.segmentSeconds = args[++i].toInt();
+        }
+        else if (args[i] == "--segment-mb")
+        {
+            recorder.segmentBytes = args[++i].toLongLong() * 1024 * 1024;
+        }
+        else if (args[i] == "--segment-format")
+        {
+            recorder.container = args[++i] == "ts" ? SegmentContainer::MpegTs : SegmentContainer::FragmentedMp4;
+        }
+        else if (args[i] == "--disk-quota-mb")
+        {
+            recorder.diskQuotaBytes = args[++i].toLongLong() * 1024 * 1024;
+        }
+        else if (args[i] == "--write-buffer-mb")
+        {
+            recorder.writer.memoryBudget = args[++i].toLongLong() * 1024 * 1024;
+        }
+        else if (args[i] == "--ladder")
+        {
+            ladder.enabled = true;
+            ladder.renditions = LadderSettings::parse(args[++i]);
+        }
+        else if (args[i] == "--hls-dir")
+        {
+            ladder.directory = args[++i];
+        }
+        else if (args[i] == "--hls-segment-seconds")
+        {
+            ladder.segmentSeconds = args[++i].toInt();
+        }
+        else if (args[i] == "--ladder-encoder")
+        {
+            ladder.encoder = args[++i];
+        }
+        else if (args[i] == "--restream")
+        {
+            restreamTargets.append(args[++i]);
+        }
+        else if (args[i] == "--timeshift-seconds")
+        {
+            timeshiftSeconds = args[++i].toInt();
+        }
+        else if (args[i] == "--audio-latency-ms")
+        {
+            audioLatencyMs = args[++i].toInt();
+        }
+        else if (args[i] == "--preview-threads")
+        {
+            previewThreads = args[++i].toInt();
+        }
+        else if (args[i] == "--decoder-threads")
+        {
+            threading.threadCount = args[++i].toInt();
+        }
+        else if (args[i] == "--decoder-threading")
+        {
+            const QString mode = args[++i];
+            if (mode == "slice")
+                threading.mode = DecoderThreadMode::Slice;
+            else if (mode == "lowlatency")
+                threading.mode = DecoderThreadMode::LowLatencySlice;
+            else
+                threading.mode = DecoderThreadMode::Frame;
+        }
+        else if (args[i] == "--session")
+        {
+            const QStringList parts = args[++i].split(':');
+            if (parts.size() < 2 || parts[0].isEmpty())
+            {
+                setInfo("Invalid session: " + args[i]);
+                continue;
+            }
+
+            QString host = parts.size() > 2 ? parts[2] : QString();
+            ffmpeg_rtmp *session = m_sessionManager->addSession(parts[0], parts[1].toInt(), host);
+            if (!session)
+            {
+                setInfo("Session key or port already in use: " + args[i]);
+                continue;
+            }
+            setInfo("Session " + parts[0] + ": " + session->url());
+        }
+    }
+
+    for (const QString &key : m_sessionManager->sessionKeys())
+    {
+        m_sessionManager->session(key)->setProbeSettings(probe);
+        m_sessionManager->session(key)->setDecoderThreading(threading);
+        m_sessionManager->session(key)->setDecodeEnabled(!recordOnly);
+        m_sessionManager->session(key)->setRecorderSettings(recorder);
+        m_sessionManager->session(key)->setTimeshiftSeconds(timeshiftSeconds);
+        m_sessionManager->session(key)->setRestreamTargets(restreamTargets);
+        m_sessionManager->session(key)->setLadderSettings(ladder);
+        m_sessionManager->session(key)->setPreviewThreads(previewThreads);
+        m_sessionManager->session(key)->setPreviewKernels(previewKernels);
+        m_sessionManager->session(key)->setPreviewZeroCopy(previewZeroCopy);
+        m_sessionManager->session(key)->setAudioLatency(audioLatencyMs);
+        m_sessionManager->session(key)->setAvSyncEnabled(avSync);
+    }
+    QSignalBlocker blocker(ui->checkPreview);
+    ui->checkPreview->setChecked(!recordOnly);
+    // Without the buffer there is nothing to rewind into, pause still freezes the picture
+    ui->pushPreviewRewind->setEnabled(timeshiftSeconds > 0);
+
+    connect(m_sessionManager, &RtmpSessionManager::sessionInfo, this, &Rtmp::setSessionInfo);
+}
+
 void Rtmp::resizeEvent(QResizeEvent *event)
 {
     int width = event->size().width();
@@ -89,6 +261,12 @@ void Rtmp::resizeEvent(QResizeEvent *event)
 //    ui->graphicsView->setFixedSize(2 * width, height);
 }
 
+void Rtmp::updatePreviewSize()
+{
+    if (m_ffmpeg_rtmp)
+        m_ffmpeg_rtmp->setPreviewSize(ui->previewWidget->deviceSize());
+}
+
 void Rtmp::onSpectrumProcessed(int fftSize)
 {
     ui->Plotter->setNewFttData(d_iirFftData, d_realFftData, fftSize/2);
@@ -131,27 +309,133 @@ void Rtmp::initSpectrumGraph()
 
 }
 
-void Rtmp::setVideoFrame(QImage image)
+void Rtmp::presentPreview()
+{
+    PreviewFrame frame;
+    if (!m_ffmpeg_rtmp || !m_ffmpeg_rtmp->takePreviewFrame(frame))
+        return;
+
+    if (frame.video.isValid())
+        showPreviewFrame(frame.video);
+    else
+        showPreviewImage(frame.image);
+    updateLatency(frame.timing);
+}
+
+void Rtmp::showPreviewImage(const QImage &image)
 {
-    scene->clear();
-    QGraphicsPixmapItem *pixmapItem = scene->addPixmap(QPixmap::fromImage(image));
-    view->fitInView(scene->sceneRect(), Qt::KeepAspectRatio);
-    view->update();
+    // Frames arrive letterboxed to the widget size in device pixels and are drawn in place
+    ui->previewWidget->setImage(image);
+    ui->previewStack->setCurrentWidget(ui->previewWidget);
 }
 
-void Rtmp::setAudioFrame(const char * payloadbuf, int payloadlen)
+void Rtmp::showPreviewFrame(const QVideoFrame &frame)
 {
+    // Qt Multimedia converts and scales on the GPU, the frame keeps the decoder buffer alive until replaced
+    ui->videoPreview->videoSink()->setVideoFrame(frame);
+    ui->previewStack->setCurrentWidget(ui->videoPreview);
+}
 
-    for (int i = 0; i < payloadlen; i++)
+void Rtmp::updateLatency(const FrameTiming &timing)
+{
+    int64_t shownUs = av_gettime_relative();
+    m_latencyDecode.add((timing.decodedUs - timing.arrivalUs) / 1000.0);
+    m_latencyConvert.add((timing.convertedUs - timing.decodedUs) / 1000.0);
+    m_latencyDisplay.add((shownUs - timing.convertedUs) / 1000.0);
+    m_latencyTotal.add((shownUs - timing.arrivalUs) / 1000.0);
+
+    // Refresh the figure a few times per second, not per frame
+    if (shownUs - m_latencyShownUs > 250000)
     {
-        if(sampleCount < DEFAULT_FFT_SIZE)
-        {
-            signalInput[sampleCount] = payloadbuf[i];
-            sampleCount ++;
-        }
-        else
+        m_latencyShownUs = shownUs;
+        ui->labelLatency->setText(QString::number(m_latencyTotal.mean(), 'f', 0) + " ms");
+        SessionStats stats = m_ffmpeg_rtmp->stats();
+        quint64 spectrumLost = m_analysisReader >= 0 ? m_ffmpeg_rtmp->analysisRing().overruns(m_analysisReader) : 0;
+        QString avSync = stats.avSyncActive
+                ? QString("A/V offset %1 ms, %2 dropped late, %3 held, %4 unsynchronised").arg(stats.avSyncOffsetMs, 0, 'f', 1)
+                      .arg(stats.avSyncDroppedLate).arg(stats.avSyncHeld).arg(stats.avSyncFallbacks)
+                : QString("A/V sync off");
+        ui->labelLatency->setToolTip(QString("decode %1 ms, convert %2 ms, display %3 ms, paint %6 ms\n%4 frames shown, %5 overwritten\nspectrum lost %7 samples\naudio %8 ms buffered (target %9 ms), %10 underruns, %11 overruns, drift %12 ppm\ndevice buffer %13 ms, output latency %14 ms\n%15")
+                                     .arg(m_latencyDecode.mean(), 0, 'f', 1)
+                                     .arg(m_latencyConvert.mean(), 0, 'f', 1)
+                                     .arg(m_latencyDisplay.mean(), 0, 'f', 1)
+                                     .arg(stats.previewFramesDisplayed)
+                                     .arg(stats.previewFramesOverwritten)
+                                     .arg(ui->previewWidget->paintTimeMs(), 0, 'f', 2)
+                                     .arg(spectrumLost)
+                                     .arg(stats.playout.bufferedMs, 0, 'f', 0)
+                                     .arg(stats.playout.targetMs, 0, 'f', 0)
+                                     .arg(stats.playout.underruns)
+                                     .arg(stats.playout.overruns)
+                                     .arg(stats.audioDriftPpm, 0, 'f', 1)
+                                     .arg(stats.playout.sinkBufferMs, 0, 'f', 1)
+                                     .arg(stats.playout.sinkBufferMs + stats.playout.bufferedMs, 0, 'f', 0)
+                                     .arg(avSync));
+    }
+}
+
+void Rtmp::setPreviewEnabled(bool enabled)
+{
+    // Takes effect on the next packet, decoding resumes at the next keyframe
+    m_ffmpeg_rtmp->setDecodeEnabled(enabled);
+    if (!enabled)
+    {
+        ui->previewWidget->clear();
+        ui->videoPreview->videoSink()->setVideoFrame(QVideoFrame());
+    }
+}
+
+void Rtmp::pausePreview(bool paused)
+{
+    if (paused)
+        m_ffmpeg_rtmp->pausePreview();
+    else
+        m_ffmpeg_rtmp->resumePreview();
+}
+
+void Rtmp::rewindPreview()
+{
+    QSignalBlocker blocker(ui->pushPreviewPause);
+    ui->pushPreviewPause->setChecked(false);
+    m_ffmpeg_rtmp->seekPreview(-PREVIEW_REWIND_SECONDS);
+}
+
+void Rtmp::goLivePreview()
+{
+    QSignalBlocker blocker(ui->pushPreviewPause);
+    ui->pushPreviewPause->setChecked(false);
+    m_ffmpeg_rtmp->goLivePreview();
+}
+
+void Rtmp::setLowLatency(bool enabled)
+{
+    m_ffmpeg_rtmp->setLatencyProfile(enabled ? LatencyProfile::LowLatency : LatencyProfile::Default);
+    m_latencyTotal.reset();
+    m_latencyDecode.reset();
+    m_latencyConvert.reset();
+    m_latencyDisplay.reset();
+
+    // The profile is applied on (re)connect
+    m_sessionManager->restartSession(QString());
+    setInfo(enabled ? "Low latency profile enabled." : "Default latency profile enabled.");
+}
+
+void Rtmp::readAudio()
+{
+    if (!m_ffmpeg_rtmp || m_analysisReader < 0)
+        return;
+
+    // One transform per full buffer, whatever is left waits for the next tick
+    AudioRing &ring = m_ffmpeg_rtmp->analysisRing();
+    for (;;)
+    {
+        size_t read = ring.read(m_analysisReader, signalInput + sampleCount, DEFAULT_FFT_SIZE - sampleCount);
+        if (read == 0)
+            break;
+        sampleCount += read;
+        if (sampleCount == DEFAULT_FFT_SIZE)
         {
-            runFFTW(signalInput,DEFAULT_FFT_SIZE);
+            runFFTW(signalInput, DEFAULT_FFT_SIZE);
             sampleCount = 0;
         }
     }
@@ -167,10 +451,11 @@ void Rtmp::runFFTW(float *buffer, int fftsize)
 
         planFft = fftw_plan_dft_1d(fftsize, in, out, FFTW_FORWARD, FFTW_ESTIMATE);
 
+        // Real samples in [-1, 1]
         for (i=0; i < fftsize; i++)
         {
-            in[i][0] = (float)buffer[i] / 127.5f - 1.f;
-            in[i][1] = (float)-buffer[i+1] / 127.5f - 1.f;
+            in[i][0] = buffer[i];
+            in[i][1] = 0.f;
         }
 
         fftw_execute(planFft);
@@ -191,8 +476,31 @@ void Rtmp::runFFTW(float *buffer, int fftsize)
 
 void Rtmp::outputDeviceChanged(int index)
 {
-    QAudioDevice ouputDevice = ui->audioOutputDeviceBox->itemData(index).value<QAudioDevice>();
-    m_ffmpeg_rtmp->set_audio_device(ouputDevice);
+    Q_UNUSED(index);
+    // Both boxes land here, the sessions switch at their next audio packet without reconnecting
+    QAudioDevice outputDevice = ui->audioOutputDeviceBox->currentData().value<QAudioDevice>();
+    int bufferMs = ui->audioBufferBox->currentData().toInt();
+    for (const QString &key : m_sessionManager->sessionKeys())
+        m_sessionManager->session(key)->setAudioOutput(outputDevice, bufferMs);
+    setInfo("Audio output: " + (outputDevice.isNull() ? QString("default") : outputDevice.description())
+            + ", " + ui->audioBufferBox->currentText());
+}
+
+void Rtmp::updateAudioOutputs()
+{
+    // Keeps the selection if the device is still there, an unplugged one falls back to the default
+    QAudioDevice current = ui->audioOutputDeviceBox->currentData().value<QAudioDevice>();
+    QSignalBlocker blocker(ui->audioOutputDeviceBox);
+    ui->audioOutputDeviceBox->clear();
+    ui->audioOutputDeviceBox->addItem("Default output", QVariant::fromValue(QAudioDevice()));
+    for (auto &device: QMediaDevices::audioOutputs()) {
+        auto name = device.description();
+        ui->audioOutputDeviceBox->addItem(name, QVariant::fromValue(device));
+        if (!current.isNull() && device.id() == current.id())
+            ui->audioOutputDeviceBox->setCurrentIndex(ui->audioOutputDeviceBox->count() - 1);
+    }
+    if (!current.isNull() && ui->audioOutputDeviceBox->currentIndex() == 0 && m_sessionManager)
+        outputDeviceChanged(0);
 }
 
 
@@ -522,12 +830,12 @@ void Rtmp::on_pushStream_clicked()
 {
     if(ui->pushStream->text() == "Start")
     {
-        m_ffmpeg_rtmp->start();
+        m_sessionManager->startAll();
         ui->pushStream->setText("Stop");
     }
     else
     {
-        m_ffmpeg_rtmp->stop();
+        m_sessionManager->stopAll();
         ui->pushStream->setText("Start");
     }
 }
@@ -537,6 +845,13 @@ void Rtmp::setInfo(QString message)
     ui->textTerminal->append(message);
 }
 
+void Rtmp::setSessionInfo(QString streamKey, QString message)
+{
+    // The default session reports through setInfo directly
+    if (!streamKey.isEmpty())
+        setInfo("[" + streamKey + "] " + message);
+}
+
 void Rtmp::setUrl(QString url)
 {
     ui->labelRtmpUrl->setText(url);
@@ -548,11 +863,19 @@ void Rtmp::setConnectionStatus(bool status)
     {
         ui->pushStream->setText("Stop");
         setInfo("Rtmp stream started.");
+        // Every publisher starts with a live preview
+        QSignalBlocker blocker(ui->pushPreviewPause);
+        ui->pushPreviewPause->setChecked(false);
+        // Paced by the refresh rate of the screen the window is on
+        qreal refreshRate = screen() ? screen()->refreshRate() : 60.0;
+        m_previewTimer.start(qMax(1, qRound(1000.0 / qMax<qreal>(refreshRate, 1.0))));
     }
     else
     {
         ui->pushStream->setText("Start");
         setInfo("Rtmp stream stopped.");
+        m_previewTimer.stop();
+        presentPreview();
     }
 }
 
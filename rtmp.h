@@ -12,11 +12,11 @@
 #include <QMediaPlayer>
 #include <QMainWindow>
 #include <QMediaFormat>
-#include <QGraphicsView>
-#include <QGraphicsScene>
 #include <QTimer>
 #include <fftw3.h>
 #include "ffmpeg_rtmp.h"
+#include "rtmp_session_manager.h"
+#include "rolling_average.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class Camera; }
@@ -26,6 +26,7 @@ QT_END_NAMESPACE
 #define DEFAULT_SAMPLE_RATE		44100
 #define DEFAULT_FFT_SIZE        4096
 #define RESET_FFT_FACTOR        -72.0f
+#define PREVIEW_REWIND_SECONDS  10
 #define REAL 0
 #define IMAG 1
 
@@ -84,14 +85,21 @@ private slots:
     void showMetaDataDialog();
 
     void setInfo(QString);
+    void setSessionInfo(QString, QString);
     void setUrl(QString);
     void setConnectionStatus(bool);
-    void setVideoFrame(QImage);
-    void setAudioFrame(const char*, int);
+    void presentPreview();
+    void readAudio();
 
     void on_pushStream_clicked();
     void on_pushExit_clicked();
     void outputDeviceChanged(int index);
+    void updateAudioOutputs();
+    void setLowLatency(bool enabled);
+    void setPreviewEnabled(bool enabled);
+    void pausePreview(bool paused);
+    void rewindPreview();
+    void goLivePreview();
 
     void initSpectrumGraph();
     void runFFTW(float *buffer, int fftsize);
@@ -108,8 +116,15 @@ protected:
     void handleResizeEvent(QResizeEvent* event);
 
 private:
+    void parseArguments();
+    void updatePreviewSize();
+    void showPreviewImage(const QImage &image);
+    void showPreviewFrame(const QVideoFrame &frame);
+    void updateLatency(const FrameTiming &timing);
+
     Ui::Camera *ui;
 
+    RtmpSessionManager *m_sessionManager = nullptr;
     ffmpeg_rtmp* m_ffmpeg_rtmp = nullptr;
     QActionGroup *videoDevicesGroup  = nullptr;
     QMediaDevices m_devices;
@@ -119,13 +134,21 @@ private:
     QImageCapture *m_imageCapture;
     QScopedPointer<QMediaRecorder> m_mediaRecorder;
 
-    QGraphicsScene *scene;
-    QGraphicsView *view;
+    // Pulls the newest preview frame once per display refresh while a publisher is connected
+    QTimer m_previewTimer;
+
+    // Glass-to-glass latency of the preview: packet arrival to frame on screen
+    RollingAverage m_latencyTotal;
+    RollingAverage m_latencyDecode;
+    RollingAverage m_latencyConvert;
+    RollingAverage m_latencyDisplay;
+    int64_t m_latencyShownUs = 0;
 
     bool m_isCapturingImage = false;
     bool m_applicationExiting = false;
     bool m_doImageCapture = true;
 
+    int m_analysisReader = -1;
     unsigned int sampleCount = 0;
     float   *d_realFftData;
     float   *d_iirFftData;
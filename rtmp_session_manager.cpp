@@ -0,0 +1,131 @@
+#include "rtmp_session_manager.h"
+
+#define SESSION_STOP_WAIT_MS    3000
+
+RtmpSessionManager::RtmpSessionManager(QObject *parent)
+    : QObject{parent}
+{
+    m_workerPool.setMaxThreadCount(QThread::idealThreadCount());
+    m_workerPool.setObjectName("rtmp workers");
+}
+
+RtmpSessionManager::~RtmpSessionManager()
+{
+    const QStringList keys = m_sessions.keys();
+    for (const QString &key : keys)
+        removeSession(key);
+    m_workerPool.waitForDone();
+}
+
+ffmpeg_rtmp* RtmpSessionManager::addSession(const QString &streamKey, int port, const QString &host)
+{
+    if (m_sessions.contains(streamKey))
+        return nullptr;
+
+    for (const Session &session : std::as_const(m_sessions))
+    {
+        if (session.port == port)
+            return nullptr;
+    }
+
+    ffmpeg_rtmp *streamer = new ffmpeg_rtmp();
+    streamer->setWorkerPool(&m_workerPool);
+    connect(streamer, &ffmpeg_rtmp::sendInfo, this, [this, streamKey](QString message) {
+        emit sessionInfo(streamKey, message);
+    });
+
+    Session session;
+    session.streamer = streamer;
+    session.port = port;
+    m_sessions.insert(streamKey, session);
+
+    streamer->setUrl(host.isEmpty() ? ffmpeg_rtmp::localAddress() : host, port, streamKey);
+    return streamer;
+}
+
+bool RtmpSessionManager::removeSession(const QString &streamKey)
+{
+    if (!m_sessions.contains(streamKey))
+        return false;
+
+    ffmpeg_rtmp *streamer = m_sessions.take(streamKey).streamer;
+    streamer->disconnect(this);
+    streamer->stop();
+
+    if (!streamer->isRunning() || streamer->wait(SESSION_STOP_WAIT_MS))
+        delete streamer;
+    else
+        connect(streamer, &QThread::finished, streamer, &QObject::deleteLater);
+
+    return true;
+}
+
+bool RtmpSessionManager::startSession(const QString &streamKey)
+{
+    ffmpeg_rtmp *streamer = session(streamKey);
+    if (!streamer)
+        return false;
+
+    if (streamer->isRunning())
+    {
+        if (!streamer->stopRequested())
+            return true;
+        // Teardown is interruptible, so this only waits for the last stage to exit
+        streamer->wait();
+    }
+    streamer->start();
+    return true;
+}
+
+bool RtmpSessionManager::stopSession(const QString &streamKey)
+{
+    ffmpeg_rtmp *streamer = session(streamKey);
+    if (!streamer)
+        return false;
+
+    streamer->stop();
+    return true;
+}
+
+bool RtmpSessionManager::restartSession(const QString &streamKey)
+{
+    ffmpeg_rtmp *streamer = session(streamKey);
+    if (!streamer)
+        return false;
+
+    streamer->restart();
+    return true;
+}
+
+void RtmpSessionManager::startAll()
+{
+    for (const QString &key : m_sessions.keys())
+        startSession(key);
+}
+
+void RtmpSessionManager::stopAll()
+{
+    for (const QString &key : m_sessions.keys())
+        stopSession(key);
+}
+
+ffmpeg_rtmp* RtmpSessionManager::session(const QString &streamKey) const
+{
+    auto it = m_sessions.constFind(streamKey);
+    if (it == m_sessions.constEnd())
+        return nullptr;
+    return it->streamer;
+}
+
+QStringList RtmpSessionManager::sessionKeys() const
+{
+    return m_sessions.keys();
+}
+
+SessionStats RtmpSessionManager::sessionStats(const QString &streamKey) const
+{
+    ffmpeg_rtmp *streamer = session(streamKey);
+    if (!streamer)
+        return SessionStats();
+    return streamer->stats();
+}
@@ -0,0 +1,52 @@
+#ifndef RTMP_SESSION_MANAGER_H
+#define RTMP_SESSION_MANAGER_H
+
+#include <QObject>
+#include <QMap>
+#include <QThreadPool>
+
+#include "ffmpeg_rtmp.h"
+
+// Owns every ingest session of this process.
+// Each session listens on its own port and owns its FFmpeg contexts, while
+// decode and mux work of all sessions is shared on one pool sized to the core count.
+class RtmpSessionManager : public QObject
+{
+    Q_OBJECT
+public:
+    explicit RtmpSessionManager(QObject *parent = nullptr);
+    ~RtmpSessionManager();
+
+    // An empty host picks the first LAN address, use 127.0.0.1 for loopback publishers.
+    // Returns nullptr if the stream key or the port is already taken.
+    ffmpeg_rtmp* addSession(const QString &streamKey, int port, const QString &host = QString());
+    bool removeSession(const QString &streamKey);
+
+    bool startSession(const QString &streamKey);
+    bool stopSession(const QString &streamKey);
+    // Drops the current publisher so that the next one can connect
+    bool restartSession(const QString &streamKey);
+    void startAll();
+    void stopAll();
+
+    ffmpeg_rtmp* session(const QString &streamKey) const;
+    QStringList sessionKeys() const;
+    SessionStats sessionStats(const QString &streamKey) const;
+
+    QThreadPool* workerPool() { return &m_workerPool; }
+
+signals:
+    void sessionInfo(QString streamKey, QString message);
+
+private:
+    struct Session
+    {
+        ffmpeg_rtmp *streamer {nullptr};
+        int port {0};
+    };
+
+    QMap<QString, Session> m_sessions;
+    QThreadPool m_workerPool;
+};
+
+#endif // RTMP_SESSION_MANAGER_H
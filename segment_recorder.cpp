@@ -0,0 +1,407 @@
+#include "segment_recorder.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QTextStream>
+#include <algorithm>
+#include <cmath>
+
+SegmentRecorder::SegmentRecorder(QObject *parent)
+    : QObject{parent}
+{
+}
+
+SegmentRecorder::~SegmentRecorder()
+{
+    close();
+    // Waits for the last segment to reach the disk
+    delete m_writer;
+}
+
+void SegmentRecorder::setSettings(const RecorderSettings &settings)
+{
+    if (settings.directory != m_settings.directory || settings.container != m_settings.container)
+        m_indexLoaded = false;
+    m_settings = settings;
+}
+
+void SegmentRecorder::setBaseName(const QString &baseName)
+{
+    if (baseName != m_baseName)
+        m_indexLoaded = false;
+    m_baseName = baseName;
+}
+
+QString SegmentRecorder::directory() const
+{
+    if (!m_active.directory.isEmpty())
+        return m_active.directory;
+    return QStandardPaths::writableLocation(QStandardPaths::DesktopLocation) + "/recordings";
+}
+
+QString SegmentRecorder::indexPath() const
+{
+    const bool hls = m_active.container == SegmentContainer::MpegTs;
+    return QDir(directory()).filePath(m_baseName + (hls ? ".m3u8" : ".index"));
+}
+
+AsyncWriterStats SegmentRecorder::writerStats() const
+{
+    QMutexLocker locker(&m_writerMutex);
+    return m_writer ? m_writer->stats() : AsyncWriterStats();
+}
+
+void SegmentRecorder::update_writer()
+{
+    const AsyncWriterSettings &settings = m_active.writer;
+    bool changed = settings.bufferSize != m_writerSettings.bufferSize
+            || settings.memoryBudget != m_writerSettings.memoryBudget
+            || settings.directIo != m_writerSettings.directIo
+            || settings.flushIntervalMs != m_writerSettings.flushIntervalMs;
+    if (m_writer && settings.enabled && !changed)
+        return;
+
+    // The writer outlives segments and publishers, it is only rebuilt when its settings change
+    QMutexLocker locker(&m_writerMutex);
+    delete m_writer;
+    m_writer = settings.enabled ? new AsyncAvioWriter(settings) : nullptr;
+    m_writerSettings = settings;
+    m_reportedStalls = 0;
+    m_reportedErrors = 0;
+}
+
+bool SegmentRecorder::open(AVFormatContext *input, int videoIndex)
+{
+    close();
+
+    m_active = m_settings;
+    update_writer();
+    m_input = input;
+    m_videoIndex = videoIndex;
+    m_referenceIndex = videoIndex;
+
+    // Audio-only input is cut on any packet of its first stream
+    if (m_referenceIndex < 0 && m_input->nb_streams > 0)
+        m_referenceIndex = 0;
+
+    if (!QDir().mkpath(directory()))
+    {
+        emit sendInfo("Recorder: cannot create " + directory());
+        return false;
+    }
+
+    if (!m_indexLoaded)
+    {
+        load_index();
+        m_indexLoaded = true;
+    }
+
+    // A new publisher starts a new segment, earlier files are never reopened
+    return open_segment(true);
+}
+
+void SegmentRecorder::close()
+{
+    if (m_output)
+        close_segment();
+    m_input = nullptr;
+}
+
+int SegmentRecorder::write(AVPacket *packet)
+{
+    if (!m_output)
+    {
+        av_packet_unref(packet);
+        return AVERROR(EINVAL);
+    }
+
+    if (packet->stream_index == m_referenceIndex && packet->pts != AV_NOPTS_VALUE)
+    {
+        bool keyframe = m_videoIndex < 0 || (packet->flags & AV_PKT_FLAG_KEY);
+        if (keyframe && rotation_due(packet->pts))
+        {
+            close_segment();
+            if (!open_segment(false))
+            {
+                av_packet_unref(packet);
+                return AVERROR(EIO);
+            }
+        }
+
+        if (m_segmentStartPts == AV_NOPTS_VALUE)
+            m_segmentStartPts = packet->pts;
+        int64_t end = packet->pts + packet->duration;
+        if (m_segmentEndPts == AV_NOPTS_VALUE || end > m_segmentEndPts)
+            m_segmentEndPts = end;
+    }
+
+    AVStream *inputStream = m_input->streams[packet->stream_index];
+    AVStream *outputStream = m_output->streams[packet->stream_index];
+
+    // Rescale packet timestamps
+    av_packet_rescale_ts(packet, inputStream->time_base, outputStream->time_base);
+    packet->pos = -1;
+
+    return av_interleaved_write_frame(m_output, packet);
+}
+
+bool SegmentRecorder::rotation_due(int64_t pts) const
+{
+    if (m_segmentStartPts == AV_NOPTS_VALUE)
+        return false;
+
+    if (m_active.segmentSeconds > 0)
+    {
+        AVRational timeBase = m_input->streams[m_referenceIndex]->time_base;
+        if ((pts - m_segmentStartPts) * av_q2d(timeBase) >= m_active.segmentSeconds)
+            return true;
+    }
+
+    if (m_active.segmentBytes > 0 && avio_tell(m_output->pb) >= m_active.segmentBytes)
+        return true;
+
+    return false;
+}
+
+bool SegmentRecorder::open_segment(bool discontinuity)
+{
+    const bool ts = m_active.container == SegmentContainer::MpegTs;
+    QString fileName = QString("%1_%2_%3.%4")
+            .arg(m_baseName,
+                 QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss"))
+            .arg(m_sequence++, 4, 10, QChar('0'))
+            .arg(ts ? "ts" : "mp4");
+    QString path = QDir(directory()).filePath(fileName);
+
+    if (avformat_alloc_output_context2(&m_output, nullptr, ts ? "mpegts" : "mp4", path.toStdString().c_str()) < 0) {
+        qDebug() << "error avformat_alloc_output_context2";
+        return false;
+    }
+
+    // Copy all input streams to the segment
+    for (unsigned int i = 0; i < m_input->nb_streams; ++i) {
+        AVStream *outputStream = avformat_new_stream(m_output, nullptr);
+        if (!outputStream) {
+            avformat_free_context(m_output);
+            m_output = nullptr;
+            return false;
+        }
+        avcodec_parameters_copy(outputStream->codecpar, m_input->streams[i]->codecpar);
+        // FLV codec tags mean nothing to the segment muxer
+        outputStream->codecpar->codec_tag = 0;
+    }
+
+    if (m_active.flushPackets)
+        m_output->flush_packets = 1;
+
+    int ret = 0;
+    if (m_writer) {
+        m_output->pb = m_writer->openFile(path);
+        m_output->flags |= AVFMT_FLAG_CUSTOM_IO;
+        if (!m_output->pb)
+            ret = AVERROR(EIO);
+    } else {
+        ret = avio_open(&m_output->pb, path.toStdString().c_str(), AVIO_FLAG_WRITE);
+    }
+    if (ret < 0) {
+        qDebug() << "error avio_open" << path;
+        avformat_free_context(m_output);
+        m_output = nullptr;
+        return false;
+    }
+
+    // Every keyframe closes a fragment, so the file is playable up to the last one
+    AVDictionary *muxer_opts = NULL;
+    if (!ts)
+        av_dict_set(&muxer_opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+
+    ret = avformat_write_header(m_output, &muxer_opts);
+    av_dict_free(&muxer_opts);
+    if (ret < 0) {
+        qDebug() << "error avformat_write_header";
+        if (m_writer) {
+            m_writer->closeFile();
+            m_output->pb = nullptr;
+        } else {
+            avio_closep(&m_output->pb);
+        }
+        avformat_free_context(m_output);
+        m_output = nullptr;
+        QFile::remove(path);
+        return false;
+    }
+
+    Segment segment;
+    segment.fileName = fileName;
+    segment.discontinuity = discontinuity;
+    m_segments.append(segment);
+    m_segmentStartPts = AV_NOPTS_VALUE;
+    m_segmentEndPts = AV_NOPTS_VALUE;
+
+    write_index();
+    emit sendInfo("Recording " + fileName);
+    return true;
+}
+
+void SegmentRecorder::close_segment()
+{
+    av_write_trailer(m_output);
+    qint64 bytes = -1;
+    if (m_writer)
+    {
+        // The tail is written in the background, the next segment does not wait for it
+        bytes = m_writer->fileBytes();
+        m_writer->closeFile();
+        m_output->pb = nullptr;
+    }
+    else
+    {
+        avio_closep(&m_output->pb);
+    }
+    avformat_free_context(m_output);
+    m_output = nullptr;
+
+    if (!m_segments.isEmpty())
+    {
+        Segment &segment = m_segments.last();
+        if (m_segmentStartPts != AV_NOPTS_VALUE && m_segmentEndPts != AV_NOPTS_VALUE)
+        {
+            AVRational timeBase = m_input->streams[m_referenceIndex]->time_base;
+            segment.duration = (m_segmentEndPts - m_segmentStartPts) * av_q2d(timeBase);
+        }
+        segment.bytes = bytes >= 0 ? bytes : QFileInfo(QDir(directory()).filePath(segment.fileName)).size();
+    }
+
+    if (m_writer)
+    {
+        AsyncWriterStats stats = m_writer->stats();
+        if (stats.stalls > m_reportedStalls)
+        {
+            emit sendInfo(QString("Recorder: disk too slow, waited %1 times (%2 ms total), %3 MB/s")
+                          .arg(stats.stalls).arg(stats.stallTimeUs / 1000).arg(stats.throughputMBps, 0, 'f', 1));
+            m_reportedStalls = stats.stalls;
+        }
+        if (stats.writeErrors > m_reportedErrors)
+        {
+            emit sendInfo(QString("Recorder: %1 write errors").arg(stats.writeErrors));
+            m_reportedErrors = stats.writeErrors;
+        }
+    }
+
+    enforce_quota();
+    write_index();
+}
+
+void SegmentRecorder::enforce_quota()
+{
+    if (m_active.diskQuotaBytes <= 0)
+        return;
+
+    qint64 total = 0;
+    for (const Segment &segment : std::as_const(m_segments))
+        total += segment.bytes;
+
+    // The newest segment is never deleted, it may still be in use
+    while (total > m_active.diskQuotaBytes && m_segments.size() > 1)
+    {
+        Segment oldest = m_segments.takeFirst();
+        m_mediaSequence++;
+        QFile::remove(QDir(directory()).filePath(oldest.fileName));
+        total -= oldest.bytes;
+        emit sendInfo("Recorder quota: removed " + oldest.fileName);
+    }
+}
+
+void SegmentRecorder::load_index()
+{
+    m_segments.clear();
+
+    QFile file(indexPath());
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return;
+
+    QTextStream in(&file);
+    Segment pending;
+    m_mediaSequence = 0;
+    while (!in.atEnd())
+    {
+        QString line = in.readLine().trimmed();
+        // The MP4 index uses the HLS layout without the prefixes
+        if (line.startsWith("#EXT-X-"))
+            line.remove(1, 6);
+        if (line.startsWith("#MEDIA-SEQUENCE:"))
+        {
+            m_mediaSequence = line.mid(16).toLongLong();
+        }
+        else if (line.startsWith("#EXTINF:") || line.startsWith("#DURATION:"))
+        {
+            pending.duration = line.section(':', 1).section(',', 0, 0).toDouble();
+        }
+        else if (line == "#DISCONTINUITY")
+        {
+            pending.discontinuity = true;
+        }
+        else if (!line.isEmpty() && !line.startsWith('#'))
+        {
+            // Segments removed by hand are dropped from the index
+            QFileInfo info(QDir(directory()).filePath(line));
+            if (info.exists())
+            {
+                pending.fileName = line;
+                pending.bytes = info.size();
+                m_segments.append(pending);
+            }
+            else if (m_segments.isEmpty())
+            {
+                m_mediaSequence++;
+            }
+            pending = Segment();
+        }
+    }
+}
+
+void SegmentRecorder::write_index()
+{
+    double target = m_active.segmentSeconds;
+    for (const Segment &segment : std::as_const(m_segments))
+        target = std::max(target, segment.duration);
+
+    // Written to a temporary file and renamed, a crash never leaves half an index
+    QSaveFile file(indexPath());
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+        return;
+
+    QTextStream out(&file);
+    if (m_active.container == SegmentContainer::MpegTs)
+    {
+        out << "#EXTM3U\n";
+        out << "#EXT-X-VERSION:3\n";
+        out << "#EXT-X-TARGETDURATION:" << static_cast<int>(std::ceil(target)) << "\n";
+        out << "#EXT-X-MEDIA-SEQUENCE:" << m_mediaSequence << "\n";
+        for (const Segment &segment : std::as_const(m_segments))
+        {
+            if (segment.discontinuity)
+                out << "#EXT-X-DISCONTINUITY\n";
+            out << "#EXTINF:" << QString::number(segment.duration, 'f', 3) << ",\n";
+            out << segment.fileName << "\n";
+        }
+    }
+    else
+    {
+        out << "#MEDIA-SEQUENCE:" << m_mediaSequence << "\n";
+        for (const Segment &segment : std::as_const(m_segments))
+        {
+            if (segment.discontinuity)
+                out << "#DISCONTINUITY\n";
+            out << "#DURATION:" << QString::number(segment.duration, 'f', 3) << "\n";
+            out << segment.fileName << "\n";
+        }
+    }
+    out.flush();
+    file.commit();
+}
@@ -0,0 +1,108 @@
+#ifndef SEGMENT_RECORDER_H
+#define SEGMENT_RECORDER_H
+
+#include <QObject>
+#include <QList>
+#include <QMutex>
+#include <QString>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include "async_avio_writer.h"
+
+#define DEFAULT_SEGMENT_SECONDS     60
+
+enum class SegmentContainer
+{
+    FragmentedMp4,
+    MpegTs
+};
+
+struct RecorderSettings
+{
+    SegmentContainer container {SegmentContainer::FragmentedMp4};
+    QString directory;                          // empty: Desktop/recordings
+    int segmentSeconds {DEFAULT_SEGMENT_SECONDS}; // 0 disables time based rotation
+    int64_t segmentBytes {0};                   // 0 disables size based rotation
+    int64_t diskQuotaBytes {0};                 // 0 keeps every segment
+    bool flushPackets {false};
+    AsyncWriterSettings writer;                 // disabled: plain avio_open
+};
+
+// Records the input streams into a rolling set of self-contained segments.
+// Segments are fragmented MP4 or MPEG-TS, both readable without a trailer, so a
+// crash loses at most the last fragment. Cuts happen on video keyframes only.
+// An index next to the segments lists them in order and survives restarts: an HLS
+// m3u8 for MPEG-TS, a plain list in the same line layout for MP4, whose self-contained
+// segments are not valid HLS media segments. The oldest segments are deleted when the
+// disk quota is exceeded.
+class SegmentRecorder : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SegmentRecorder(QObject *parent = nullptr);
+    ~SegmentRecorder();
+
+    // Both are applied by the next open()
+    void setSettings(const RecorderSettings &settings);
+    void setBaseName(const QString &baseName);
+
+    // Starts a new segment for a newly connected publisher
+    bool open(AVFormatContext *input, int videoIndex);
+    // Packet timestamps are in the input stream time base, the packet data is consumed
+    int write(AVPacket *packet);
+    void close();
+
+    bool isOpen() const { return m_output != nullptr; }
+    // <base>.m3u8 for MPEG-TS, <base>.index for MP4
+    QString indexPath() const;
+    // Safe to call from any thread
+    AsyncWriterStats writerStats() const;
+
+signals:
+    void sendInfo(QString);
+
+private:
+    struct Segment
+    {
+        QString fileName;
+        double duration {0};
+        qint64 bytes {0};
+        bool discontinuity {false};
+    };
+
+    bool open_segment(bool discontinuity);
+    void close_segment();
+    bool rotation_due(int64_t pts) const;
+    void load_index();
+    void write_index();
+    void enforce_quota();
+    void update_writer();
+    QString directory() const;
+
+    RecorderSettings m_settings;
+    RecorderSettings m_active;
+    QString m_baseName {"output"};
+
+    AVFormatContext *m_input {nullptr};
+    AVFormatContext *m_output {nullptr};
+    AsyncAvioWriter *m_writer {nullptr};
+    AsyncWriterSettings m_writerSettings;
+    mutable QMutex m_writerMutex;
+    quint64 m_reportedStalls {0};
+    quint64 m_reportedErrors {0};
+    int m_videoIndex {-1};
+    int m_referenceIndex {-1};
+    int64_t m_segmentStartPts {AV_NOPTS_VALUE};
+    int64_t m_segmentEndPts {AV_NOPTS_VALUE};
+    int m_sequence {0};
+
+    QList<Segment> m_segments;
+    qint64 m_mediaSequence {0};
+    bool m_indexLoaded {false};
+};
+
+#endif // SEGMENT_RECORDER_H
@@ -0,0 +1,130 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free single-producer / single-consumer ring.
+// Exactly one thread may call push() and exactly one other thread may call pop().
+// The capacity is rounded up to the next power of two.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity)
+    {
+        m_capacity = 1;
+        while (m_capacity < capacity)
+            m_capacity <<= 1;
+        m_mask = m_capacity - 1;
+        m_buffer.resize(m_capacity);
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side. Returns false when the queue is full.
+    bool push(const T &value)
+    {
+        T copy = value;
+        return push(std::move(copy));
+    }
+
+    bool push(T &&value)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tailCache >= m_capacity)
+        {
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+            if (head - m_tailCache >= m_capacity)
+                return false;
+        }
+        m_buffer[head & m_mask] = std::move(value);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false when the queue is empty.
+    bool pop(T &value)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_headCache)
+        {
+            m_headCache = m_head.load(std::memory_order_acquire);
+            if (tail == m_headCache)
+                return false;
+        }
+        value = std::move(m_buffer[tail & m_mask]);
+        // Shared handles left in the slot would keep their buffers alive until it is reused
+        m_buffer[tail & m_mask] = T();
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side, bulk. Copies as many values as fit and returns how many.
+    size_t write(const T *values, size_t count)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (m_capacity - (head - m_tailCache) < count)
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+        count = std::min(count, m_capacity - (head - m_tailCache));
+
+        // At most two runs, before and after the wrap
+        const size_t first = std::min(count, m_capacity - (head & m_mask));
+        std::copy(values, values + first, m_buffer.begin() + (head & m_mask));
+        std::copy(values + first, values + count, m_buffer.begin());
+        m_head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer side, bulk. Copies up to count values and returns how many.
+    size_t read(T *values, size_t count)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (m_headCache - tail < count)
+            m_headCache = m_head.load(std::memory_order_acquire);
+        count = std::min(count, m_headCache - tail);
+
+        const size_t first = std::min(count, m_capacity - (tail & m_mask));
+        std::copy(m_buffer.begin() + (tail & m_mask), m_buffer.begin() + (tail & m_mask) + first, values);
+        std::copy(m_buffer.begin(), m_buffer.begin() + (count - first), values + first);
+        m_tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer side: drops up to count of the oldest values and returns how many
+    size_t skip(size_t count)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        m_headCache = m_head.load(std::memory_order_acquire);
+        count = std::min(count, m_headCache - tail);
+        m_tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    // Approximate when called from a thread other than producer or consumer.
+    size_t size() const
+    {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return m_capacity; }
+
+private:
+    std::vector<T> m_buffer;
+    size_t m_capacity {0};
+    size_t m_mask {0};
+
+    // Producer and consumer indices live on separate cache lines,
+    // each next to the cached copy of the other side's index.
+    alignas(64) std::atomic<size_t> m_head {0};
+    size_t m_tailCache {0};
+    alignas(64) std::atomic<size_t> m_tail {0};
+    size_t m_headCache {0};
+};
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,80 @@
+#include "stream_param_cache.h"
+
+StreamParamCache& StreamParamCache::instance()
+{
+    static StreamParamCache cache;
+    return cache;
+}
+
+StreamParamCache::~StreamParamCache()
+{
+    for (Entry &entry : m_entries)
+    {
+        avcodec_parameters_free(&entry.video);
+        avcodec_parameters_free(&entry.audio);
+    }
+}
+
+bool StreamParamCache::isComplete(const AVCodecParameters *params)
+{
+    if (!params || params->codec_id == AV_CODEC_ID_NONE)
+        return false;
+
+    if (params->codec_type == AVMEDIA_TYPE_VIDEO)
+        return params->width > 0 && params->height > 0 && params->format >= 0;
+
+    if (params->codec_type == AVMEDIA_TYPE_AUDIO)
+    {
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+        return params->sample_rate > 0 && params->channels > 0 && params->format >= 0;
+#else
+        return params->sample_rate > 0 && params->ch_layout.nb_channels > 0 && params->format >= 0;
+#endif
+    }
+
+    return false;
+}
+
+void StreamParamCache::store(const QString &key, const AVCodecParameters *video, const AVCodecParameters *audio)
+{
+    if (!isComplete(video) || !isComplete(audio))
+        return;
+
+    QMutexLocker locker(&m_mutex);
+
+    Entry &entry = m_entries[key];
+    if (!entry.video)
+        entry.video = avcodec_parameters_alloc();
+    if (!entry.audio)
+        entry.audio = avcodec_parameters_alloc();
+    if (!entry.video || !entry.audio)
+        return;
+
+    avcodec_parameters_copy(entry.video, video);
+    avcodec_parameters_copy(entry.audio, audio);
+}
+
+bool StreamParamCache::load(const QString &key, AVCodecParameters *video, AVCodecParameters *audio) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    auto it = m_entries.constFind(key);
+    if (it == m_entries.constEnd() || !it->video || !it->audio)
+        return false;
+
+    return avcodec_parameters_copy(video, it->video) >= 0
+            && avcodec_parameters_copy(audio, it->audio) >= 0;
+}
+
+void StreamParamCache::remove(const QString &key)
+{
+    QMutexLocker locker(&m_mutex);
+
+    auto it = m_entries.find(key);
+    if (it == m_entries.end())
+        return;
+
+    avcodec_parameters_free(&it->video);
+    avcodec_parameters_free(&it->audio);
+    m_entries.erase(it);
+}
@@ -0,0 +1,42 @@
+#ifndef STREAM_PARAM_CACHE_H
+#define STREAM_PARAM_CACHE_H
+
+#include <QMap>
+#include <QMutex>
+#include <QString>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// Codec parameters learned for each publisher, shared by all sessions.
+// A returning publisher is opened from these instead of a full stream probe.
+class StreamParamCache
+{
+public:
+    static StreamParamCache& instance();
+
+    // Only complete parameters (with dimensions / sample rate) are stored
+    void store(const QString &key, const AVCodecParameters *video, const AVCodecParameters *audio);
+    // Copies the cached parameters into caller-allocated video and audio
+    bool load(const QString &key, AVCodecParameters *video, AVCodecParameters *audio) const;
+    void remove(const QString &key);
+
+    static bool isComplete(const AVCodecParameters *params);
+
+private:
+    StreamParamCache() = default;
+    ~StreamParamCache();
+
+    struct Entry
+    {
+        AVCodecParameters *video {nullptr};
+        AVCodecParameters *audio {nullptr};
+    };
+
+    mutable QMutex m_mutex;
+    QMap<QString, Entry> m_entries;
+};
+
+#endif // STREAM_PARAM_CACHE_H
@@ -0,0 +1,270 @@
+#include <QCoreApplication>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+#include "audio_converter.h"
+#include "preview_converter.h"
+#include "yuv_to_rgb.h"
+
+#define PREVIEW_BENCHMARK_FRAMES    30
+#define YUV_BENCHMARK_FRAMES        20
+#define AUDIO_BENCHMARK_FRAMES      2000
+#define AUDIO_BENCHMARK_SAMPLES     1024
+
+// Sliced against single-threaded conversion of synthetic 4:2:0 frames at 1080p, 4K and 8K
+static QStringList benchmark_preview()
+{
+    const QSize sizes[] = { QSize(1920, 1080), QSize(3840, 2160), QSize(7680, 4320) };
+    QStringList report;
+
+    for (const QSize &size : sizes)
+    {
+        AVFrame *frame = av_frame_alloc();
+        frame->width = size.width();
+        frame->height = size.height();
+        frame->format = AV_PIX_FMT_YUV420P;
+        if (av_frame_get_buffer(frame, 0) < 0)
+        {
+            av_frame_free(&frame);
+            report << QString("Preview convert %1x%2: no memory").arg(size.width()).arg(size.height());
+            continue;
+        }
+
+        // A gradient, so that the converter does real work on every pixel
+        for (int y = 0; y < frame->height; ++y)
+            for (int x = 0; x < frame->width; ++x)
+                frame->data[0][y * frame->linesize[0] + x] = static_cast<uint8_t>(x + y);
+        for (int plane = 1; plane < 3; ++plane)
+            for (int y = 0; y < frame->height / 2; ++y)
+                memset(frame->data[plane] + y * frame->linesize[plane], plane == 1 ? 96 : 160, frame->width / 2);
+
+        // swscale first, then the kernels when the CPU has any
+        const int paths = YuvToRgb::level() != SimdLevel::Scalar ? 2 : 1;
+        for (int kernels = 0; kernels < paths; ++kernels)
+        {
+            double ms[2] = {};
+            int slices = 1;
+            const char *path = "";
+            for (int run = 0; run < 2; ++run)
+            {
+                PreviewConverter converter;
+                converter.setThreadCount(run == 0 ? 1 : 0);
+                converter.setKernelsEnabled(kernels);
+                QImage image;
+                // The first frame builds the contexts and the pool
+                converter.convert(frame, image);
+                int64_t startUs = av_gettime_relative();
+                for (int i = 0; i < PREVIEW_BENCHMARK_FRAMES; ++i)
+                    converter.convert(frame, image);
+                ms[run] = (av_gettime_relative() - startUs) / 1000.0 / PREVIEW_BENCHMARK_FRAMES;
+                slices = converter.stats().slices;
+                path = converter.stats().path;
+            }
+
+            report << QString("Preview convert %1x%2 %3: %4 ms single, %5 ms in %6 slices (x%7)")
+                      .arg(size.width()).arg(size.height()).arg(path)
+                      .arg(ms[0], 0, 'f', 2).arg(ms[1], 0, 'f', 2).arg(slices)
+                      .arg(ms[1] > 0 ? ms[0] / ms[1] : 0, 0, 'f', 2);
+        }
+        av_frame_free(&frame);
+    }
+    return report;
+}
+
+// Each kernel against swscale, single-threaded, at 1080p, 4K and 8K. tests/yuv_to_rgb checks the output.
+static QStringList benchmark_kernels()
+{
+    const int sizes[][2] = { {1920, 1080}, {3840, 2160}, {7680, 4320} };
+    const AVPixelFormat formats[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12 };
+    QStringList report;
+
+    for (AVPixelFormat format : formats)
+    {
+        for (const auto &size : sizes)
+        {
+            AVFrame *frame = av_frame_alloc();
+            frame->width = size[0];
+            frame->height = size[1];
+            frame->format = format;
+            if (av_frame_get_buffer(frame, 0) < 0)
+            {
+                av_frame_free(&frame);
+                continue;
+            }
+            uint32_t seed = 12345;
+            for (int plane = 0; plane < 3 && frame->data[plane]; ++plane)
+            {
+                int rows = plane ? (frame->height + 1) / 2 : frame->height;
+                for (int y = 0; y < rows; ++y)
+                    for (int x = 0; x < frame->linesize[plane]; ++x)
+                    {
+                        seed = seed * 1664525 + 1013904223;
+                        frame->data[plane][y * frame->linesize[plane] + x] = seed >> 24;
+                    }
+            }
+
+            const int stride = frame->width * 4;
+            std::vector<uint8_t> output((size_t)stride * frame->height);
+            QString line = QString("%1 %2x%3:").arg(format == AV_PIX_FMT_NV12 ? "NV12" : "YUV420P")
+                           .arg(frame->width).arg(frame->height);
+
+            SwsContext *sws = sws_getContext(frame->width, frame->height, format, frame->width, frame->height,
+                                             AV_PIX_FMT_RGB32, SWS_BILINEAR, nullptr, nullptr, nullptr);
+            if (sws)
+            {
+                uint8_t *destData[1] = { output.data() };
+                int destLinesize[1] = { stride };
+                int64_t startUs = av_gettime_relative();
+                for (int i = 0; i < YUV_BENCHMARK_FRAMES; ++i)
+                    sws_scale(sws, frame->data, frame->linesize, 0, frame->height, destData, destLinesize);
+                double ms = (av_gettime_relative() - startUs) / 1000.0 / YUV_BENCHMARK_FRAMES;
+                sws_freeContext(sws);
+                line += QString(" swscale %1 ms").arg(ms, 0, 'f', 2);
+            }
+
+            for (SimdLevel kernel : YuvToRgb::levels())
+            {
+                int64_t startUs = av_gettime_relative();
+                for (int i = 0; i < YUV_BENCHMARK_FRAMES; ++i)
+                    YuvToRgb::convert(frame, output.data(), stride, 0, frame->height, kernel);
+                double ms = (av_gettime_relative() - startUs) / 1000.0 / YUV_BENCHMARK_FRAMES;
+                line += QString(", %1 %2 ms").arg(YuvToRgb::name(kernel)).arg(ms, 0, 'f', 2);
+            }
+            av_frame_free(&frame);
+            report << line;
+        }
+    }
+    return report;
+}
+
+// A quiet sine in every channel, so that float formats never hold denormals or NaNs
+static void fill_sine(AVFrame *frame, int channels)
+{
+    const AVSampleFormat format = static_cast<AVSampleFormat>(frame->format);
+    const bool planar = av_sample_fmt_is_planar(format);
+    const int bytes = av_get_bytes_per_sample(format);
+
+    for (int ch = 0; ch < channels; ++ch)
+    {
+        for (int i = 0; i < frame->nb_samples; ++i)
+        {
+            double value = 0.5 * std::sin((i + ch * 7) * 0.0625);
+            uint8_t *p = planar ? frame->extended_data[ch] + i * bytes
+                                : frame->extended_data[0] + (i * channels + ch) * bytes;
+            switch (av_get_packed_sample_fmt(format))
+            {
+            case AV_SAMPLE_FMT_U8:
+                *p = static_cast<uint8_t>(128 + value * 127);
+                break;
+            case AV_SAMPLE_FMT_S16:
+                *reinterpret_cast<int16_t*>(p) = static_cast<int16_t>(value * INT16_MAX);
+                break;
+            case AV_SAMPLE_FMT_S32:
+                *reinterpret_cast<int32_t*>(p) = static_cast<int32_t>(value * INT32_MAX);
+                break;
+            case AV_SAMPLE_FMT_S64:
+                *reinterpret_cast<int64_t*>(p) = static_cast<int64_t>(value * INT32_MAX) << 32;
+                break;
+            case AV_SAMPLE_FMT_FLT:
+                *reinterpret_cast<float*>(p) = static_cast<float>(value);
+                break;
+            case AV_SAMPLE_FMT_DBL:
+                *reinterpret_cast<double*>(p) = value;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+// Every packed and planar sample format in mono, stereo and 5.1 to stereo S16
+static QStringList benchmark_audio()
+{
+    const AVSampleFormat formats[] = {
+        AV_SAMPLE_FMT_U8, AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S64, AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_DBL,
+        AV_SAMPLE_FMT_U8P, AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S32P, AV_SAMPLE_FMT_S64P, AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_DBLP
+    };
+    const int channelCounts[] = { 1, 2, 6 };
+    QStringList report;
+
+    for (AVSampleFormat format : formats)
+    {
+        QString line = QString("Audio convert %1 to s16 stereo:").arg(av_get_sample_fmt_name(format));
+        for (int channels : channelCounts)
+        {
+            AVFrame *frame = av_frame_alloc();
+            frame->format = format;
+            frame->sample_rate = 48000;
+            frame->nb_samples = AUDIO_BENCHMARK_SAMPLES;
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 0, 0)
+            frame->channels = channels;
+            frame->channel_layout = av_get_default_channel_layout(channels);
+#else
+            av_channel_layout_default(&frame->ch_layout, channels);
+#endif
+            if (av_frame_get_buffer(frame, 0) < 0)
+            {
+                av_frame_free(&frame);
+                line += QString(" %1ch no memory,").arg(channels);
+                continue;
+            }
+            fill_sine(frame, channels);
+
+            AudioConverter converter;
+            converter.setOutput(AV_SAMPLE_FMT_S16, 2);
+            const uint8_t *data = nullptr;
+            int bytes = 0;
+            // The first frame builds the context and the buffer
+            converter.convert(frame, data, bytes);
+            int64_t startUs = av_gettime_relative();
+            for (int i = 0; i < AUDIO_BENCHMARK_FRAMES; ++i)
+                converter.convert(frame, data, bytes);
+            double us = static_cast<double>(av_gettime_relative() - startUs) / AUDIO_BENCHMARK_FRAMES;
+            av_frame_free(&frame);
+
+            line += QString(" %1ch %2 us/frame (%3 Msamples/s, %4 allocations),").arg(channels)
+                    .arg(us, 0, 'f', 2).arg(us > 0 ? AUDIO_BENCHMARK_SAMPLES * channels / us : 0, 0, 'f', 0)
+                    .arg(converter.stats().bufferAllocations);
+        }
+        line.chop(1);
+        report << line;
+    }
+    return report;
+}
+
+// benchmarks [preview] [kernels] [audio], all of them without arguments.
+// Takes a few seconds at 8K.
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QStringList which = app.arguments().mid(1);
+    if (which.isEmpty())
+        which = QStringList { "preview", "kernels", "audio" };
+
+    for (const QString &name : which)
+    {
+        QStringList lines;
+        if (name == "preview")
+            lines = benchmark_preview();
+        else if (name == "kernels")
+            lines = benchmark_kernels();
+        else if (name == "audio")
+            lines = benchmark_audio();
+        else
+        {
+            std::cerr << "unknown benchmark " << name.toStdString() << ", expected preview, kernels or audio" << std::endl;
+            return 1;
+        }
+        for (const QString &line : lines)
+            std::cout << line.toStdString() << std::endl;
+    }
+    return 0;
+}
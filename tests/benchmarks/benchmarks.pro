@@ -0,0 +1,22 @@
+TEMPLATE = app
+TARGET = benchmarks
+
+QT = core gui
+CONFIG += console c++17
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../..
+
+HEADERS = \
+    ../../audio_converter.h \
+    ../../preview_converter.h \
+    ../../rolling_average.h \
+    ../../yuv_to_rgb.h
+
+SOURCES = \
+    ../../audio_converter.cpp \
+    ../../preview_converter.cpp \
+    ../../yuv_to_rgb.cpp \
+    benchmarks.cpp
+
+include(../../ffmpeg.pri)
@@ -0,0 +1,18 @@
+TEMPLATE = app
+TARGET = tst_restream_output
+
+QT = core testlib
+CONFIG += console testcase c++17
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../..
+
+HEADERS = \
+    ../../restream_output.h \
+    ../../spsc_queue.h
+
+SOURCES = \
+    ../../restream_output.cpp \
+    tst_restream_output.cpp
+
+include(../../ffmpeg.pri)
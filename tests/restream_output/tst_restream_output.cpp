@@ -0,0 +1,90 @@
+#include <QTemporaryDir>
+#include <QTest>
+#include <cstring>
+
+#include "restream_output.h"
+
+#define TEST_PACKETS    200
+#define TEST_PACKET_MS  40
+
+class TestRestreamOutput : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void stoppedFileIsComplete_data();
+    void stoppedFileIsComplete();
+};
+
+void TestRestreamOutput::stoppedFileIsComplete_data()
+{
+    QTest::addColumn<QString>("extension");
+
+    QTest::newRow("mkv") << "mkv";
+    QTest::newRow("mp4") << "mp4";
+}
+
+// stop() right after the last push: the queued packets and the trailer must still reach the file
+void TestRestreamOutput::stoppedFileIsComplete()
+{
+    QFETCH(QString, extension);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("restream." + extension);
+
+    // An input with one intra-only video stream, as the demux thread would hand over
+    AVFormatContext *input = avformat_alloc_context();
+    AVStream *stream = avformat_new_stream(input, nullptr);
+    QVERIFY(stream);
+    stream->time_base = AVRational{1, 1000};
+    stream->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    stream->codecpar->codec_id = AV_CODEC_ID_MJPEG;
+    stream->codecpar->width = 320;
+    stream->codecpar->height = 240;
+
+    RestreamOutput output(path);
+    output.start(input, 0);
+    avformat_free_context(input);
+    // Packets that arrive before the file is open are dropped by design
+    QTRY_COMPARE(output.stats().state, RestreamState::Running);
+
+    AVPacket *packet = av_packet_alloc();
+    for (int i = 0; i < TEST_PACKETS; ++i)
+    {
+        QCOMPARE(av_new_packet(packet, 1000), 0);
+        memset(packet->data, i, packet->size);
+        packet->stream_index = 0;
+        packet->pts = packet->dts = i * TEST_PACKET_MS;
+        packet->duration = TEST_PACKET_MS;
+        packet->flags |= AV_PKT_FLAG_KEY;
+        output.push(packet);
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    output.stop();
+
+    const RestreamStats stats = output.stats();
+    QCOMPARE(stats.state, RestreamState::Stopped);
+    QCOMPARE(stats.packetsDropped, quint64(0));
+    QCOMPARE(stats.packetsWritten, quint64(TEST_PACKETS));
+
+    AVFormatContext *result = nullptr;
+    QCOMPARE(avformat_open_input(&result, path.toStdString().c_str(), nullptr, nullptr), 0);
+    // Both muxers hold the last cluster or fragment back until the trailer
+    int packets = 0;
+    AVPacket *read = av_packet_alloc();
+    while (av_read_frame(result, read) >= 0)
+    {
+        packets++;
+        av_packet_unref(read);
+    }
+    av_packet_free(&read);
+    avformat_close_input(&result);
+
+    QCOMPARE(packets, TEST_PACKETS);
+}
+
+QTEST_GUILESS_MAIN(TestRestreamOutput)
+
+#include "tst_restream_output.moc"
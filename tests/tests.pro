@@ -0,0 +1,12 @@
+# Programs that exercise single classes of the app outside of it, on synthetic input:
+#   yuv_to_rgb       the 4:2:0 kernels against the scalar code and swscale
+#   restream_output  file restreams stopped mid-stream come out complete
+#   benchmarks       times preview, kernel and audio conversion and prints the numbers
+# qmake tests/tests.pro && make && make check, every program but benchmarks is a pass/fail test.
+# They build the app's sources they need from the parent directory and link FFmpeg through ffmpeg.pri.
+
+TEMPLATE = subdirs
+SUBDIRS = \
+    benchmarks \
+    restream_output \
+    yuv_to_rgb
@@ -0,0 +1,179 @@
+#include <QTest>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+extern "C"
+{
+#include <libswscale/swscale.h>
+}
+
+#include "yuv_to_rgb.h"
+
+Q_DECLARE_METATYPE(AVPixelFormat)
+
+// Every input value shows up, so saturation and rounding are both covered
+static AVFrame* random_frame(AVPixelFormat format, int width, int height)
+{
+    AVFrame *frame = av_frame_alloc();
+    frame->width = width;
+    frame->height = height;
+    frame->format = format;
+    if (av_frame_get_buffer(frame, 0) < 0)
+    {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+
+    uint32_t seed = 12345;
+    for (int plane = 0; plane < 3 && frame->data[plane]; ++plane)
+    {
+        int rows = plane ? (frame->height + 1) / 2 : frame->height;
+        for (int y = 0; y < rows; ++y)
+            for (int x = 0; x < frame->linesize[plane]; ++x)
+            {
+                seed = seed * 1664525 + 1013904223;
+                frame->data[plane][y * frame->linesize[plane] + x] = seed >> 24;
+            }
+    }
+    return frame;
+}
+
+class TestYuvToRgb : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    void kernelsMatchScalar_data();
+    void kernelsMatchScalar();
+    void slicesMatchWhole_data();
+    void slicesMatchWhole();
+    void scalarMatchesSwscale_data();
+    void scalarMatchesSwscale();
+
+private:
+    void add_frames();
+};
+
+void TestYuvToRgb::initTestCase()
+{
+    if (!YuvToRgb::supports(AV_PIX_FMT_YUV420P))
+        QSKIP("The kernels write RGB32 in little-endian order only");
+    qInfo() << "kernels:" << YuvToRgb::levels().size() - 1 << "best:" << YuvToRgb::name(YuvToRgb::level());
+}
+
+// Odd and non-multiple-of-16 sizes reach the scalar tails of every kernel
+void TestYuvToRgb::add_frames()
+{
+    QTest::addColumn<AVPixelFormat>("format");
+    QTest::addColumn<int>("width");
+    QTest::addColumn<int>("height");
+
+    const int sizes[][2] = { {1920, 1080}, {1280, 720}, {642, 362}, {33, 17}, {1, 1} };
+    for (AVPixelFormat format : { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12 })
+        for (const auto &size : sizes)
+            QTest::addRow("%s %dx%d", format == AV_PIX_FMT_NV12 ? "NV12" : "YUV420P", size[0], size[1])
+                << format << size[0] << size[1];
+}
+
+void TestYuvToRgb::kernelsMatchScalar_data()
+{
+    add_frames();
+}
+
+void TestYuvToRgb::kernelsMatchScalar()
+{
+    QFETCH(AVPixelFormat, format);
+    QFETCH(int, width);
+    QFETCH(int, height);
+
+    AVFrame *frame = random_frame(format, width, height);
+    QVERIFY(frame);
+    const int stride = width * 4;
+    std::vector<uint8_t> scalar((size_t)stride * height), output(scalar.size());
+    YuvToRgb::convert(frame, scalar.data(), stride, 0, height, SimdLevel::Scalar);
+
+    for (SimdLevel level : YuvToRgb::levels())
+    {
+        std::fill(output.begin(), output.end(), 0);
+        YuvToRgb::convert(frame, output.data(), stride, 0, height, level);
+        if (memcmp(output.data(), scalar.data(), output.size()) != 0)
+        {
+            av_frame_free(&frame);
+            QFAIL(qPrintable(QString("%1 differs from scalar").arg(YuvToRgb::name(level))));
+        }
+    }
+    av_frame_free(&frame);
+}
+
+void TestYuvToRgb::slicesMatchWhole_data()
+{
+    add_frames();
+}
+
+// The preview converter hands each band to a different thread, bands may start on odd rows
+void TestYuvToRgb::slicesMatchWhole()
+{
+    QFETCH(AVPixelFormat, format);
+    QFETCH(int, width);
+    QFETCH(int, height);
+
+    AVFrame *frame = random_frame(format, width, height);
+    QVERIFY(frame);
+    const int stride = width * 4;
+    std::vector<uint8_t> whole((size_t)stride * height), sliced(whole.size());
+    YuvToRgb::convert(frame, whole.data(), stride, 0, height);
+
+    const int odd = std::min(height / 3 | 1, height);
+    const int cuts[] = { 0, odd, std::max(height / 2, odd), height };
+    for (int i = 0; i + 1 < 4; ++i)
+        YuvToRgb::convert(frame, sliced.data(), stride, cuts[i], cuts[i + 1]);
+    av_frame_free(&frame);
+    QVERIFY(whole == sliced);
+}
+
+void TestYuvToRgb::scalarMatchesSwscale_data()
+{
+    add_frames();
+}
+
+// Against the unscaled converter the preview used before the kernels
+void TestYuvToRgb::scalarMatchesSwscale()
+{
+    QFETCH(AVPixelFormat, format);
+    QFETCH(int, width);
+    QFETCH(int, height);
+
+    AVFrame *frame = random_frame(format, width, height);
+    QVERIFY(frame);
+    const int stride = width * 4;
+    std::vector<uint8_t> reference((size_t)stride * height), output(reference.size());
+
+    SwsContext *sws = sws_getContext(width, height, format, width, height,
+                                     AV_PIX_FMT_RGB32, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!sws)
+    {
+        av_frame_free(&frame);
+        QSKIP("swscale has no context for this size");
+    }
+    uint8_t *destData[1] = { reference.data() };
+    int destLinesize[1] = { stride };
+    sws_scale(sws, frame->data, frame->linesize, 0, height, destData, destLinesize);
+    sws_freeContext(sws);
+
+    YuvToRgb::convert(frame, output.data(), stride, 0, height, SimdLevel::Scalar);
+    av_frame_free(&frame);
+
+    int maxDiff = 0;
+    for (size_t i = 0; i < output.size(); ++i)
+        maxDiff = std::max(maxDiff, std::abs(int(output[i]) - int(reference[i])));
+    QVERIFY2(maxDiff <= YUV_SWSCALE_TOLERANCE, qPrintable(QString("max diff %1").arg(maxDiff)));
+}
+
+QTEST_APPLESS_MAIN(TestYuvToRgb)
+
+#include "tst_yuv_to_rgb.moc"
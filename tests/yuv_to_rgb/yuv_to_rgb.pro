@@ -0,0 +1,17 @@
+TEMPLATE = app
+TARGET = tst_yuv_to_rgb
+
+QT = core testlib
+CONFIG += console testcase c++17
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../..
+
+HEADERS = \
+    ../../yuv_to_rgb.h
+
+SOURCES = \
+    ../../yuv_to_rgb.cpp \
+    tst_yuv_to_rgb.cpp
+
+include(../../ffmpeg.pri)
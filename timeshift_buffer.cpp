@@ -0,0 +1,146 @@
+#include "timeshift_buffer.h"
+
+#include <algorithm>
+
+TimeshiftBuffer::TimeshiftBuffer(int windowSeconds, int64_t maxBytes)
+    : m_windowSeconds(windowSeconds)
+    , m_maxBytes(maxBytes)
+{
+    // Every slot exists up front, appending only moves references
+    int capacity = std::max(1, windowSeconds * TIMESHIFT_PACKETS_PER_SECOND);
+    m_slots.resize(capacity);
+    m_times.resize(capacity, AV_NOPTS_VALUE);
+    for (AVPacket *&slot : m_slots)
+        slot = av_packet_alloc();
+}
+
+TimeshiftBuffer::~TimeshiftBuffer()
+{
+    for (AVPacket *&slot : m_slots)
+        av_packet_free(&slot);
+}
+
+void TimeshiftBuffer::reset(AVFormatContext *input, int videoIndex)
+{
+    QMutexLocker locker(&m_mutex);
+
+    while (m_first < m_end)
+        evict_oldest();
+
+    m_timeBases.clear();
+    for (unsigned int i = 0; input && i < input->nb_streams; ++i)
+        m_timeBases.push_back(input->streams[i]->time_base);
+    m_videoIndex = videoIndex;
+    m_lastTimeUs = AV_NOPTS_VALUE;
+}
+
+int64_t TimeshiftBuffer::packet_time_us(const AVPacket *packet) const
+{
+    // dts is monotonic, pts jumps around with B-frames
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (ts == AV_NOPTS_VALUE || packet->stream_index < 0 || packet->stream_index >= (int)m_timeBases.size())
+        return m_lastTimeUs;
+    return av_rescale_q(ts, m_timeBases[packet->stream_index], AV_TIME_BASE_Q);
+}
+
+int64_t TimeshiftBuffer::append(const AVPacket *packet)
+{
+    QMutexLocker locker(&m_mutex);
+
+    int64_t timeUs = packet_time_us(packet);
+    if (timeUs == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+    // Interleaved streams may run slightly backwards, the ring stays ordered
+    if (m_lastTimeUs != AV_NOPTS_VALUE)
+        timeUs = std::max(timeUs, m_lastTimeUs);
+
+    const uint64_t capacity = m_slots.size();
+    while (m_end - m_first >= capacity
+           || (m_first < m_end && timeUs - m_times[m_first % capacity] > m_windowSeconds * 1000000LL)
+           || (m_first < m_end && m_bytes + packet->size > m_maxBytes))
+        evict_oldest();
+
+    AVPacket *slot = m_slots[m_end % capacity];
+    if (av_packet_ref(slot, packet) < 0)
+        return AV_NOPTS_VALUE;
+    m_times[m_end % capacity] = timeUs;
+    m_bytes += slot->size;
+
+    bool indexed;
+    if (m_videoIndex >= 0)
+        indexed = packet->stream_index == m_videoIndex && (packet->flags & AV_PKT_FLAG_KEY);
+    else
+        indexed = m_keyframes.empty() || timeUs - m_keyframes.back().timeUs >= TIMESHIFT_AUDIO_INDEX_US;
+    if (indexed)
+        m_keyframes.push_back({m_end, timeUs});
+
+    m_lastTimeUs = timeUs;
+    m_end++;
+    return timeUs;
+}
+
+void TimeshiftBuffer::evict_oldest()
+{
+    AVPacket *slot = m_slots[m_first % m_slots.size()];
+    m_bytes -= slot->size;
+    av_packet_unref(slot);
+    m_first++;
+
+    while (!m_keyframes.empty() && m_keyframes.front().seq < m_first)
+        m_keyframes.pop_front();
+}
+
+bool TimeshiftBuffer::read(uint64_t seq, AVPacket *packet, int64_t *timeUs) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (seq < m_first || seq >= m_end)
+        return false;
+
+    if (timeUs)
+        *timeUs = m_times[seq % m_slots.size()];
+    return av_packet_ref(packet, m_slots[seq % m_slots.size()]) >= 0;
+}
+
+bool TimeshiftBuffer::keyframeAt(int64_t timeUs, uint64_t &seq) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_keyframes.empty())
+        return false;
+
+    auto it = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), timeUs,
+                               [](int64_t time, const Keyframe &keyframe) { return time < keyframe.timeUs; });
+    seq = it == m_keyframes.begin() ? it->seq : std::prev(it)->seq;
+    return true;
+}
+
+uint64_t TimeshiftBuffer::firstSeq() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_first;
+}
+
+uint64_t TimeshiftBuffer::endSeq() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_end;
+}
+
+int64_t TimeshiftBuffer::startTimeUs() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_first < m_end ? m_times[m_first % m_slots.size()] : AV_NOPTS_VALUE;
+}
+
+int64_t TimeshiftBuffer::endTimeUs() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_lastTimeUs;
+}
+
+int64_t TimeshiftBuffer::bytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_bytes;
+}
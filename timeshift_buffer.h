@@ -0,0 +1,73 @@
+#ifndef TIMESHIFT_BUFFER_H
+#define TIMESHIFT_BUFFER_H
+
+#include <QMutex>
+#include <deque>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#define TIMESHIFT_PACKETS_PER_SECOND    200
+#define TIMESHIFT_MAX_BYTES             (512LL * 1024 * 1024)
+#define TIMESHIFT_AUDIO_INDEX_US        1000000
+
+// Ring of the last seconds of compressed packets for pausing and rewinding the preview.
+// Slots are allocated once; they hold references to the demuxed packet data, so
+// memory follows the bitrate. Positions are absolute sequence numbers, a slot is
+// seq % capacity. Video keyframes are indexed so that seeks start on a keyframe.
+// Written by the demux thread, read by the preview replay, both under one mutex.
+class TimeshiftBuffer
+{
+public:
+    explicit TimeshiftBuffer(int windowSeconds, int64_t maxBytes = TIMESHIFT_MAX_BYTES);
+    ~TimeshiftBuffer();
+
+    TimeshiftBuffer(const TimeshiftBuffer&) = delete;
+    TimeshiftBuffer& operator=(const TimeshiftBuffer&) = delete;
+
+    // Drops every packet and takes the time bases of a new publisher
+    void reset(AVFormatContext *input, int videoIndex);
+    // Returns the buffer time of the packet, AV_NOPTS_VALUE if it was not stored
+    int64_t append(const AVPacket *packet);
+
+    // Takes a reference on the packet at seq, false at the live edge or once evicted
+    bool read(uint64_t seq, AVPacket *packet, int64_t *timeUs = nullptr) const;
+    // Sequence of the latest keyframe at or before timeUs, or of the oldest one
+    bool keyframeAt(int64_t timeUs, uint64_t &seq) const;
+
+    uint64_t firstSeq() const;
+    uint64_t endSeq() const;
+    int64_t startTimeUs() const;
+    int64_t endTimeUs() const;
+    int64_t bytes() const;
+    int windowSeconds() const { return m_windowSeconds; }
+
+private:
+    struct Keyframe
+    {
+        uint64_t seq;
+        int64_t timeUs;
+    };
+
+    void evict_oldest();
+    int64_t packet_time_us(const AVPacket *packet) const;
+
+    const int m_windowSeconds;
+    const int64_t m_maxBytes;
+    std::vector<AVPacket*> m_slots;
+    std::vector<int64_t> m_times;
+    std::deque<Keyframe> m_keyframes;
+    std::vector<AVRational> m_timeBases;
+    int m_videoIndex {-1};
+
+    mutable QMutex m_mutex;
+    uint64_t m_first {0};
+    uint64_t m_end {0};
+    int64_t m_bytes {0};
+    int64_t m_lastTimeUs {AV_NOPTS_VALUE};
+};
+
+#endif // TIMESHIFT_BUFFER_H
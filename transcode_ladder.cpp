@@ -0,0 +1,560 @@
+#include "transcode_ladder.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QStringList>
+#include <QTextStream>
+#include <algorithm>
+
+extern "C"
+{
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+}
+
+static int64_t default_bitrate_kbps(int height)
+{
+    if (height >= 2160) return 12000;
+    if (height >= 1440) return 8000;
+    if (height >= 1080) return 5000;
+    if (height >= 720) return 3000;
+    if (height >= 540) return 2000;
+    if (height >= 480) return 1200;
+    if (height >= 360) return 700;
+    return 400;
+}
+
+QList<RenditionSettings> LadderSettings::defaultRenditions()
+{
+    return parse("1080p,720p,480p,360p");
+}
+
+QList<RenditionSettings> LadderSettings::parse(const QString &spec)
+{
+    QList<RenditionSettings> renditions;
+    const QStringList entries = spec.split(',', Qt::SkipEmptyParts);
+    for (const QString &entry : entries)
+    {
+        RenditionSettings rendition;
+        QString size = entry.section('@', 0, 0).trimmed();
+        if (size.endsWith('p'))
+        {
+            rendition.height = size.chopped(1).toInt();
+        }
+        else
+        {
+            rendition.width = size.section('x', 0, 0).toInt();
+            rendition.height = size.section('x', 1, 1).toInt();
+        }
+        if (rendition.height <= 0)
+            continue;
+
+        int64_t kbps = entry.contains('@') ? entry.section('@', 1, 1).toLongLong() : 0;
+        rendition.bitRate = (kbps > 0 ? kbps : default_bitrate_kbps(rendition.height)) * 1000;
+        rendition.name = QString::number(rendition.height) + "p";
+        renditions.append(rendition);
+    }
+    return renditions;
+}
+
+TranscodeLadder::TranscodeLadder(QObject *parent)
+    : QObject{parent}
+{
+}
+
+TranscodeLadder::~TranscodeLadder()
+{
+    stop();
+}
+
+void TranscodeLadder::setBaseName(const QString &baseName)
+{
+    m_baseName = baseName;
+}
+
+QString TranscodeLadder::directory() const
+{
+    QString root = m_settings.directory;
+    if (root.isEmpty())
+        root = QStandardPaths::writableLocation(QStandardPaths::DesktopLocation) + "/hls";
+    return QDir(root).filePath(m_baseName);
+}
+
+bool TranscodeLadder::start(const LadderSettings &settings, AVFormatContext *input, int videoIndex, int audioIndex)
+{
+    stop();
+
+    m_settings = settings;
+    if (m_settings.renditions.isEmpty())
+        m_settings.renditions = LadderSettings::defaultRenditions();
+    m_settings.segmentSeconds = std::max(1, m_settings.segmentSeconds);
+
+    if (videoIndex < 0)
+        return false;
+    AVStream *video = input->streams[videoIndex];
+
+    // The ladder has its own decoder, preview, time-shift and record-only do not affect it
+    const AVCodec *codec = avcodec_find_decoder(video->codecpar->codec_id);
+    m_decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!m_decoder || avcodec_parameters_to_context(m_decoder, video->codecpar) < 0
+            || avcodec_open2(m_decoder, codec, nullptr) < 0)
+    {
+        emit sendInfo("Ladder: cannot open the video decoder.");
+        avcodec_free_context(&m_decoder);
+        return false;
+    }
+    m_decoded = av_frame_alloc();
+
+    m_videoIndex = videoIndex;
+    m_audioIndex = audioIndex;
+    m_videoTimeBase = video->time_base;
+    m_frameRate = av_guess_frame_rate(input, video, nullptr);
+    if (m_frameRate.num <= 0 || m_frameRate.den <= 0)
+        m_frameRate = {25, 1};
+    m_sourceWidth = video->codecpar->width;
+    m_sourceHeight = video->codecpar->height;
+    if (audioIndex >= 0)
+    {
+        m_audioTimeBase = input->streams[audioIndex]->time_base;
+        m_audioParams = avcodec_parameters_alloc();
+        avcodec_parameters_copy(m_audioParams, input->streams[audioIndex]->codecpar);
+    }
+
+    // Never upscale, renditions above the source collapse into one at the source size
+    QList<RenditionSettings> renditions;
+    for (RenditionSettings rendition : std::as_const(m_settings.renditions))
+    {
+        if (rendition.height > m_sourceHeight)
+        {
+            rendition.height = m_sourceHeight;
+            rendition.width = 0;
+            rendition.name = QString::number(m_sourceHeight) + "p";
+        }
+        if (rendition.width <= 0 && m_sourceHeight > 0)
+            rendition.width = static_cast<int>(int64_t(rendition.height) * m_sourceWidth / m_sourceHeight);
+        rendition.width &= ~1;
+        rendition.height &= ~1;
+
+        bool duplicate = std::any_of(renditions.begin(), renditions.end(),
+                                     [&](const RenditionSettings &other) { return other.name == rendition.name; });
+        if (!duplicate && rendition.width > 0 && rendition.height > 0)
+            renditions.append(rendition);
+    }
+    m_settings.renditions = renditions;
+    if (renditions.isEmpty())
+    {
+        emit sendInfo("Ladder: no usable rendition for the source size.");
+        avcodec_free_context(&m_decoder);
+        av_frame_free(&m_decoded);
+        avcodec_parameters_free(&m_audioParams);
+        return false;
+    }
+
+    {
+        QMutexLocker locker(&m_renditionsMutex);
+        for (const RenditionSettings &settings : std::as_const(renditions))
+        {
+            std::unique_ptr<Rendition> rendition(new Rendition);
+            rendition->settings = settings;
+            QDir().mkpath(QDir(directory()).filePath(settings.name));
+            m_renditions.push_back(std::move(rendition));
+        }
+    }
+    write_master_playlist();
+
+    m_inputDone = false;
+    m_dropUntilKeyframe = true;
+    m_nextKeyframeUs = AV_NOPTS_VALUE;
+
+    m_decodeStage.reset(new PipelineStage("ladder decode", [this] { return pump_decode(); },
+                                          [this] { return m_inputDone.load(); }));
+    for (auto &rendition : m_renditions)
+    {
+        Rendition *r = rendition.get();
+        r->stage.reset(new PipelineStage("ladder " + r->settings.name, [this, r] { return pump_rendition(r); },
+                                         [this] { return m_decodeStage->isFinished(); }));
+    }
+
+    // Encoders are heavy and block, every rendition keeps its own thread
+    m_decodeStage->start();
+    for (auto &rendition : m_renditions)
+        rendition->stage->start();
+
+    emit sendInfo(QString("Ladder: %1 renditions in %2").arg(m_renditions.size()).arg(directory()));
+    return true;
+}
+
+void TranscodeLadder::stop()
+{
+    if (!m_decodeStage)
+        return;
+
+    m_inputDone = true;
+    m_decodeStage->wait();
+    for (auto &rendition : m_renditions)
+        rendition->stage->wait();
+
+    AVPacket *packet = nullptr;
+    while (m_packets.pop(packet))
+        av_packet_free(&packet);
+
+    for (auto &rendition : m_renditions)
+    {
+        LadderItem item;
+        while (rendition->queue.pop(item))
+        {
+            av_frame_free(&item.frame);
+            av_packet_free(&item.audio);
+        }
+        close_rendition(rendition.get());
+        emit sendInfo(QString("Ladder %1: %2 frames, %3 dropped, %4x real time")
+                      .arg(rendition->settings.name).arg(rendition->framesEncoded.load())
+                      .arg(rendition->framesDropped.load()).arg(rendition->realTimeFactor.load(), 0, 'f', 2));
+    }
+
+    {
+        QMutexLocker locker(&m_renditionsMutex);
+        m_renditions.clear();
+    }
+    m_decodeStage.reset();
+
+    avcodec_free_context(&m_decoder);
+    av_frame_free(&m_decoded);
+    avcodec_parameters_free(&m_audioParams);
+}
+
+void TranscodeLadder::push(const AVPacket *packet)
+{
+    if (!m_decodeStage)
+        return;
+    if (packet->stream_index != m_videoIndex && packet->stream_index != m_audioIndex)
+        return;
+
+    // Start, and restart after an overflow, on a video keyframe
+    if (m_dropUntilKeyframe)
+    {
+        if (packet->stream_index != m_videoIndex || !(packet->flags & AV_PKT_FLAG_KEY))
+            return;
+        m_dropUntilKeyframe = false;
+    }
+
+    AVPacket *ref = av_packet_clone(packet);
+    if (!ref)
+        return;
+    if (!m_packets.push(ref))
+    {
+        av_packet_free(&ref);
+        m_dropUntilKeyframe = true;
+    }
+    m_decodeStage->notify();
+}
+
+bool TranscodeLadder::pump_decode()
+{
+    AVPacket *packet = nullptr;
+    if (!m_packets.pop(packet))
+        return false;
+
+    if (packet->stream_index == m_audioIndex)
+    {
+        LadderItem item;
+        item.audio = packet;
+        fan_out(item);
+        av_packet_free(&packet);
+        return true;
+    }
+
+    int ret = avcodec_send_packet(m_decoder, packet);
+    av_packet_free(&packet);
+    if (ret < 0)
+        return true;
+
+    while (avcodec_receive_frame(m_decoder, m_decoded) >= 0)
+    {
+        m_decoded->pts = m_decoded->best_effort_timestamp;
+
+        // Keyframes on a fixed grid of source time, identical for every rendition
+        LadderItem item;
+        item.frame = m_decoded;
+        if (m_decoded->pts != AV_NOPTS_VALUE)
+        {
+            int64_t timeUs = av_rescale_q(m_decoded->pts, m_videoTimeBase, AV_TIME_BASE_Q);
+            if (m_nextKeyframeUs == AV_NOPTS_VALUE)
+                m_nextKeyframeUs = timeUs;
+            if (timeUs >= m_nextKeyframeUs)
+            {
+                item.forceKeyframe = true;
+                while (m_nextKeyframeUs <= timeUs)
+                    m_nextKeyframeUs += m_settings.segmentSeconds * 1000000LL;
+            }
+        }
+
+        fan_out(item);
+        av_frame_unref(m_decoded);
+    }
+    return true;
+}
+
+void TranscodeLadder::fan_out(const LadderItem &item)
+{
+    for (auto &rendition : m_renditions)
+    {
+        // Every rendition gets a reference to the same decoded picture
+        LadderItem copy;
+        copy.forceKeyframe = item.forceKeyframe || (item.frame && rendition->carryKeyframe);
+        if (item.frame)
+            copy.frame = av_frame_clone(item.frame);
+        else
+            copy.audio = av_packet_clone(item.audio);
+        if (!copy.frame && !copy.audio)
+            continue;
+
+        if (!rendition->queue.push(copy))
+        {
+            av_frame_free(&copy.frame);
+            av_packet_free(&copy.audio);
+            if (item.frame)
+            {
+                rendition->framesDropped++;
+                // Keep the segment grid: the next queued frame takes the keyframe
+                rendition->carryKeyframe = rendition->carryKeyframe || item.forceKeyframe;
+            }
+        }
+        else if (item.frame)
+        {
+            rendition->carryKeyframe = false;
+        }
+        rendition->stage->notify();
+    }
+}
+
+bool TranscodeLadder::open_rendition(Rendition *r, const AVFrame *frame)
+{
+    const AVCodec *codec = m_settings.encoder.isEmpty()
+            ? avcodec_find_encoder(AV_CODEC_ID_H264)
+            : avcodec_find_encoder_by_name(m_settings.encoder.toStdString().c_str());
+    if (!codec)
+        return false;
+
+    QString folder = QDir(directory()).filePath(r->settings.name);
+    QString playlist = QDir(folder).filePath("index.m3u8");
+    if (avformat_alloc_output_context2(&r->output, nullptr, "hls", playlist.toStdString().c_str()) < 0)
+        return false;
+
+    r->encoder = avcodec_alloc_context3(codec);
+    if (!r->encoder)
+        return false;
+    r->encoder->width = r->settings.width;
+    r->encoder->height = r->settings.height;
+    r->encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+    r->encoder->sample_aspect_ratio = {1, 1};
+    r->encoder->time_base = m_videoTimeBase;
+    r->encoder->framerate = m_frameRate;
+    r->encoder->bit_rate = r->settings.bitRate;
+    r->encoder->rc_max_rate = r->settings.bitRate;
+    r->encoder->rc_buffer_size = r->settings.bitRate * 2;
+    r->encoder->gop_size = std::max(1, static_cast<int>(av_q2d(m_frameRate) * m_settings.segmentSeconds));
+    r->encoder->max_b_frames = 0;
+    r->encoder->thread_count = 0;
+    if (r->output->oformat->flags & AVFMT_GLOBALHEADER)
+        r->encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    // Private options only exist on some encoders, failures are fine
+    av_opt_set(r->encoder->priv_data, "preset", "veryfast", 0);
+    av_opt_set(r->encoder->priv_data, "forced-idr", "1", 0);
+
+    if (avcodec_open2(r->encoder, codec, nullptr) < 0)
+        return false;
+
+    AVStream *video = avformat_new_stream(r->output, nullptr);
+    if (!video)
+        return false;
+    avcodec_parameters_from_context(video->codecpar, r->encoder);
+    video->time_base = r->encoder->time_base;
+    video->avg_frame_rate = m_frameRate;
+
+    if (m_audioParams)
+    {
+        AVStream *audio = avformat_new_stream(r->output, nullptr);
+        if (!audio)
+            return false;
+        avcodec_parameters_copy(audio->codecpar, m_audioParams);
+        audio->codecpar->codec_tag = 0;
+        audio->time_base = m_audioTimeBase;
+    }
+
+    AVDictionary *muxer_opts = NULL;
+    av_dict_set_int(&muxer_opts, "hls_time", m_settings.segmentSeconds, 0);
+    av_dict_set(&muxer_opts, "hls_segment_type", "fmp4", 0);
+    av_dict_set(&muxer_opts, "hls_list_size", "0", 0);
+    av_dict_set(&muxer_opts, "hls_flags", "independent_segments+temp_file", 0);
+    av_dict_set(&muxer_opts, "hls_fmp4_init_filename", "init.mp4", 0);
+    av_dict_set(&muxer_opts, "hls_segment_filename", QDir(folder).filePath("seg_%05d.m4s").toStdString().c_str(), 0);
+    int ret = avformat_write_header(r->output, &muxer_opts);
+    av_dict_free(&muxer_opts);
+    if (ret < 0)
+        return false;
+    r->headerWritten = true;
+
+    r->scaled = av_frame_alloc();
+    r->packet = av_packet_alloc();
+    if (!r->scaled || !r->packet)
+        return false;
+    r->scaled->format = r->encoder->pix_fmt;
+    r->scaled->width = r->encoder->width;
+    r->scaled->height = r->encoder->height;
+    if (av_frame_get_buffer(r->scaled, 0) < 0)
+        return false;
+
+    emit sendInfo(QString("Ladder %1: %2x%3 %4 kbit/s with %5 from %6x%7")
+                  .arg(r->settings.name).arg(r->encoder->width).arg(r->encoder->height)
+                  .arg(r->settings.bitRate / 1000).arg(codec->name).arg(frame->width).arg(frame->height));
+    return true;
+}
+
+bool TranscodeLadder::encode(Rendition *r, AVFrame *frame)
+{
+    int ret = avcodec_send_frame(r->encoder, frame);
+    if (ret < 0)
+        return false;
+
+    while (avcodec_receive_packet(r->encoder, r->packet) >= 0)
+    {
+        av_packet_rescale_ts(r->packet, r->encoder->time_base, r->output->streams[0]->time_base);
+        r->packet->stream_index = 0;
+        av_interleaved_write_frame(r->output, r->packet);
+    }
+    return true;
+}
+
+bool TranscodeLadder::pump_rendition(Rendition *r)
+{
+    LadderItem item;
+    if (!r->queue.pop(item))
+        return false;
+
+    if (item.audio)
+    {
+        // Copied as is, until the rendition is open there is nothing to mux it into
+        if (r->headerWritten && r->output->nb_streams > 1)
+        {
+            av_packet_rescale_ts(item.audio, m_audioTimeBase, r->output->streams[1]->time_base);
+            item.audio->stream_index = 1;
+            item.audio->pos = -1;
+            av_interleaved_write_frame(r->output, item.audio);
+        }
+        av_packet_free(&item.audio);
+        return true;
+    }
+
+    int64_t startUs = av_gettime_relative();
+    AVFrame *frame = item.frame;
+
+    if (!r->encoder && !r->failed && !open_rendition(r, frame))
+    {
+        r->failed = true;
+        emit sendInfo("Ladder " + r->settings.name + ": cannot open the encoder or output.");
+    }
+
+    // The encoder needs strictly increasing timestamps
+    if (r->failed || frame->pts == AV_NOPTS_VALUE || (r->lastPts != AV_NOPTS_VALUE && frame->pts <= r->lastPts))
+    {
+        av_frame_free(&item.frame);
+        return true;
+    }
+
+    // Each rendition scales the shared picture on its own thread
+    r->sws = sws_getCachedContext(r->sws, frame->width, frame->height, static_cast<AVPixelFormat>(frame->format),
+                                  r->encoder->width, r->encoder->height, r->encoder->pix_fmt,
+                                  SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!r->sws || av_frame_make_writable(r->scaled) < 0)
+    {
+        av_frame_free(&item.frame);
+        return true;
+    }
+    sws_scale(r->sws, frame->data, frame->linesize, 0, frame->height, r->scaled->data, r->scaled->linesize);
+    r->scaled->pts = frame->pts;
+    r->scaled->pict_type = item.forceKeyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    r->lastPts = frame->pts;
+    if (r->firstPts == AV_NOPTS_VALUE)
+        r->firstPts = frame->pts;
+    av_frame_free(&item.frame);
+
+    encode(r, r->scaled);
+    r->framesEncoded++;
+
+    // Media time handled per second of work on this thread
+    r->busyUs += av_gettime_relative() - startUs;
+    double mediaSeconds = (r->lastPts - r->firstPts) * av_q2d(m_videoTimeBase);
+    if (r->busyUs > 0)
+        r->realTimeFactor = mediaSeconds / (r->busyUs / 1000000.0);
+    if (r->framesEncoded % LADDER_STATS_INTERVAL == 0)
+        emit sendInfo(QString("Ladder %1: %2x real time").arg(r->settings.name).arg(r->realTimeFactor.load(), 0, 'f', 2));
+    return true;
+}
+
+void TranscodeLadder::close_rendition(Rendition *r)
+{
+    if (r->headerWritten)
+    {
+        // Drain the encoder so the last segment is complete
+        encode(r, nullptr);
+        av_write_trailer(r->output);
+        r->headerWritten = false;
+    }
+    avformat_free_context(r->output);
+    r->output = nullptr;
+    avcodec_free_context(&r->encoder);
+    sws_freeContext(r->sws);
+    r->sws = nullptr;
+    av_frame_free(&r->scaled);
+    av_packet_free(&r->packet);
+}
+
+void TranscodeLadder::write_master_playlist()
+{
+    int64_t audioBitRate = 0;
+    if (m_audioParams)
+        audioBitRate = m_audioParams->bit_rate > 0 ? m_audioParams->bit_rate : LADDER_AUDIO_BITRATE;
+
+    QSaveFile file(QDir(directory()).filePath("master.m3u8"));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+        return;
+
+    QTextStream out(&file);
+    out << "#EXTM3U\n";
+    out << "#EXT-X-VERSION:7\n";
+    out << "#EXT-X-INDEPENDENT-SEGMENTS\n";
+    for (const RenditionSettings &rendition : std::as_const(m_settings.renditions))
+    {
+        // Peak rate with some container overhead
+        int64_t bandwidth = rendition.bitRate * 11 / 10 + audioBitRate;
+        out << "#EXT-X-STREAM-INF:BANDWIDTH=" << bandwidth
+            << ",RESOLUTION=" << rendition.width << "x" << rendition.height
+            << ",FRAME-RATE=" << QString::number(av_q2d(m_frameRate), 'f', 3) << "\n";
+        out << rendition.name << "/index.m3u8\n";
+    }
+    out.flush();
+    file.commit();
+}
+
+QList<RenditionStats> TranscodeLadder::stats() const
+{
+    QMutexLocker locker(&m_renditionsMutex);
+
+    QList<RenditionStats> list;
+    for (const auto &rendition : m_renditions)
+    {
+        RenditionStats stats;
+        stats.name = rendition->settings.name;
+        stats.width = rendition->settings.width;
+        stats.height = rendition->settings.height;
+        stats.framesEncoded = rendition->framesEncoded;
+        stats.framesDropped = rendition->framesDropped;
+        stats.realTimeFactor = rendition->realTimeFactor;
+        list.append(stats);
+    }
+    return list;
+}
@@ -0,0 +1,149 @@
+#ifndef TRANSCODE_LADDER_H
+#define TRANSCODE_LADDER_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include "pipeline_stage.h"
+#include "spsc_queue.h"
+
+#define LADDER_PACKET_QUEUE_SIZE    512
+#define LADDER_FRAME_QUEUE_SIZE     32
+#define LADDER_SEGMENT_SECONDS      4
+#define LADDER_STATS_INTERVAL       300
+#define LADDER_AUDIO_BITRATE        128000
+
+struct RenditionSettings
+{
+    QString name;
+    int width {0};              // 0 keeps the source aspect ratio
+    int height {0};
+    int64_t bitRate {0};
+};
+
+struct LadderSettings
+{
+    bool enabled {false};
+    QString directory;          // empty: Desktop/hls
+    int segmentSeconds {LADDER_SEGMENT_SECONDS};
+    QString encoder;            // empty: FFmpeg's default H.264 encoder
+    QList<RenditionSettings> renditions;
+
+    static QList<RenditionSettings> defaultRenditions();
+    // "1080p,720p" or "1280x720@3000" entries, bit rates in kbit/s
+    static QList<RenditionSettings> parse(const QString &spec);
+};
+
+struct RenditionStats
+{
+    QString name;
+    int width {0};
+    int height {0};
+    quint64 framesEncoded {0};
+    quint64 framesDropped {0};
+    double realTimeFactor {0};  // media seconds per busy second, above 1 keeps up
+};
+
+// Decode-once ABR ladder.
+// One decoder thread feeds a shared reference of every frame to each rendition;
+// renditions scale and encode on their own threads and write HLS with fMP4
+// segments. Keyframes are forced on the same source frames in every rendition,
+// so segment boundaries line up across the ladder. Audio is copied, not re-encoded.
+// A rendition that cannot keep up drops frames, ingest never waits on the ladder.
+class TranscodeLadder : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TranscodeLadder(QObject *parent = nullptr);
+    ~TranscodeLadder();
+
+    void setBaseName(const QString &baseName);
+
+    bool start(const LadderSettings &settings, AVFormatContext *input, int videoIndex, int audioIndex);
+    void stop();
+    bool isRunning() const { return m_decodeStage != nullptr; }
+
+    // Called by the demux thread, never blocks
+    void push(const AVPacket *packet);
+
+    // Safe to call from any thread
+    QList<RenditionStats> stats() const;
+
+signals:
+    void sendInfo(QString);
+
+private:
+    struct LadderItem
+    {
+        AVFrame *frame {nullptr};
+        AVPacket *audio {nullptr};
+        bool forceKeyframe {false};
+    };
+
+    struct Rendition
+    {
+        RenditionSettings settings;
+        SpscQueue<LadderItem> queue {LADDER_FRAME_QUEUE_SIZE};
+        std::unique_ptr<PipelineStage> stage;
+        SwsContext *sws {nullptr};
+        AVCodecContext *encoder {nullptr};
+        AVFormatContext *output {nullptr};
+        AVFrame *scaled {nullptr};
+        AVPacket *packet {nullptr};
+        bool headerWritten {false};
+        bool failed {false};
+        bool carryKeyframe {false};     // decode thread side: a forced keyframe was dropped
+        int64_t lastPts {AV_NOPTS_VALUE};
+        int64_t firstPts {AV_NOPTS_VALUE};
+        int64_t busyUs {0};
+        std::atomic<quint64> framesEncoded {0};
+        std::atomic<quint64> framesDropped {0};
+        std::atomic<double> realTimeFactor {0};
+    };
+
+    bool pump_decode();
+    bool pump_rendition(Rendition *rendition);
+    void fan_out(const LadderItem &item);
+    bool open_rendition(Rendition *rendition, const AVFrame *frame);
+    bool encode(Rendition *rendition, AVFrame *frame);
+    void close_rendition(Rendition *rendition);
+    void write_master_playlist();
+    QString directory() const;
+
+    LadderSettings m_settings;
+    QString m_baseName {"output"};
+
+    AVCodecContext *m_decoder {nullptr};
+    AVFrame *m_decoded {nullptr};
+    AVRational m_videoTimeBase {1, 1000};
+    AVRational m_audioTimeBase {1, 1000};
+    AVRational m_frameRate {25, 1};
+    AVCodecParameters *m_audioParams {nullptr};
+    int m_videoIndex {-1};
+    int m_audioIndex {-1};
+    int m_sourceWidth {0};
+    int m_sourceHeight {0};
+    int64_t m_nextKeyframeUs {AV_NOPTS_VALUE};
+
+    SpscQueue<AVPacket*> m_packets {LADDER_PACKET_QUEUE_SIZE};
+    std::unique_ptr<PipelineStage> m_decodeStage;
+    std::vector<std::unique_ptr<Rendition>> m_renditions;
+    mutable QMutex m_renditionsMutex;
+    std::atomic<bool> m_inputDone {false};
+    bool m_dropUntilKeyframe {true};
+};
+
+#endif // TRANSCODE_LADDER_H
@@ -5,18 +5,51 @@ QT += multimedia multimediawidgets widgets network
 
 HEADERS = \
     Plotter.h \
+    async_avio_writer.h \
+    audio_converter.h \
+    audio_playout.h \
+    audio_ring.h \
+    avframe_video_buffer.h \
+    clock_drift.h \
     ffmpeg_rtmp.h \
     imagesettings.h \
+    latest_mailbox.h \
+    pipeline_stage.h \
+    preview_converter.h \
+    preview_widget.h \
+    restream_output.h \
+    rolling_average.h \
     rtmp.h \
+    rtmp_session_manager.h \
+    segment_recorder.h \
+    spsc_queue.h \
+    stream_param_cache.h \
+    timeshift_buffer.h \
+    transcode_ladder.h \
+    yuv_to_rgb.h \
     videosettings.h \
     metadatadialog.h
 
 SOURCES = \
     Plotter.cpp \
     main.cpp \
+    async_avio_writer.cpp \
+    audio_converter.cpp \
+    audio_playout.cpp \
+    avframe_video_buffer.cpp \
     ffmpeg_rtmp.cpp \
     imagesettings.cpp \
+    pipeline_stage.cpp \
+    preview_converter.cpp \
+    preview_widget.cpp \
+    restream_output.cpp \
     rtmp.cpp \
+    rtmp_session_manager.cpp \
+    segment_recorder.cpp \
+    stream_param_cache.cpp \
+    timeshift_buffer.cpp \
+    transcode_ladder.cpp \
+    yuv_to_rgb.cpp \
     videosettings.cpp \
     metadatadialog.cpp
 
@@ -33,31 +66,23 @@ android|ios {
         videosettings.ui
 }
 
+include(./ffmpeg.pri)
+
 win32 {
   message("Win32 enabled")
   DEFINES += WIN32_LEAN_AND_MEAN
   RC_ICONS += $$PWD\images\app.ico
-  INCLUDEPATH += $$PWD\lib\ffmpeg
   INCLUDEPATH += $$PWD\lib\fftw
-  LIBS += -L$$PWD\lib\libav -llibavformat -llibavcodec -llibavutil -llibavfilter -llibswscale -lswresample
   LIBS += -L$$PWD\lib\fftw -llibfftw3-3 -llibfftw3f-3 -llibfftw3l-3
 }
 
 unix:!macx {
     message("linux enabled")
-    INCLUDEPATH += /usr/include/x86_64-linux-gnu/libavcodec
-    INCLUDEPATH += /usr/include/x86_64-linux-gnu/libavformat
-    INCLUDEPATH += /usr/include/x86_64-linux-gnu/libavfilter
-    LIBS += -L/usr/include/x86_64-linux-gnu/ -lavformat -lavcodec -lavutil -lavfilter -lswscale -lswresample
 }
 
 unix:macx {
     message("macx enabled")
-    # HOMEBREW_CELLAR_PATH = /opt/homebrew/Cellar
-    HOMEBREW_CELLAR_PATH = /usr/local/Cellar
-    INCLUDEPATH += $$HOMEBREW_CELLAR_PATH/ffmpeg/7.0.1/include
     INCLUDEPATH += $$HOMEBREW_CELLAR_PATH/fftw/3.3.10_1/include
-    LIBS += -L$$HOMEBREW_CELLAR_PATH/ffmpeg/7.0.1/lib -lavformat -lavcodec -lavutil -lavfilter -lswscale -lswresample
     LIBS += -L$$HOMEBREW_CELLAR_PATH/fftw/3.3.10_1/lib -lfftw3
 }
 
@@ -74,3 +99,24 @@ OTHER_FILES += android/AndroidManifest.xml
 
 # ffmpeg -re -i test.flv  -vcodec libx264 -preset fast -crf 30 -acodec aac -ab 128k -ar 44100 -strict experimental -f flv rtmp://192.168.1.9:8889/live
 # ffmpeg -re -i test.flv  -vcodec libx264 -preset fast -crf 30 -acodec aac -ab 128k -ar 44100 -strict experimental -f flv rtmp://172.26.241.24:8889/live
+# decoder threading: video_process_ai --decoder-threads 8 --decoder-threading frame|slice|lowlatency
+# fast-start probing, the defaults shown; a publisher whose tracks are not all found is probed again with FFmpeg's defaults:
+#   video_process_ai --probesize 65536 --analyzeduration 500000 --fpsprobesize 0 (or --no-fast-start)
+# record only, no decoding until Preview is checked: video_process_ai --record-only
+# segmented recording: video_process_ai --record-dir /data/rec --segment-seconds 60 --segment-format ts --disk-quota-mb 20000
+#   ts segments are listed in an HLS <base>.m3u8, fmp4 (the default) ones in a plain <base>.index
+# restream without re-encoding, tested against loopback receivers:
+#   ffplay -fflags nobuffer udp://127.0.0.1:1234
+#   ffmpeg -listen 1 -i rtmp://127.0.0.1:1935/live/out -c copy received.flv
+#   video_process_ai --restream udp://127.0.0.1:1234?pkt_size=1316 --restream rtmp://127.0.0.1:1935/live/out --restream copy_{time}.mkv
+# HLS ladder, master.m3u8 under <hls-dir>/<session>: video_process_ai --ladder 1080p,720p,480p@1000 --hls-segment-seconds 4 --ladder-encoder libx264
+# preview conversion threads: video_process_ai --preview-threads 4
+#   YUV previews go to a QVideoWidget without RGB conversion, --preview-rgb brings back the converter
+#   8-bit 4:2:0 goes through the SSE2/AVX2/NEON kernels, --preview-swscale turns them off
+# kernel tests and the preview/audio conversion benchmarks: qmake tests/tests.pro && make && make check
+# audio playout jitter buffer, grows on underruns and shrinks back after 10 s: video_process_ai --audio-latency-ms 80
+# preview frames are presented against the audio playout clock, --no-av-sync shows them as soon as they are converted
+# preview time-shift window (pause, -10 s, Live buttons), off unless set, up to 512 MiB per session: video_process_ai --timeshift-seconds 600
+# recorder write-behind: video_process_ai --write-buffer-mb 256 --direct-io (or --sync-write to write from the mux stage)
+# several loopback publishers: video_process_ai --session cam1:8890:127.0.0.1 --session cam2:8891:127.0.0.1
+# ffmpeg -re -i test.flv -c copy -f flv rtmp://127.0.0.1:8890/live/cam1
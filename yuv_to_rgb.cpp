@@ -0,0 +1,373 @@
+#include "yuv_to_rgb.h"
+
+#include <QtGlobal>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define YUV_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64) || defined(__ARM_NEON)
+#define YUV_NEON
+#include <arm_neon.h>
+#endif
+
+// BT.601 limited range. Luma is scaled by 19077/256 (1.164 * 64), chroma by
+// coefficients * 64, results keep 6 fractional bits and fit in 16-bit lanes.
+#define YUV_Y           19077
+#define YUV_Y_OFFSET    (32 - ((16 * YUV_Y) >> 8))
+#define YUV_RV          102
+#define YUV_GU          25
+#define YUV_GV          52
+#define YUV_BU          129
+
+typedef void (*RowFunction)(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width);
+
+static inline uint8_t clamp_pixel(int value)
+{
+    value >>= 6;
+    return static_cast<uint8_t>(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// Reference for every kernel, and the tail of each row
+static inline void yuv_pixel(int y, int u, int v, uint8_t *dst)
+{
+    int luma = ((y * YUV_Y) >> 8) + YUV_Y_OFFSET;
+    u -= 128;
+    v -= 128;
+    dst[0] = clamp_pixel(luma + YUV_BU * u);
+    dst[1] = clamp_pixel(luma - YUV_GU * u - YUV_GV * v);
+    dst[2] = clamp_pixel(luma + YUV_RV * v);
+    dst[3] = 0xff;
+}
+
+static void row_planar_scalar(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+    for (int x = 0; x < width; ++x)
+        yuv_pixel(y[x], u[x >> 1], v[x >> 1], dst + 4 * x);
+}
+
+static void row_nv12_scalar(const uint8_t *y, const uint8_t *uv, const uint8_t *, uint8_t *dst, int width)
+{
+    for (int x = 0; x < width; ++x)
+        yuv_pixel(y[x], uv[x & ~1], uv[x | 1], dst + 4 * x);
+}
+
+#ifdef YUV_X86
+
+// 16 pixels: 16 luma bytes, 8 chroma pairs widened to 16 bits
+TARGET_SSE2 static inline void rgb_sse2(__m128i yy, __m128i uu, __m128i vv, uint8_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uu = _mm_sub_epi16(uu, _mm_set1_epi16(128));
+    vv = _mm_sub_epi16(vv, _mm_set1_epi16(128));
+    __m128i rv = _mm_mullo_epi16(vv, _mm_set1_epi16(YUV_RV));
+    __m128i guv = _mm_add_epi16(_mm_mullo_epi16(uu, _mm_set1_epi16(YUV_GU)), _mm_mullo_epi16(vv, _mm_set1_epi16(YUV_GV)));
+    __m128i bu = _mm_mullo_epi16(uu, _mm_set1_epi16(YUV_BU));
+
+    __m128i r[2], g[2], b[2];
+    for (int half = 0; half < 2; ++half)
+    {
+        __m128i luma = half ? _mm_unpackhi_epi8(yy, zero) : _mm_unpacklo_epi8(yy, zero);
+        luma = _mm_mulhi_epu16(_mm_slli_epi16(luma, 8), _mm_set1_epi16((short)YUV_Y));
+        luma = _mm_add_epi16(luma, _mm_set1_epi16(YUV_Y_OFFSET));
+        // Each chroma sample covers two pixels
+        __m128i cr = half ? _mm_unpackhi_epi16(rv, rv) : _mm_unpacklo_epi16(rv, rv);
+        __m128i cg = half ? _mm_unpackhi_epi16(guv, guv) : _mm_unpacklo_epi16(guv, guv);
+        __m128i cb = half ? _mm_unpackhi_epi16(bu, bu) : _mm_unpacklo_epi16(bu, bu);
+        r[half] = _mm_srai_epi16(_mm_adds_epi16(luma, cr), 6);
+        g[half] = _mm_srai_epi16(_mm_subs_epi16(luma, cg), 6);
+        b[half] = _mm_srai_epi16(_mm_adds_epi16(luma, cb), 6);
+    }
+    __m128i R = _mm_packus_epi16(r[0], r[1]);
+    __m128i G = _mm_packus_epi16(g[0], g[1]);
+    __m128i B = _mm_packus_epi16(b[0], b[1]);
+    __m128i A = _mm_set1_epi8((char)0xff);
+
+    __m128i bgLo = _mm_unpacklo_epi8(B, G);
+    __m128i bgHi = _mm_unpackhi_epi8(B, G);
+    __m128i raLo = _mm_unpacklo_epi8(R, A);
+    __m128i raHi = _mm_unpackhi_epi8(R, A);
+    _mm_storeu_si128((__m128i*)(dst), _mm_unpacklo_epi16(bgLo, raLo));
+    _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi16(bgLo, raLo));
+    _mm_storeu_si128((__m128i*)(dst + 32), _mm_unpacklo_epi16(bgHi, raHi));
+    _mm_storeu_si128((__m128i*)(dst + 48), _mm_unpackhi_epi16(bgHi, raHi));
+}
+
+TARGET_SSE2 static void row_planar_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i yy = _mm_loadu_si128((const __m128i*)(y + x));
+        __m128i uu = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x / 2)), zero);
+        __m128i vv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(v + x / 2)), zero);
+        rgb_sse2(yy, uu, vv, dst + 4 * x);
+    }
+    row_planar_scalar(y + x, u + x / 2, v + x / 2, dst + 4 * x, width - x);
+}
+
+TARGET_SSE2 static void row_nv12_sse2(const uint8_t *y, const uint8_t *uv, const uint8_t *, uint8_t *dst, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i yy = _mm_loadu_si128((const __m128i*)(y + x));
+        __m128i pairs = _mm_loadu_si128((const __m128i*)(uv + x));
+        __m128i uu = _mm_and_si128(pairs, _mm_set1_epi16(0x00ff));
+        __m128i vv = _mm_srli_epi16(pairs, 8);
+        rgb_sse2(yy, uu, vv, dst + 4 * x);
+    }
+    row_nv12_scalar(y + x, uv + x, nullptr, dst + 4 * x, width - x);
+}
+
+// 16 pixels of one half: luma and the chroma terms already in pixel order
+TARGET_AVX2 static inline void store_avx2(__m256i luma, __m256i cr, __m256i cg, __m256i cb, uint8_t *dst)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255);
+    __m256i r = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(_mm256_adds_epi16(luma, cr), 6), zero), max);
+    __m256i g = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(_mm256_subs_epi16(luma, cg), 6), zero), max);
+    __m256i b = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(_mm256_adds_epi16(luma, cb), 6), zero), max);
+
+    __m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+    __m256i ra = _mm256_or_si256(r, _mm256_set1_epi16((short)0xff00));
+    // Unpacks stay within 128-bit lanes: lo holds pixels 0-3 and 8-11, hi 4-7 and 12-15
+    __m256i lo = _mm256_unpacklo_epi16(bg, ra);
+    __m256i hi = _mm256_unpackhi_epi16(bg, ra);
+    _mm256_storeu_si256((__m256i*)(dst), _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i*)(dst + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+// 32 pixels: luma widened in pixel order, 16 chroma pairs widened in order
+TARGET_AVX2 static inline void rgb_avx2(__m256i yLo, __m256i yHi, __m256i uu, __m256i vv, uint8_t *dst)
+{
+    uu = _mm256_sub_epi16(uu, _mm256_set1_epi16(128));
+    vv = _mm256_sub_epi16(vv, _mm256_set1_epi16(128));
+    __m256i rv = _mm256_mullo_epi16(vv, _mm256_set1_epi16(YUV_RV));
+    __m256i guv = _mm256_add_epi16(_mm256_mullo_epi16(uu, _mm256_set1_epi16(YUV_GU)),
+                                   _mm256_mullo_epi16(vv, _mm256_set1_epi16(YUV_GV)));
+    __m256i bu = _mm256_mullo_epi16(uu, _mm256_set1_epi16(YUV_BU));
+    // Chroma 0-3,8-11 | 4-7,12-15, so the in-lane unpacks below come out in pixel order
+    rv = _mm256_permute4x64_epi64(rv, 0xd8);
+    guv = _mm256_permute4x64_epi64(guv, 0xd8);
+    bu = _mm256_permute4x64_epi64(bu, 0xd8);
+
+    const __m256i scale = _mm256_set1_epi16((short)YUV_Y);
+    const __m256i offset = _mm256_set1_epi16(YUV_Y_OFFSET);
+    __m256i lumaLo = _mm256_add_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(yLo, 8), scale), offset);
+    __m256i lumaHi = _mm256_add_epi16(_mm256_mulhi_epu16(_mm256_slli_epi16(yHi, 8), scale), offset);
+
+    store_avx2(lumaLo, _mm256_unpacklo_epi16(rv, rv), _mm256_unpacklo_epi16(guv, guv),
+               _mm256_unpacklo_epi16(bu, bu), dst);
+    store_avx2(lumaHi, _mm256_unpackhi_epi16(rv, rv), _mm256_unpackhi_epi16(guv, guv),
+               _mm256_unpackhi_epi16(bu, bu), dst + 64);
+}
+
+TARGET_AVX2 static void row_planar_avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i yy = _mm256_loadu_si256((const __m256i*)(y + x));
+        __m256i yLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(yy));
+        __m256i yHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(yy, 1));
+        __m256i uu = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(u + x / 2)));
+        __m256i vv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(v + x / 2)));
+        rgb_avx2(yLo, yHi, uu, vv, dst + 4 * x);
+    }
+    row_planar_sse2(y + x, u + x / 2, v + x / 2, dst + 4 * x, width - x);
+}
+
+TARGET_AVX2 static void row_nv12_avx2(const uint8_t *y, const uint8_t *uv, const uint8_t *, uint8_t *dst, int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i yy = _mm256_loadu_si256((const __m256i*)(y + x));
+        __m256i yLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(yy));
+        __m256i yHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(yy, 1));
+        __m256i pairs = _mm256_loadu_si256((const __m256i*)(uv + x));
+        __m256i uu = _mm256_and_si256(pairs, _mm256_set1_epi16(0x00ff));
+        __m256i vv = _mm256_srli_epi16(pairs, 8);
+        rgb_avx2(yLo, yHi, uu, vv, dst + 4 * x);
+    }
+    row_nv12_sse2(y + x, uv + x, nullptr, dst + 4 * x, width - x);
+}
+
+#endif // YUV_X86
+
+#ifdef YUV_NEON
+
+// 16 pixels, written as B, G, R, A by one interleaving store
+static inline void rgb_neon(uint8x16_t yy, int16x8_t uu, int16x8_t vv, uint8_t *dst)
+{
+    uu = vsubq_s16(uu, vdupq_n_s16(128));
+    vv = vsubq_s16(vv, vdupq_n_s16(128));
+    int16x8x2_t rv = vzipq_s16(vmulq_n_s16(vv, YUV_RV), vmulq_n_s16(vv, YUV_RV));
+    int16x8_t guv = vmlaq_n_s16(vmulq_n_s16(uu, YUV_GU), vv, YUV_GV);
+    int16x8x2_t cg = vzipq_s16(guv, guv);
+    int16x8x2_t bu = vzipq_s16(vmulq_n_s16(uu, YUV_BU), vmulq_n_s16(uu, YUV_BU));
+
+    // (y << 7) * YUV_Y * 2 >> 16 is the same (y * YUV_Y) >> 8 as the scalar code
+    int16x8_t luma[2];
+    luma[0] = vreinterpretq_s16_u16(vshll_n_u8(vget_low_u8(yy), 7));
+    luma[1] = vreinterpretq_s16_u16(vshll_n_u8(vget_high_u8(yy), 7));
+    for (int half = 0; half < 2; ++half)
+        luma[half] = vaddq_s16(vqdmulhq_s16(luma[half], vdupq_n_s16(YUV_Y)), vdupq_n_s16(YUV_Y_OFFSET));
+
+    uint8x16x4_t pixels;
+    pixels.val[0] = vcombine_u8(vqshrun_n_s16(vqaddq_s16(luma[0], bu.val[0]), 6),
+                                vqshrun_n_s16(vqaddq_s16(luma[1], bu.val[1]), 6));
+    pixels.val[1] = vcombine_u8(vqshrun_n_s16(vqsubq_s16(luma[0], cg.val[0]), 6),
+                                vqshrun_n_s16(vqsubq_s16(luma[1], cg.val[1]), 6));
+    pixels.val[2] = vcombine_u8(vqshrun_n_s16(vqaddq_s16(luma[0], rv.val[0]), 6),
+                                vqshrun_n_s16(vqaddq_s16(luma[1], rv.val[1]), 6));
+    pixels.val[3] = vdupq_n_u8(0xff);
+    vst4q_u8(dst, pixels);
+}
+
+static void row_planar_neon(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        int16x8_t uu = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u + x / 2)));
+        int16x8_t vv = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v + x / 2)));
+        rgb_neon(vld1q_u8(y + x), uu, vv, dst + 4 * x);
+    }
+    row_planar_scalar(y + x, u + x / 2, v + x / 2, dst + 4 * x, width - x);
+}
+
+static void row_nv12_neon(const uint8_t *y, const uint8_t *uv, const uint8_t *, uint8_t *dst, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x8x2_t pairs = vld2_u8(uv + x);
+        int16x8_t uu = vreinterpretq_s16_u16(vmovl_u8(pairs.val[0]));
+        int16x8_t vv = vreinterpretq_s16_u16(vmovl_u8(pairs.val[1]));
+        rgb_neon(vld1q_u8(y + x), uu, vv, dst + 4 * x);
+    }
+    row_nv12_scalar(y + x, uv + x, nullptr, dst + 4 * x, width - x);
+}
+
+#endif // YUV_NEON
+
+static SimdLevel detect_level()
+{
+#if defined(YUV_X86)
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] >= 7)
+    {
+        __cpuid(info, 1);
+        bool osxsave = info[2] & (1 << 27);
+        __cpuidex(info, 7, 0);
+        bool avx2 = info[1] & (1 << 5);
+        // The OS has to save the ymm registers too
+        if (avx2 && osxsave && (_xgetbv(0) & 6) == 6)
+            return SimdLevel::Avx2;
+    }
+    return SimdLevel::Sse2;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::Avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return SimdLevel::Sse2;
+#endif
+#elif defined(YUV_NEON)
+    return SimdLevel::Neon;
+#endif
+    return SimdLevel::Scalar;
+}
+
+static RowFunction row_function(SimdLevel level, bool nv12)
+{
+    switch (level)
+    {
+#ifdef YUV_X86
+    case SimdLevel::Avx2:
+        return nv12 ? row_nv12_avx2 : row_planar_avx2;
+    case SimdLevel::Sse2:
+        return nv12 ? row_nv12_sse2 : row_planar_sse2;
+#endif
+#ifdef YUV_NEON
+    case SimdLevel::Neon:
+        return nv12 ? row_nv12_neon : row_planar_neon;
+#endif
+    default:
+        return nv12 ? row_nv12_scalar : row_planar_scalar;
+    }
+}
+
+bool YuvToRgb::supports(int pixelFormat)
+{
+    // RGB32 is B, G, R, A in memory only on little-endian machines
+    if (Q_BYTE_ORDER != Q_LITTLE_ENDIAN)
+        return false;
+    return pixelFormat == AV_PIX_FMT_YUV420P || pixelFormat == AV_PIX_FMT_NV12;
+}
+
+SimdLevel YuvToRgb::level()
+{
+    static const SimdLevel detected = detect_level();
+    return detected;
+}
+
+std::vector<SimdLevel> YuvToRgb::levels()
+{
+    std::vector<SimdLevel> levels {SimdLevel::Scalar};
+#ifdef YUV_X86
+    levels.push_back(SimdLevel::Sse2);
+    if (level() == SimdLevel::Avx2)
+        levels.push_back(SimdLevel::Avx2);
+#endif
+#ifdef YUV_NEON
+    levels.push_back(SimdLevel::Neon);
+#endif
+    return levels;
+}
+
+const char* YuvToRgb::name(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::Sse2:
+        return "sse2";
+    case SimdLevel::Avx2:
+        return "avx2";
+    case SimdLevel::Neon:
+        return "neon";
+    default:
+        return "scalar";
+    }
+}
+
+void YuvToRgb::convert(const AVFrame *frame, uint8_t *dst, int dstStride, int firstRow, int endRow)
+{
+    convert(frame, dst, dstStride, firstRow, endRow, level());
+}
+
+void YuvToRgb::convert(const AVFrame *frame, uint8_t *dst, int dstStride, int firstRow, int endRow, SimdLevel level)
+{
+    const bool nv12 = frame->format == AV_PIX_FMT_NV12;
+    RowFunction row = row_function(level, nv12);
+
+    for (int y = firstRow; y < endRow; ++y)
+    {
+        const uint8_t *luma = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        const uint8_t *u = frame->data[1] + (ptrdiff_t)(y >> 1) * frame->linesize[1];
+        const uint8_t *v = nv12 ? nullptr : frame->data[2] + (ptrdiff_t)(y >> 1) * frame->linesize[2];
+        row(luma, u, v, dst + (ptrdiff_t)y * dstStride, frame->width);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef YUV_TO_RGB_H
+#define YUV_TO_RGB_H
+
+#include <cstdint>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// Largest difference from swscale's unscaled converter in any channel; only the
+// rounding of the fixed-point products differs. tests/yuv_to_rgb checks it.
+#define YUV_SWSCALE_TOLERANCE   2
+
+enum class SimdLevel
+{
+    Scalar,
+    Sse2,
+    Avx2,
+    Neon
+};
+
+// 8-bit 4:2:0 (YUV420P and NV12) to RGB32 at the source size, BT.601 limited range
+// like swscale's default. Rows are converted with the widest kernel the CPU runs,
+// picked once at startup; every kernel gives the same bytes as the scalar one.
+class YuvToRgb
+{
+public:
+    static bool supports(int pixelFormat);
+    static SimdLevel level();
+    static const char* name(SimdLevel level);
+    // Scalar first, then every kernel this CPU runs
+    static std::vector<SimdLevel> levels();
+
+    // Rows [firstRow, endRow) of frame into dst, which points at row 0
+    static void convert(const AVFrame *frame, uint8_t *dst, int dstStride, int firstRow, int endRow);
+    static void convert(const AVFrame *frame, uint8_t *dst, int dstStride, int firstRow, int endRow, SimdLevel level);
+};
+
+#endif // YUV_TO_RGB_H